@@ -0,0 +1,403 @@
+/*
+ *  AAC inline RDS decoding worker
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  Some radio stations put the RDS data into the AAC frames, where only
+ *  the FFmpeg decoder finds it (as frame side data). Decoding AAC is by
+ *  far the most expensive thing ts2shout does, so the parser and the
+ *  decoder run in a worker thread. The payload is handed over through a
+ *  lock free ring (single producer, single consumer), the RDS data found
+ *  comes back through a second one and is handed to the RDS decoder by
+ *  the main thread. The audio output never waits for the decoder, payload
+ *  that doesn't fit into the ring is dropped (the parser resyncs).
+ *
+ *  Most stations don't send inline RDS at all. Therefore FFmpeg is only set
+ *  up after the LATM parser found UECP frames in the payload, and it is torn
+ *  down again if the decoder doesn't find RDS data for a while.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ts2shout.h"
+#include "rds.h"
+#include "aac_rds.h"
+#include "latm.h"
+
+#ifdef FFMPEG
+
+extern programm_info_t *global_state;
+
+static struct {
+	pthread_t worker;
+	uint8_t state;                          /* 0 = not started, 1 = running, 2 = failed, decode synchronously */
+	sem_t data_available;
+	atomic_int stop;
+	/* Payload, main thread -> worker */
+	unsigned char data[AAC_RDS_RING_SIZE];
+	atomic_uint data_head;                  /* written by the worker */
+	atomic_uint data_tail;                  /* written by the main thread */
+	uint64_t dropped_bytes;
+	/* RDS side data, worker -> main thread */
+	aac_rds_message_t message[AAC_RDS_MESSAGES];
+	atomic_uint message_head;               /* written by the main thread */
+	atomic_uint message_tail;               /* written by the worker */
+	uint32_t dropped_messages;
+	/* Lifecycle of the FFmpeg decoder (main thread) */
+	uint8_t open;                           /* FFmpeg is set up */
+	uint32_t uecp_frames;                   /* UECP frames of the LATM scan already seen */
+	uint64_t first_payload;                 /* time of the first payload */
+	uint64_t opened;                        /* time of the last setup */
+	uint64_t last_message;                  /* time of the last RDS data of the decoder */
+	uint64_t active;                        /* total time the decoder was set up */
+	uint32_t setups;
+	uint64_t setup_time;                    /* time needed for the last setup */
+	long setup_memory;                      /* resident memory the last setup needed */
+} aac_rds;
+
+static uint64_t now_us() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/* Resident memory in KByte, 0 if unknown */
+static long resident_kbyte() {
+	long size = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (! statm) {
+		return 0;
+	}
+	if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(statm);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Post the RDS data of a frame back to the main thread (worker) */
+static void message_push(const uint8_t* data, size_t size) {
+	unsigned int tail = atomic_load_explicit(&aac_rds.message_tail, memory_order_relaxed);
+	aac_rds_message_t* message;
+	if (size > AAC_RDS_MESSAGE_SIZE
+		|| tail - atomic_load_explicit(&aac_rds.message_head, memory_order_acquire) == AAC_RDS_MESSAGES) {
+		aac_rds.dropped_messages++;
+		return;
+	}
+	message = &aac_rds.message[tail & (AAC_RDS_MESSAGES - 1)];
+	memcpy(message->data, data, size);
+	message->size = size;
+	atomic_store_explicit(&aac_rds.message_tail, tail + 1, memory_order_release);
+	return;
+}
+
+static void aac_decode(AVCodecContext *dec_ctx, AVPacket *pkt, AVFrame *frame) {
+	int ret;
+	char	errstr[STR_BUF_SIZE];
+	/* send the packet with the compressed data to the decoder */
+	ret = avcodec_send_packet(dec_ctx, pkt);
+	if (ret < 0) {
+		av_strerror(ret, errstr, STR_BUF_SIZE);
+		output_logmessage("aac_decode(): Error submitting the packet to the decoder: %s\n", errstr);
+		return;
+	}
+	/* read all the output frames (in general there may be any number of them */
+	while (ret >= 0) {
+		AVFrameSideData* sd = NULL;
+		ret = avcodec_receive_frame(dec_ctx, frame);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+			return;
+		} else if (ret < 0) {
+			av_strerror(ret, errstr, STR_BUF_SIZE);
+			output_logmessage("aac_decode(): Error during decoding: %s\n", errstr);
+			return;
+		}
+		sd = av_frame_get_side_data(frame, AV_FRAME_DATA_RDS_DATA_PACKET);
+		if (sd) {
+			message_push(sd->data, sd->size);
+		}
+	}
+	return;
+}
+
+/* Run the parser over a piece of payload and decode the frames it finds,
+ * the parser keeps incomplete frames internally */
+static void parse_payload(const unsigned char* data, size_t size) {
+	avcodec_buffers_t* ffmpeg = &global_state->ffmpeg;
+	while (size > 0) {
+		int ret = av_parser_parse2(ffmpeg->parser, ffmpeg->c, &ffmpeg->pkt->data, &ffmpeg->pkt->size,
+			data, size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+		if (ret < 0) {
+			output_logmessage("parse_payload(): Error while parsing\n");
+			return;
+		}
+		data += ret;
+		size -= ret;
+		if (ffmpeg->pkt->size) {
+			aac_decode(ffmpeg->c, ffmpeg->pkt, ffmpeg->decoded_frame);
+		}
+	}
+	return;
+}
+
+/* Decode everything in the ring. The data is parsed in place, the space is
+ * given back to the main thread after the frames are decoded */
+static void drain_payload() {
+	unsigned int head = atomic_load_explicit(&aac_rds.data_head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&aac_rds.data_tail, memory_order_acquire);
+	while (head != tail) {
+		size_t offset = head & (AAC_RDS_RING_SIZE - 1);
+		size_t size = tail - head;
+		if (size > AAC_RDS_RING_SIZE - offset) {
+			size = AAC_RDS_RING_SIZE - offset;
+		}
+		parse_payload(aac_rds.data + offset, size);
+		head += size;
+		atomic_store_explicit(&aac_rds.data_head, head, memory_order_release);
+		tail = atomic_load_explicit(&aac_rds.data_tail, memory_order_acquire);
+	}
+	return;
+}
+
+static void* aac_rds_worker(void* arg) {
+	while (1) {
+		if (sem_wait(&aac_rds.data_available) < 0) {
+			continue;
+		}
+		drain_payload();
+		if (atomic_load_explicit(&aac_rds.stop, memory_order_acquire)) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Start the worker after FFmpeg is set up, all signals are handled by the main thread */
+static void aac_rds_start() {
+	sigset_t all_signals;
+	sigset_t old_signals;
+	if (aac_rds.state != 0) {
+		return;
+	}
+	atomic_store_explicit(&aac_rds.stop, 0, memory_order_relaxed);
+	if (sem_init(&aac_rds.data_available, 0, 0) < 0) {
+		aac_rds.state = 2;
+		return;
+	}
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	if (pthread_create(&aac_rds.worker, NULL, aac_rds_worker, NULL) != 0) {
+		output_logmessage("aac_rds_start(): Can't start the AAC decoder thread, decoding in the main thread\n");
+		sem_destroy(&aac_rds.data_available);
+		aac_rds.state = 2;
+	} else {
+		aac_rds.state = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	return;
+}
+
+/* Hand payload over to the decoder (main thread), never waits */
+static void aac_rds_feed(const unsigned char* data, size_t len) {
+	unsigned int tail = atomic_load_explicit(&aac_rds.data_tail, memory_order_relaxed);
+	size_t offset = tail & (AAC_RDS_RING_SIZE - 1);
+	size_t first = len;
+	if (len == 0) {
+		return;
+	}
+	if (aac_rds.state != 1) {
+		parse_payload(data, len);
+		return;
+	}
+	if (len > AAC_RDS_RING_SIZE - (tail - atomic_load_explicit(&aac_rds.data_head, memory_order_acquire))) {
+		if (aac_rds.dropped_bytes == 0) {
+			output_logmessage("aac_rds_feed(): AAC decoder too slow, dropping payload\n");
+		}
+		aac_rds.dropped_bytes += len;
+		return;
+	}
+	if (first > AAC_RDS_RING_SIZE - offset) {
+		first = AAC_RDS_RING_SIZE - offset;
+	}
+	memcpy(aac_rds.data + offset, data, first);
+	memcpy(aac_rds.data, data + first, len - first);
+	atomic_store_explicit(&aac_rds.data_tail, tail + len, memory_order_release);
+	sem_post(&aac_rds.data_available);
+	return;
+}
+
+/* Hand the RDS data found by the decoder to the RDS decoder (main thread) */
+static void aac_rds_poll() {
+	unsigned int head = atomic_load_explicit(&aac_rds.message_head, memory_order_relaxed);
+	while (head != atomic_load_explicit(&aac_rds.message_tail, memory_order_acquire)) {
+		aac_rds_message_t* message = &aac_rds.message[head & (AAC_RDS_MESSAGES - 1)];
+		rds_convert_from_ancillary_data(message->data, message->size);
+		aac_rds.last_message = now_us();
+		head++;
+		atomic_store_explicit(&aac_rds.message_head, head, memory_order_release);
+	}
+	return;
+}
+
+/* Let the worker decode what is left and end it */
+static void aac_rds_stop() {
+	if (aac_rds.state == 1) {
+		atomic_store_explicit(&aac_rds.stop, 1, memory_order_release);
+		sem_post(&aac_rds.data_available);
+		pthread_join(aac_rds.worker, NULL);
+		sem_destroy(&aac_rds.data_available);
+		aac_rds_poll();
+	}
+	aac_rds.state = 0;
+	return;
+}
+
+/* Set up the parser and the decoder and start the worker */
+static int aac_rds_open() {
+	avcodec_buffers_t* ffmpeg = &global_state->ffmpeg;
+	uint64_t start = now_us();
+	long memory = resident_kbyte();
+
+	ffmpeg->pkt = av_packet_alloc();
+	ffmpeg->codec = avcodec_find_decoder(AV_CODEC_ID_AAC_LATM);
+	if (! ffmpeg->codec) {
+		output_logmessage("avcodec_find_decoder(): Codec AV_CODEC_ID_AAC_LATM not found.\n");
+		return 0;
+	}
+	ffmpeg->parser = av_parser_init(ffmpeg->codec->id);
+	if (! ffmpeg->parser) {
+		output_logmessage("av_parser_init(): Parser for Codec not possible.\n");
+		return 0;
+	}
+	ffmpeg->c = avcodec_alloc_context3(ffmpeg->codec);
+	if (! ffmpeg->c) {
+		output_logmessage("avcodec_alloc_context3(): Could not allocate audio codec context.\n");
+		return 0;
+	}
+	if (avcodec_open2(ffmpeg->c, ffmpeg->codec, NULL) < 0) {
+		output_logmessage("avcodec_open2(): Could not open codec.\n");
+		return 0;
+	}
+	ffmpeg->decoded_frame = av_frame_alloc();
+	if (! ffmpeg->decoded_frame) {
+		output_logmessage("av_frame_alloc(): Could not allocate decoded frame space.\n");
+		return 0;
+	}
+	aac_rds_start();
+	aac_rds.open = 1;
+	aac_rds.setups++;
+	aac_rds.opened = now_us();
+	aac_rds.last_message = aac_rds.opened;
+	aac_rds.setup_time = aac_rds.opened - start;
+	aac_rds.setup_memory = resident_kbyte() - memory;
+	latm_uecp_scan(0);
+	output_logmessage("aac_rds_open(): UECP data found, FFmpeg decoder set up in %.1f ms (%ld KByte)\n",
+		aac_rds.setup_time / 1000.0, aac_rds.setup_memory);
+	return 1;
+}
+
+/* Stop the worker and free everything FFmpeg needs, the LATM scan takes over again */
+static void aac_rds_teardown() {
+	avcodec_buffers_t* ffmpeg = &global_state->ffmpeg;
+	if (aac_rds.open) {
+		aac_rds_stop();
+		aac_rds.active += now_us() - aac_rds.opened;
+		aac_rds.open = 0;
+	}
+	if (ffmpeg->parser) {
+		av_parser_close(ffmpeg->parser);
+		ffmpeg->parser = NULL;
+	}
+	avcodec_free_context(&ffmpeg->c);
+	av_frame_free(&ffmpeg->decoded_frame);
+	av_packet_free(&ffmpeg->pkt);
+	ffmpeg->codec = NULL;
+	latm_uecp_scan(1);
+	return;
+}
+
+/* Payload of an AAC-LATM stream with possible inline RDS (main thread) */
+void aac_rds_payload(const unsigned char* data, size_t len) {
+	uint64_t now = now_us();
+	/* The native LATM parser found the RDS data, no decoder needed */
+	if (latm_data_stream_elements() > 0) {
+		if (aac_rds.open) {
+			aac_rds_teardown();
+		}
+		return;
+	}
+	if (aac_rds.first_payload == 0) {
+		aac_rds.first_payload = now;
+		latm_uecp_scan(1);
+	}
+	if (! aac_rds.open) {
+		/* The scan runs in latm_parse(), after this payload was handed over */
+		if (latm_uecp_frames() == aac_rds.uecp_frames) {
+			return;
+		}
+		aac_rds.uecp_frames = latm_uecp_frames();
+		if (! aac_rds_open()) {
+			aac_rds_teardown();
+			/* Don't try it again and again */
+			latm_uecp_scan(0);
+			return;
+		}
+	}
+	aac_rds_feed(data, len);
+	aac_rds_poll();
+	/* The last message may be newer than now */
+	if (now > aac_rds.last_message
+		&& now - aac_rds.last_message > (uint64_t)global_state->aac_rds_idle * 1000000) {
+		output_logmessage("aac_rds_payload(): No inline RDS data for %d s, FFmpeg decoder torn down\n",
+			global_state->aac_rds_idle);
+		aac_rds_teardown();
+		aac_rds.uecp_frames = latm_uecp_frames();
+	}
+	return;
+}
+
+/* At exit: end the decoder and tell what it cost */
+void aac_rds_close() {
+	if (aac_rds.first_payload == 0) {
+		return;
+	}
+	aac_rds_teardown();
+	latm_uecp_scan(0);
+	if (aac_rds.setups == 0) {
+		output_logmessage("AAC inline RDS: no UECP data found, FFmpeg decoder never set up\n");
+	} else {
+		output_logmessage("AAC inline RDS: FFmpeg decoder set up %d time(s), active %.0f s of %.0f s, last setup %.1f ms (%ld KByte)\n",
+			aac_rds.setups, aac_rds.active / 1000000.0, (now_us() - aac_rds.first_payload) / 1000000.0,
+			aac_rds.setup_time / 1000.0, aac_rds.setup_memory);
+	}
+	if (aac_rds.dropped_bytes > 0 || aac_rds.dropped_messages > 0) {
+		output_logmessage("AAC inline RDS: %lu bytes of payload and %d RDS messages dropped\n",
+			aac_rds.dropped_bytes, aac_rds.dropped_messages);
+	}
+	return;
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ *  AAC inline RDS decoding worker header
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef _AAC_RDS_H
+#define _AAC_RDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Payload waiting for the decoder, a few seconds of AAC, must be a power of two */
+#define AAC_RDS_RING_SIZE       65536
+/* Default for the rdsidle option: seconds without inline RDS until the decoder is torn down */
+#define AAC_RDS_IDLE_TIMEOUT    120
+/* RDS data found by the decoder and not yet handed to the RDS decoder, must be a power of two */
+#define AAC_RDS_MESSAGES        16
+/* Maximum size of the RDS side data of one frame */
+#define AAC_RDS_MESSAGE_SIZE    1024
+
+typedef struct aac_rds_message_s {
+	uint16_t size;
+	uint8_t  data[AAC_RDS_MESSAGE_SIZE];
+} aac_rds_message_t;
+
+/* In aac_rds.c */
+#ifdef FFMPEG
+void aac_rds_payload(const unsigned char* data, size_t len);
+void aac_rds_close();
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ *  DVB (EN 300 468 Annex A) and RDS text to UTF-8 conversion header
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef _CHARSET_H
+#define _CHARSET_H
+
+#include <stddef.h>
+
+/* In charset.c, both return the length of the output (without the trailing 0) */
+size_t dvb_text_to_utf8(const unsigned char* in, size_t len, char* out, size_t out_size);
+size_t rds_text_to_utf8(const unsigned char* in, size_t len, char* out, size_t out_size);
+
+#endif
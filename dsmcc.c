@@ -22,502 +22,1326 @@
 */
 
 // #define DEBUG
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
 #include <zlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 
 #include "ts2shout.h"
 #include "rds.h"
 #include "dsmcc.h"
 
-#define CACHE_DIRECTORY "/var/tmp/cache"
-#define MAXDIRELEMENTS 200
+extern programm_info_t *global_state;
 
-/* Automatic variable, this way initialized with 0 */
+/* The modules of the carousel that are currently received, the chunk pool
+ * holding their data and the index of the BIOP objects */
+static struct {
+	uint32_t size;                          /* slots of the hash table, power of two */
+	uint32_t used;
+	module_buffer_t* module;
+	unsigned char* slab[DSMCC_MAX_SLABS];
+	uint16_t slabs;                         /* allocated slabs */
+	uint16_t* free_chunk;                   /* stack of free chunks */
+	uint16_t free_count;
+	uint32_t dropped_blocks;                /* blocks dropped because the pool was exhausted */
+	uint64_t skipped_blocks;                /* blocks of already decoded modules */
+	uint32_t objects_size;                  /* slots of the object index, power of two */
+	uint32_t objects_used;
+	dsmcc_object_t* object;
+	uint32_t carousel_id;                   /* downloadId of the DII, names the cache directory */
+	uint32_t dii_count;                     /* DIIs received */
+	uint32_t swept_modules;                 /* incomplete modules freed because the carousel dropped them */
+	/* The worker thread, it owns the object index and output */
+	uint32_t objects_carousel_id;           /* carousel the object index belongs to */
+	char output[80];                        /* temporary directory of the module being decoded, "" if nothing is written */
+	uint32_t unresolved;                    /* files of that module without a known path */
+	uint8_t output_error_shown;
+	pthread_t worker;
+	uint8_t worker_state;                   /* 0 = not started, 1 = running, 2 = failed, decode synchronously */
+	sem_t work_available;
+	dsmcc_queue_t work;                     /* jobs to the worker */
+	dsmcc_queue_t done;                     /* jobs back from the worker */
+	uint32_t in_flight;                     /* jobs not yet returned, at most DSMCC_WORKER_QUEUE_SIZE */
+	uint8_t  cached_in_flight;              /* one of them is the job of the modules found in the cache */
+	uint32_t dropped_modules;               /* completed modules dropped because the queue was full */
+} dsmcc;
 
-module_buffer_t * module_buffer[65535];
-dir_element_t dir_element[MAXDIRELEMENTS];
-uint16_t num_elements = 0;
+static unsigned char* chunk_data(uint16_t chunk) {
+	return dsmcc.slab[chunk / DSMCC_CHUNKS_PER_SLAB] + (chunk % DSMCC_CHUNKS_PER_SLAB) * DSMCC_CHUNK_SIZE;
+}
 
-void cleanup_download_data_block(module_buffer_t* single_module_buffer, uint16_t block_nr) {
-	if (single_module_buffer == NULL) {
-		return;
+/* Get a chunk out of the pool, returns DSMCC_NO_CHUNK if the pool is exhausted */
+static uint16_t chunk_alloc() {
+	if (dsmcc.free_count == 0) {
+		uint16_t i;
+		if (dsmcc.slabs == DSMCC_MAX_SLABS) {
+			return DSMCC_NO_CHUNK;
+		}
+		if (dsmcc.free_chunk == NULL) {
+			dsmcc.free_chunk = malloc(DSMCC_MAX_SLABS * DSMCC_CHUNKS_PER_SLAB * sizeof(uint16_t));
+		}
+		dsmcc.slab[dsmcc.slabs] = malloc(DSMCC_CHUNKS_PER_SLAB * DSMCC_CHUNK_SIZE);
+		if (dsmcc.free_chunk == NULL || dsmcc.slab[dsmcc.slabs] == NULL) {
+			return DSMCC_NO_CHUNK;
+		}
+		for (i = DSMCC_CHUNKS_PER_SLAB; i > 0; i--) {
+			dsmcc.free_chunk[dsmcc.free_count++] = dsmcc.slabs * DSMCC_CHUNKS_PER_SLAB + i - 1;
+		}
+		dsmcc.slabs++;
 	}
-	if (block_nr > MAX_BLOCKNR) {
-		output_logmessage("cleanup_download_data_block(): internal error, block_nr (%d) > %d, cannot handle\n", block_nr, MAX_BLOCKNR);
+	return dsmcc.free_chunk[--dsmcc.free_count];
+}
+
+static void chunk_free(uint16_t chunk) {
+	dsmcc.free_chunk[dsmcc.free_count++] = chunk;
+	return;
+}
+
+static int queue_push(dsmcc_queue_t* queue, dsmcc_job_t* job) {
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == DSMCC_WORKER_QUEUE_SIZE) {
+		return 0;
+	}
+	queue->job[tail & (DSMCC_WORKER_QUEUE_SIZE - 1)] = job;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+static dsmcc_job_t* queue_pop(dsmcc_queue_t* queue) {
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	dsmcc_job_t* job;
+	if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+		return NULL;
+	}
+	job = queue->job[head & (DSMCC_WORKER_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return job;
+}
+
+static module_buffer_t* module_lookup(uint16_t module_nr) {
+	uint32_t i = ((module_nr * 2654435769u) >> 16) & (dsmcc.size - 1);
+	while (dsmcc.module[i].used) {
+		if (dsmcc.module[i].module_number == module_nr) {
+			return &dsmcc.module[i];
+		}
+		i = (i + 1) & (dsmcc.size - 1);
+	}
+	return &dsmcc.module[i];
+}
+
+/* Find a module, NULL if nothing of it has been received yet */
+static module_buffer_t* module_find(uint16_t module_nr) {
+	module_buffer_t* single_module_buffer;
+	if (dsmcc.size == 0) {
+		return NULL;
+	}
+	single_module_buffer = module_lookup(module_nr);
+	return (single_module_buffer->used ? single_module_buffer : NULL);
+}
+
+/* Find or add a module. Adding may move the other modules in memory */
+static module_buffer_t* module_add(uint16_t module_nr) {
+	module_buffer_t* single_module_buffer;
+	if (dsmcc.size == 0) {
+		dsmcc.size = DSMCC_MODULES_INITIAL_SIZE;
+		dsmcc.module = calloc(dsmcc.size, sizeof(module_buffer_t));
+	}
+	single_module_buffer = module_lookup(module_nr);
+	if (single_module_buffer->used) {
+		return single_module_buffer;
+	}
+	/* Keep the load factor below 3/4 */
+	if ((dsmcc.used + 1) * 4 > dsmcc.size * 3) {
+		module_buffer_t* old = dsmcc.module;
+		uint32_t old_size = dsmcc.size;
+		uint32_t i;
+		dsmcc.size *= 2;
+		dsmcc.module = calloc(dsmcc.size, sizeof(module_buffer_t));
+		for (i = 0; i < old_size; i++) {
+			if (old[i].used) {
+				*module_lookup(old[i].module_number) = old[i];
+			}
+		}
+		free(old);
+		single_module_buffer = module_lookup(module_nr);
+	}
+	single_module_buffer->used = 1;
+	single_module_buffer->module_number = module_nr;
+	dsmcc.used++;
+	return single_module_buffer;
+}
+
+void cleanup_download_data_block(module_buffer_t* single_module_buffer, uint16_t block_nr) {
+	if (single_module_buffer == NULL || block_nr >= single_module_buffer->block_count) {
 		return;
 	}
-	if (single_module_buffer->buffer[block_nr] != NULL) {
-		free(single_module_buffer->buffer[block_nr]);
-		single_module_buffer->buffer[block_nr] = NULL;
+	if (single_module_buffer->block[block_nr].chunk != DSMCC_NO_CHUNK) {
+		chunk_free(single_module_buffer->block[block_nr].chunk);
+		single_module_buffer->block[block_nr].chunk = DSMCC_NO_CHUNK;
+		single_module_buffer->received -= single_module_buffer->block[block_nr].size;
 	}
-	single_module_buffer->block_size[block_nr] = 0;
-	single_module_buffer->valid = 0;
+	single_module_buffer->block[block_nr].size = 0;
 	return;
 }
 
+/* Free all blocks of a module, the module itself stays known */
 void cleanup_download_module_buffer(module_buffer_t* single_module_buffer) {
-	uint16_t i = 0;
+	uint32_t i = 0;
 	if (single_module_buffer == NULL) {
 		return;
 	}
-	for (i = 0; i < MAX_BLOCKNR; i++) {
+	for (i = 0; i < single_module_buffer->block_count; i++) {
 		cleanup_download_data_block(single_module_buffer, i);
 	}
-	single_module_buffer->data_size = 0;
-	single_module_buffer->max_blocknr = 0;
+	single_module_buffer->received = 0;
 }
 
-void add_direlement(uint64_t id, const char* filename, uint8_t* object_key, uint8_t object_key_length, modetype_t mode) {
-	#ifdef DEBUG
-	if (mode == FILETYPE) {
-		fprintf(stderr, "add_direlement(): 0x%lx, %s (num: %d), object_key: 0x%02x%02x (length: %d)\n", id, filename, num_elements, object_key[0], object_key[1], object_key_length);
-	} else {
-		fprintf(stderr, "add_direlement(): 0x%lx, %s (num: %d) (Dirmode, object_key_len: %d)\n", id, filename, num_elements, object_key_length);
+/* Free the blocks of incomplete modules the carousel doesn't carry any longer:
+ * modules this DII listed before but doesn't list now and modules no DII has
+ * listed for DSMCC_UNLISTED_DIIS DIIs. Decoded modules hold no blocks. */
+static void module_sweep(uint16_t dii) {
+	uint32_t i;
+	for (i = 0; i < dsmcc.size; i++) {
+		module_buffer_t* single_module_buffer = &dsmcc.module[i];
+		if (! single_module_buffer->used || single_module_buffer->received == 0) {
+			continue;
+		}
+		if (single_module_buffer->listed ? (single_module_buffer->dii == dii && single_module_buffer->dii_seen != dsmcc.dii_count)
+				: (dsmcc.dii_count - single_module_buffer->dii_seen > DSMCC_UNLISTED_DIIS)) {
+			cleanup_download_module_buffer(single_module_buffer);
+			dsmcc.swept_modules++;
+		}
 	}
-	#endif
-	if (object_key_length > 2) {
-		assert(object_key_length <= 2);
-		return;
+	return;
+}
+
+/* Forget all modules, e.g. of a carousel with another downloadId */
+static void module_clear() {
+	uint32_t i;
+	for (i = 0; i < dsmcc.size; i++) {
+		cleanup_download_module_buffer(&dsmcc.module[i]);
+		free(dsmcc.module[i].block);
 	}
-	/* Directory without object_key_length */
-	if ( (mode = DIRTYPE || mode == TOPLEVELDIRTYPE) && object_key_length == 0) {
-		for ( uint16_t i = 0; i < num_elements; i++) {
-			if (dir_element[i].object_id == id) {
-				strncpy(dir_element[i].filename, filename, sizeof(dir_element[i].filename)-1);
-				dir_element[i].filename[sizeof(dir_element[i].filename)-1] = '\0';
-				dir_element[i].mode = mode;
-				return;
+	if (dsmcc.size > 0) {
+		memset(dsmcc.module, 0, dsmcc.size * sizeof(module_buffer_t));
+	}
+	dsmcc.used = 0;
+	return;
+}
+
+static dsmcc_object_t* object_lookup(uint64_t id) {
+	uint32_t i = (uint32_t)((id * 0x9e3779b97f4a7c15ull) >> 40) & (dsmcc.objects_size - 1);
+	while (dsmcc.object[i].used) {
+		if (dsmcc.object[i].id == id) {
+			return &dsmcc.object[i];
+		}
+		i = (i + 1) & (dsmcc.objects_size - 1);
+	}
+	return &dsmcc.object[i];
+}
+
+/* Find an object of the index, NULL if it is unknown */
+static dsmcc_object_t* object_find(uint64_t id) {
+	dsmcc_object_t* object;
+	if (dsmcc.objects_size == 0) {
+		return NULL;
+	}
+	object = object_lookup(id);
+	return (object->used ? object : NULL);
+}
+
+/* Find or add an object. Adding may move the other objects in memory */
+static dsmcc_object_t* object_add(uint64_t id) {
+	dsmcc_object_t* object;
+	if (dsmcc.objects_size == 0) {
+		dsmcc.objects_size = DSMCC_OBJECTS_INITIAL_SIZE;
+		dsmcc.object = calloc(dsmcc.objects_size, sizeof(dsmcc_object_t));
+	}
+	object = object_lookup(id);
+	if (object->used) {
+		return object;
+	}
+	/* Keep the load factor below 3/4 */
+	if ((dsmcc.objects_used + 1) * 4 > dsmcc.objects_size * 3) {
+		dsmcc_object_t* old = dsmcc.object;
+		uint32_t old_size = dsmcc.objects_size;
+		uint32_t i;
+		dsmcc.objects_size *= 2;
+		dsmcc.object = calloc(dsmcc.objects_size, sizeof(dsmcc_object_t));
+		for (i = 0; i < old_size; i++) {
+			if (old[i].used) {
+				*object_lookup(old[i].id) = old[i];
 			}
 		}
-		/* Add new element */
-		if ( num_elements < MAXDIRELEMENTS ) {
-			dir_element[num_elements].object_key_length = object_key_length;
-			dir_element[num_elements].object_id = id;
-			strncpy(dir_element[num_elements].filename, filename, sizeof(dir_element[num_elements].filename)-1);
-			dir_element[num_elements].filename[sizeof(dir_element[num_elements].filename)-1] = '\0';
-			dir_element[num_elements].mode = mode;
-	        num_elements++;
+		free(old);
+		object = object_lookup(id);
+	}
+	object->used = 1;
+	object->id = id;
+	object->mode = FILETYPE;
+	dsmcc.objects_used++;
+	return object;
+}
+
+/* Remember the name of an object in a directory */
+static void object_link(uint64_t child, uint64_t directory, modetype_t mode, const char* name) {
+	dsmcc_object_t* object = object_add(child);
+	object->mode = mode;
+	object->parent = directory;
+	object->linked = 1;
+	if (object->name == NULL || strcmp(object->name, name) != 0) {
+		free(object->name);
+		object->name = strdup(name);
+		if (object->name == NULL) {
+			object->linked = 0;
+		}
+	}
+	return;
+}
+
+/* Forget all objects, they belong to another carousel (worker) */
+static void object_clear() {
+	uint32_t i;
+	for (i = 0; i < dsmcc.objects_size; i++) {
+		free(dsmcc.object[i].name);
+	}
+	if (dsmcc.objects_size > 0) {
+		memset(dsmcc.object, 0, dsmcc.objects_size * sizeof(dsmcc_object_t));
+	}
+	dsmcc.objects_used = 0;
+	return;
+}
+
+/* The path of an object relative to the service gateway, returns 0 if
+ * a directory on the way is not (yet) known */
+static int object_path(uint64_t id, char* path, size_t size) {
+	const char* component[DSMCC_MAX_PATH_DEPTH];
+	dsmcc_object_t* object = object_find(id);
+	int depth = 0;
+	size_t pos = 0;
+	while (object && object->mode != TOPLEVELDIRTYPE) {
+		if (! object->linked || depth == DSMCC_MAX_PATH_DEPTH) {
+			return 0;
+		}
+		component[depth++] = object->name;
+		object = object_find(object->parent);
+	}
+	if (object == NULL || depth == 0) {
+		return 0;
+	}
+	while (depth > 0) {
+		depth--;
+		pos += snprintf(path + pos, size - pos, "%s%s", (pos > 0 ? "/" : ""), component[depth]);
+		if (pos >= size) {
+			return 0;
 		}
+	}
+	return 1;
+}
+
+/* The object key as number, DVB allows at most 4 bytes */
+static int object_key_read(const unsigned char* key, uint8_t key_length, uint32_t* result) {
+	uint8_t i;
+	if (key_length > DSMCC_MAX_OBJECT_KEY_LENGTH) {
+		return 0;
+	}
+	*result = 0;
+	for (i = 0; i < key_length; i++) {
+		*result = (*result << 8) | key[i];
+	}
+	return 1;
+}
+
+/* The cache directory of a module version, relative to DSMCC_CACHE_DIRECTORY.
+ * A module directory only appears complete, it is renamed from a temporary
+ * directory after all objects of the module have been written. */
+static void module_directory(char* directory, size_t size, uint32_t carousel_id, uint16_t module_nr, uint8_t version) {
+	snprintf(directory, size, "%08x/%04x-%02x", carousel_id, module_nr, version);
+	return;
+}
+
+/* Has this or another process already decoded the module version? Used by
+ * both threads, the worker passes the carousel of its job */
+static int module_cached(uint32_t carousel_id, uint16_t module_nr, uint8_t version) {
+	char path[256];
+	struct stat module_stat;
+	snprintf(path, sizeof(path), DSMCC_CACHE_DIRECTORY "/%08x/%04x-%02x/" DSMCC_INDEX_FILE, carousel_id, module_nr, version);
+	return (stat(path, &module_stat) == 0 && S_ISREG(module_stat.st_mode));
+}
+
+/* Write the directories of the module being decoded and their bindings
+ * to its index file, one per line (worker):
+ *   o <object id> <mode>
+ *   b <object id> <directory id> <mode> <name> */
+static void module_index_write(uint16_t module_nr) {
+	char filename[128];
+	uint32_t i;
+	FILE* f;
+	if (dsmcc.output[0] == '\0') {
 		return;
 	}
-	/* change already existing element */
-	for ( uint16_t i = 0; i < num_elements; i++) {
-		if (dir_element[i].object_id == id) {
-			if (memcmp(&dir_element[i].object_key, object_key, object_key_length) == 0) {
-				strncpy(dir_element[i].filename, filename, sizeof(dir_element[i].filename)-1);
-				dir_element[i].filename[sizeof(dir_element[i].filename)-1] = '\0';
-				dir_element[i].mode = mode;
-				return;
+	snprintf(filename, sizeof(filename), "%s/" DSMCC_INDEX_FILE, dsmcc.output);
+	f = fopen(filename, "w");
+	if (! f) {
+		return;
+	}
+	for (i = 0; i < dsmcc.objects_size; i++) {
+		dsmcc_object_t* object = &dsmcc.object[i];
+		if (! object->used) {
+			continue;
+		}
+		if ((object->id >> 40) == module_nr && object->mode != FILETYPE) {
+			fprintf(f, "o %lx %d\n", object->id, object->mode);
+		}
+		if (object->linked && (object->parent >> 40) == module_nr) {
+			fprintf(f, "b %lx %lx %d %s\n", object->id, object->parent, object->mode, object->name);
+		}
+	}
+	fclose(f);
+	return;
+}
+
+/* Add the directories of a cached module to the object index (worker) */
+static void module_index_load(uint32_t carousel_id, uint16_t module_nr, uint8_t version) {
+	char filename[256];
+	char line[512];
+	FILE* f;
+	snprintf(filename, sizeof(filename), DSMCC_CACHE_DIRECTORY "/%08x/%04x-%02x/" DSMCC_INDEX_FILE, carousel_id, module_nr, version);
+	f = fopen(filename, "r");
+	if (! f) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char* pos = line + 1;
+		uint64_t id;
+		uint64_t directory = 0;
+		long mode;
+		line[strcspn(line, "\n")] = '\0';
+		id = strtoull(pos, &pos, 16);
+		if (line[0] == 'b') {
+			directory = strtoull(pos, &pos, 16);
+		}
+		mode = strtol(pos, &pos, 10);
+		if (mode < TOPLEVELDIRTYPE || mode > FILETYPE) {
+			continue;
+		}
+		if (line[0] == 'o') {
+			object_add(id)->mode = mode;
+		} else if (line[0] == 'b' && pos[0] == ' ' && pos[1] != '\0') {
+			object_link(id, directory, mode, pos + 1);
+		}
+	}
+	fclose(f);
+	return;
+}
+
+/* Remove a module directory with its subdirectories */
+static void remove_directory(const char* path) {
+	char filename[1024];
+	struct dirent* entry;
+	struct stat file_stat;
+	DIR* dir = opendir(path);
+	if (dir == NULL) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+			snprintf(filename, sizeof(filename), "%s/%s", path, entry->d_name);
+			if (lstat(filename, &file_stat) == 0 && S_ISDIR(file_stat.st_mode)) {
+				remove_directory(filename);
+			} else {
+				unlink(filename);
 			}
 		}
 	}
-	/* Add new element */
-	if ( num_elements < MAXDIRELEMENTS ) {
-		memcpy(&dir_element[num_elements].object_key, object_key, object_key_length);
-		dir_element[num_elements].object_key_length = object_key_length;
+	closedir(dir);
+	rmdir(path);
+	return;
+}
+
+/* A station logo is an image with "logo" in its name */
+static int is_logo(const char* name) {
+	const char* extension = strrchr(name, '.');
+	if (extension == NULL || strcasestr(name, "logo") == NULL) {
+		return 0;
+	}
+	return (strcasecmp(extension, ".png") == 0 || strcasecmp(extension, ".jpg") == 0
+		|| strcasecmp(extension, ".jpeg") == 0 || strcasecmp(extension, ".gif") == 0);
+}
 
-        dir_element[num_elements].object_id = id;
-        strncpy(dir_element[num_elements].filename, filename, sizeof(dir_element[num_elements].filename)-1);
-        dir_element[num_elements].filename[sizeof(dir_element[num_elements].filename)-1] = '\0';
-		dir_element[num_elements].mode = mode;
-        num_elements++;
-    }
+/* Search a logo in a directory of the cache and its subdirectories,
+ * path is relative to DSMCC_CACHE_DIRECTORY */
+static int find_logo(const char* path, char* logo, size_t size, int depth) {
+	char filename[1024];
+	struct dirent* entry;
+	struct stat file_stat;
+	DIR* dir;
+	int found = 0;
+	snprintf(filename, sizeof(filename), DSMCC_CACHE_DIRECTORY "/%s", path);
+	dir = opendir(filename);
+	if (dir == NULL) {
+		return 0;
+	}
+	while (! found && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(filename, sizeof(filename), DSMCC_CACHE_DIRECTORY "/%s/%s", path, entry->d_name);
+		if (lstat(filename, &file_stat) < 0) {
+			continue;
+		}
+		if (S_ISREG(file_stat.st_mode) && is_logo(entry->d_name)) {
+			snprintf(logo, size, "%s/%s", path, entry->d_name);
+			found = 1;
+		} else if (S_ISDIR(file_stat.st_mode) && depth < DSMCC_MAX_PATH_DEPTH) {
+			snprintf(filename, sizeof(filename), "%s/%s", path, entry->d_name);
+			found = find_logo(filename, logo, size, depth + 1);
+		}
+	}
+	closedir(dir);
+	return found;
+}
+
+/* Look for the station logo in a decoded module (worker) */
+static int module_logo_lookup(dsmcc_job_t* job, uint16_t module_nr, uint8_t version) {
+	char directory[32];
+	module_directory(directory, sizeof(directory), job->carousel_id, module_nr, version);
+	if (! find_logo(directory, job->logo, sizeof(job->logo), 0)) {
+		job->logo[0] = '\0';
+		return 0;
+	}
+	return 1;
+}
+
+/* Announce the logo found by the worker, a logo of an older version of the module is withdrawn */
+static void module_logo_apply(dsmcc_job_t* job) {
+	char directory[32];
+	if (job->logo[0] != '\0') {
+		if (set_stream_logo(job->logo)) {
+			output_logmessage("DSM-CC: station logo %s\n", job->logo);
+		}
+		return;
+	}
+	if (job->cached) {
+		return;
+	}
+	snprintf(directory, sizeof(directory), "%08x/%04x-", job->carousel_id, job->module.module_number);
+	if (strncmp(global_state->stream_logo, directory, strlen(directory)) == 0) {
+		set_stream_logo("");
+	}
 	return;
 }
 
-char *get_filename(uint64_t id, uint8_t* object_key, uint8_t* object_key_length, modetype_t mode) {
-	if (mode == FILETYPE) {
-		for ( uint16_t i = 0; i < num_elements; i++) {
-			if (dir_element[i].object_id == id) {
-				memcpy(object_key_length, &dir_element[i].object_key_length, sizeof(uint8_t));
-				memcpy(object_key, &dir_element[i].object_key, dir_element[i].object_key_length);
-				return dir_element[i].filename;
+/* Create the temporary directory the objects of a module are written to */
+static void module_output_begin(dsmcc_job_t* job) {
+	char path[64];
+	dsmcc.output[0] = '\0';
+	snprintf(path, sizeof(path), DSMCC_CACHE_DIRECTORY "/%08x", job->carousel_id);
+	if (   (mkdir(DSMCC_CACHE_DIRECTORY, 0755) < 0 && errno != EEXIST)
+		|| (mkdir(path, 0755) < 0 && errno != EEXIST) ) {
+		if (! dsmcc.output_error_shown) {
+			output_logmessage("module_output_begin(): Can't create %s: %s\n", path, strerror(errno));
+			dsmcc.output_error_shown = 1;
+		}
+		return;
+	}
+	snprintf(dsmcc.output, sizeof(dsmcc.output), "%s/.%04x-%02x.XXXXXX", path, job->module.module_number,
+		job->module.version);
+	if (mkdtemp(dsmcc.output) == NULL) {
+		if (! dsmcc.output_error_shown) {
+			output_logmessage("module_output_begin(): Can't create %s: %s\n", dsmcc.output, strerror(errno));
+			dsmcc.output_error_shown = 1;
+		}
+		dsmcc.output[0] = '\0';
+		return;
+	}
+	/* mkdtemp uses 0700, the web server should be able to serve the files */
+	chmod(dsmcc.output, 0755);
+	return;
+}
+
+/* Rename the temporary directory to the module directory and remove the
+ * older versions of the module. If another process has been faster its
+ * directory is kept and ours is thrown away. */
+static void module_output_publish(dsmcc_job_t* job) {
+	char directory[32];
+	char path[64];
+	char prefix[8];
+	struct dirent* entry;
+	DIR* dir;
+	if (dsmcc.output[0] == '\0') {
+		return;
+	}
+	module_directory(directory, sizeof(directory), job->carousel_id, job->module.module_number, job->module.version);
+	snprintf(path, sizeof(path), DSMCC_CACHE_DIRECTORY "/%s", directory);
+	if (rename(dsmcc.output, path) < 0) {
+		/* A directory without index is left over by an older ts2shout */
+		if (! module_cached(job->carousel_id, job->module.module_number, job->module.version)) {
+			remove_directory(path);
+		}
+		if (rename(dsmcc.output, path) < 0) {
+			remove_directory(dsmcc.output);
+		}
+	}
+	dsmcc.output[0] = '\0';
+	snprintf(path, sizeof(path), DSMCC_CACHE_DIRECTORY "/%08x", job->carousel_id);
+	snprintf(prefix, sizeof(prefix), "%04x-", job->module.module_number);
+	dir = opendir(path);
+	if (dir != NULL) {
+		while ((entry = readdir(dir)) != NULL) {
+			if (strncmp(entry->d_name, prefix, 5) == 0 && strcmp(entry->d_name, strchr(directory, '/') + 1) != 0) {
+				char old[512];
+				snprintf(old, sizeof(old), "%s/%s", path, entry->d_name);
+				remove_directory(old);
 			}
 		}
-	} else {
-		/* Dirname */
+		closedir(dir);
 	}
-	return 0;
+	module_logo_lookup(job, job->module.module_number, job->module.version);
+	return;
+}
+
+/* Check the header of a section: download data blocks of modules that are
+ * already decoded in the same version are not needed. The carousel repeats
+ * endlessly, this keeps the steady state cost low. */
+int dsmcc_section_wanted(unsigned char *buf) {
+	module_buffer_t* single_module_buffer;
+	if (DSMCC_MESSAGE_TYPE(buf) != 0x3c) {
+		return 1;
+	}
+	single_module_buffer = module_find(DSMCC_MODULE_ID(buf));
+	if (single_module_buffer && single_module_buffer->decoded && single_module_buffer->decoded_version == DSMCC_MODULE_VERSION(buf)) {
+		dsmcc.skipped_blocks++;
+		return 0;
+	}
+	return 1;
 }
 
 void handle_download_data_block(unsigned char *buf, size_t len) {
 	uint16_t module_nr;
 	uint16_t block_nr;
+	uint16_t block_size;
+	module_buffer_t* single_module_buffer;
 	if (DSMCC_MESSAGE_TYPE(buf) != 0x3c) {
 		output_logmessage("handle_download_data_block(): internal error, called with wrong message type 0x%x\n", DSMCC_MESSAGE_TYPE(buf));
 		return;
 	}
+	if (DSMCC_MESSAGE_SIZE(buf) < 6 || DSMCC_MESSAGE_SIZE(buf) - 6 > DSMCC_CHUNK_SIZE || DSMCC_MESSAGE_SIZE(buf) + 20 > len) {
+		return;
+	}
 	module_nr = DSMCC_MODULE_ID(buf);
 	block_nr  = DSMCC_BLOCKNR(buf);
-	if (module_buffer[module_nr] == NULL) {
-		module_buffer[module_nr] = calloc(1,sizeof(module_buffer));
+	block_size = DSMCC_MESSAGE_SIZE(buf) - 6;
+	single_module_buffer = module_add(module_nr);
+	if (single_module_buffer->decoded && single_module_buffer->decoded_version == DSMCC_MODULE_VERSION(buf)) {
+		return;
+	}
+	/* A new version of the module, the blocks of the old version are useless */
+	if (single_module_buffer->version != DSMCC_MODULE_VERSION(buf)) {
+		cleanup_download_module_buffer(single_module_buffer);
+		single_module_buffer->version = DSMCC_MODULE_VERSION(buf);
+		single_module_buffer->deferred = 0;
+	}
+	/* Not listed by a DII (yet), the time to live starts with its first block */
+	if (! single_module_buffer->listed && single_module_buffer->received == 0) {
+		single_module_buffer->dii_seen = dsmcc.dii_count;
+	}
+	if (block_nr >= single_module_buffer->block_count) {
+		/* Grow the block list, double it to keep reallocations rare */
+		uint32_t count = single_module_buffer->block_count * 2;
+		uint32_t i;
+		dsmcc_block_t* block;
+		if (count <= block_nr) {
+			count = block_nr + 1;
+		}
+		block = realloc(single_module_buffer->block, count * sizeof(dsmcc_block_t));
+		if (block == NULL) {
+			return;
+		}
+		for (i = single_module_buffer->block_count; i < count; i++) {
+			block[i].chunk = DSMCC_NO_CHUNK;
+			block[i].size = 0;
+		}
+		single_module_buffer->block = block;
+		single_module_buffer->block_count = count;
+	}
+	if (single_module_buffer->block[block_nr].chunk == DSMCC_NO_CHUNK) {
+		uint16_t chunk = chunk_alloc();
+		if (chunk == DSMCC_NO_CHUNK) {
+			if (dsmcc.dropped_blocks++ == 0) {
+				output_logmessage("handle_download_data_block(): DSM-CC memory limit of %d kB reached, dropping blocks\n",
+					DSMCC_MAX_SLABS * DSMCC_CHUNKS_PER_SLAB * DSMCC_CHUNK_SIZE / 1024);
+			}
+			return;
+		}
+		single_module_buffer->block[block_nr].chunk = chunk;
+	} else {
+		single_module_buffer->received -= single_module_buffer->block[block_nr].size;
 	}
-	if (block_nr > MAX_BLOCKNR) {
-		output_logmessage("handle_download_data_block(): internal error, block_nr (%d) > %d, cannot handle\n", block_nr, MAX_BLOCKNR);
+	single_module_buffer->block[block_nr].size = block_size;
+	single_module_buffer->received += block_size;
+	memcpy(chunk_data(single_module_buffer->block[block_nr].chunk), DSMCC_MESSAGE(buf), block_size);
+	return;
+}
+
+/* Remember the objects a directory (or the service gateway) binds to names.
+ * The objects are found by the ObjectLocation of their IOR. */
+static void biop_directory_bindings(uint64_t directory, unsigned char* current_pos, unsigned char* end) {
+	uint16_t bindings_count;
+	uint16_t i;
+	if (current_pos + 2 > end) {
 		return;
 	}
-	module_buffer[module_nr]->module_number = module_nr;
-	if ( (DSMCC_MESSAGE_SIZE(buf) - 6) != module_buffer[module_nr]->block_size[block_nr]) {
-		if ( module_buffer[module_nr]->block_size[block_nr] > 0 ) {
-			cleanup_download_data_block(module_buffer[module_nr], block_nr);
+	bindings_count = DSMCC_MODULE_FETCH16BITVAL(current_pos);
+	current_pos += 2;
+	for (i = 0; i < bindings_count; i++) {
+		char name[256] = "";
+		unsigned char* kind = NULL;
+		uint8_t components;
+		uint8_t j;
+		uint32_t type_id_length;
+		uint32_t profiles_count;
+		uint32_t k;
+		uint64_t child = 0;
+		uint8_t child_found = 0;
+		modetype_t mode;
+		char* c;
+		/* BIOP::Name, DVB uses exactly one name component */
+		if (current_pos + 1 > end) {
+			return;
+		}
+		components = current_pos[0];
+		current_pos++;
+		for (j = 0; j < components; j++) {
+			uint8_t id_length;
+			uint8_t kind_length;
+			if (current_pos + 1 > end || current_pos + 2 + current_pos[0] > end) {
+				return;
+			}
+			id_length = current_pos[0];
+			snprintf(name, sizeof(name), "%.*s", id_length, current_pos + 1);
+			current_pos += 1 + id_length;
+			kind_length = current_pos[0];
+			if (current_pos + 1 + kind_length > end) {
+				return;
+			}
+			kind = (kind_length >= 3 ? current_pos + 1 : NULL);
+			current_pos += 1 + kind_length;
+		}
+		/* binding_type, IOR::IOR type_id */
+		if (current_pos + 5 > end) {
+			return;
+		}
+		type_id_length = DSMCC_MODULE_FETCH32BITVAL((current_pos + 1));
+		if (type_id_length > end - current_pos - 5 || current_pos + 9 + type_id_length > end) {
+			return;
 		}
-		module_buffer[module_nr]->block_size[block_nr] = DSMCC_MESSAGE_SIZE(buf) - 6;
-		module_buffer[module_nr]->buffer[block_nr] = malloc(DSMCC_MESSAGE_SIZE(buf));
+		current_pos += 5 + type_id_length;
+		profiles_count = DSMCC_MODULE_FETCH32BITVAL(current_pos);
+		current_pos += 4;
+		for (k = 0; k < profiles_count; k++) {
+			uint32_t profile_tag;
+			uint32_t profile_data_length;
+			if (current_pos + 8 > end) {
+				return;
+			}
+			profile_tag = DSMCC_MODULE_FETCH32BITVAL(current_pos);
+			profile_data_length = DSMCC_MODULE_FETCH32BITVAL((current_pos + 4));
+			current_pos += 8;
+			if (profile_data_length > end - current_pos) {
+				return;
+			}
+			/* BIOPProfileBody: byte_order, lite_components_count, the first one is the ObjectLocation */
+			if (profile_tag == DSMCC_TAG_BIOP_PROFILE && profile_data_length >= 15
+					&& DSMCC_MODULE_FETCH32BITVAL((current_pos + 2)) == DSMCC_TAG_OBJECT_LOCATION) {
+				unsigned char* location = current_pos + 7;
+				uint32_t object_key;
+				if (location + 9 <= current_pos + profile_data_length && location + 9 + location[8] <= current_pos + profile_data_length
+						&& object_key_read(location + 9, location[8], &object_key)) {
+					child = DSMCC_OBJECT_ID(DSMCC_MODULE_FETCH16BITVAL((location + 4)), location[8], object_key);
+					child_found = 1;
+				}
+			}
+			current_pos += profile_data_length;
+		}
+		/* objectInfo, for files the content size */
+		if (current_pos + 2 > end || current_pos + 2 + DSMCC_MODULE_FETCH16BITVAL(current_pos) > end) {
+			return;
+		}
+		current_pos += 2 + DSMCC_MODULE_FETCH16BITVAL(current_pos);
+		if (kind != NULL && strncmp((char*)kind, "fil", 3) == 0) {
+			mode = FILETYPE;
+		} else if (kind != NULL && strncmp((char*)kind, "dir", 3) == 0) {
+			mode = DIRTYPE;
+		} else {
+			/* Streams and stream events are no files */
+			continue;
+		}
+		/* The name comes from the broadcast, it has to stay inside the cache directory */
+		if (! child_found || name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+		/* The path ends up quoted in the ICY metadata (StreamUrl='...';) */
+		for (c = name; *c; c++) {
+			if (*c == '/' || *c == '\'' || *c == ';' || (unsigned char)*c < 0x20 || *c == 0x7f) {
+				*c = '_';
+			}
+		}
+		#ifdef DEBUG
+		fprintf(stderr, "biop_directory_bindings(): 0x%lx: %s -> 0x%lx (%s)\n", directory, name, child, (mode == FILETYPE ? "file" : "directory"));
+		#endif
+		object_link(child, directory, mode, name);
 	}
-	memcpy(module_buffer[module_nr]->buffer[block_nr], DSMCC_MESSAGE(buf), DSMCC_MESSAGE_SIZE(buf) - 6);
 	return;
 }
 
-/* Decode BIOP Files
+/* Write the content of a file object to the temporary module directory, by
+ * its path if the directories are known, otherwise by module and object key */
+static void biop_file_write(uint64_t id, uint16_t module_nr, uint32_t object_key, unsigned char* content, uint32_t content_length) {
+	char filename[512];
+	char path[384];
+	size_t length;
+	FILE* f;
+	static uint8_t errorshown = 0; /* Show filesystem errors only once */
+	if (dsmcc.output[0] == '\0') {
+		return;
+	}
+	if (object_path(id, path, sizeof(path))) {
+		char* slash;
+		length = strlen(dsmcc.output);
+		snprintf(filename, sizeof(filename), "%s/%s", dsmcc.output, path);
+		for (slash = strchr(filename + length + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+			*slash = '\0';
+			mkdir(filename, 0755);
+			*slash = '/';
+		}
+	} else {
+		snprintf(filename, sizeof(filename), "%s/File-Module-0x%02x-ObjectKey-0x%02x.data", dsmcc.output, module_nr, object_key);
+		dsmcc.unresolved++;
+	}
+	#ifdef DEBUG
+	fprintf(stderr, "biop_file_write(): Module 0x%x, BIOP File, writing to %s\n", module_nr, filename);
+	#endif
+	f = fopen(filename, "w");
+	if (! f) {
+		if (! errorshown) {
+			output_logmessage("biop_file_write(): fopen(): %s: %s\n", filename, strerror(errno));
+			errorshown = 1;
+		}
+		return;
+	}
+	fwrite(content, 1, content_length, f);
+	fclose(f);
+	return;
+}
+
+/* Decode BIOP messages
  * See ETSI TR 101 202 V1.2.1
  * buffer = pointer to first byte in module buffer
- * offset = initially 0, increment to next BIOP header if wanted for subsequent calls *
+ * offset = initially 0, increment to next BIOP header if wanted for subsequent calls
  * length = module length given in DSM-CC frame header
  * module_nr = module number
+ * wanted = FILETYPE to write the files, DIRTYPE to index the directories (including the service gateway)
+ * Returns the size of the message, 0 if there is no BIOP message at offset
 */
-uint32_t biop_file_message(unsigned char *buffer, size_t offset, size_t length, uint16_t module_nr) {
+uint32_t biop_file_message(unsigned char *buffer, size_t offset, size_t length, uint16_t module_nr, modetype_t wanted) {
 	uint32_t message_size;
-	uint32_t remaining_message_size;
-	uint32_t content_length;
 	uint8_t	 object_key_length;
-	uint8_t* object_key;
-	uint8_t* object_id;
-	unsigned char * current_pos;
-	uint16_t object_info_length;
+	uint32_t object_key;
+	uint32_t kind_length;
+	uint32_t content_length;
+	uint64_t id;
+	unsigned char* current_pos;
+	unsigned char* end;
 	uint8_t context_list_count;
-	uint16_t context_data_length;
-	uint8_t i = 0;
-	uint8_t j = 0;
-	char filename[255];
-	FILE *f;
+	uint8_t i;
 	modetype_t mode;
-	static uint8_t errorshown = 0; /* Show filesystem errors only once */
 
 	/* avoid wrong usage / crashes */
-	if (length < 28 || offset > ( length - 28) ) {
-		assert(length >= 28);
-		assert(offset < ( length - 28));
-		return 0;
-	}
-	if (buffer == NULL) {
+	if (buffer == NULL || length < 28 || offset > (length - 28)) {
 		return 0;
 	}
 	current_pos = buffer + offset;
-#if 0
-	if (module_nr == 1 && offset > 0) {
-		fprintf(stderr, "----- OFFSET %ld -----\n", offset);
-		DumpHex(current_pos, 64);
+	if ( strncmp((char*)current_pos, "BIOP", 4) != 0 ) {
+		return 0;
 	}
-#endif
-	if ( strncmp((char*)current_pos, "BIOP", 4) == 0 ) {
-		/* MAGIC "BIOP" found */
-	} else {
+	/* BIOP Version, endianess and message type */
+	if (current_pos[4] != 1 || current_pos[5] != 0 || current_pos[6] != 0 || current_pos[7] != 0) {
 		return 0;
 	}
-	/* BIOP Version */
-	if (current_pos[4] == 1 && current_pos[5] == 0 && current_pos[6] == 0 && current_pos[7] == 0) {
-		/* Version, endianess and message type correct */
-	} else {
+	message_size = DSMCC_MODULE_FETCH32BITVAL((current_pos + 8));
+	if (message_size > length - offset - 12) {
 		return 0;
 	}
-	current_pos = current_pos + 8;
-	message_size = DSMCC_MODULE_FETCH32BITVAL(current_pos);
-	remaining_message_size = message_size;
-	object_key_length = current_pos[4];
-	object_key = current_pos + 5;
-	current_pos = current_pos + 5 + object_key_length;
-	remaining_message_size = remaining_message_size - 5 - object_key_length;
-	mode = FILETYPE;
-	if (   current_pos[0] == 0 && current_pos[1] == 0 && current_pos[2] == 0 && current_pos[3] == 4 ) {
-		if ( (strncmp((char*)current_pos + 4, "fil", 3) == 0 ) && current_pos[7] == 0 ) {
-#ifdef DEBUG
-			fprintf(stderr, "Module: 0x%x (size %ld), type File found, processing: %ld\n", module_nr, length, offset + message_size + 12);
-#endif
-			mode = FILETYPE;
-			/* Found fil */
-		} else if ( ( (strncmp((char*)current_pos + 4, "dir", 3) == 0) || (strncmp((char*)current_pos + 4, "srg", 3) == 0) )
-					&& current_pos[7] == 0 ) {
-#ifdef DEBUG
-			if (object_key_length == 0) {
-				fprintf(stderr, "Module: 0x%x (size %ld), type Directory (no object_key) found, processing: %ld\n", module_nr, length,
-				offset + message_size + 12);
-				DumpHex(current_pos, remaining_message_size);
-			} else {
-				fprintf(stderr, "Module: 0x%x (size %ld), type Directory (object_key_length: %d, object_key: 0x%02x) found, processing: %ld\n", module_nr, length,
-				object_key_length, object_key[0], offset + message_size + 12);
-				DumpHex(current_pos, remaining_message_size);
-			}
-			// DumpHex(current_pos, message_size);
-#endif
-			if (strncmp((char*)current_pos + 4, "dir", 3) == 0) {
-				mode = DIRTYPE;
-			} else {
-				mode = TOPLEVELDIRTYPE;
-			}
-			/* Found dir */
-		} else {
-#ifdef DEBUG
-			fprintf(stderr, "Module: 0x%x (size %ld), typ %c%c%c found, jumping to: %ld\n", module_nr, length, current_pos[4], current_pos[5], current_pos[6], offset + message_size + 12);
-#endif
-			return message_size + 12;
-		}
+	end = current_pos + 12 + message_size;
+	current_pos += 12;
+	object_key_length = current_pos[0];
+	if (current_pos + 5 + object_key_length > end || ! object_key_read(current_pos + 1, object_key_length, &object_key)) {
+		return message_size + 12;
+	}
+	id = DSMCC_OBJECT_ID(module_nr, object_key_length, object_key);
+	current_pos += 1 + object_key_length;
+	kind_length = DSMCC_MODULE_FETCH32BITVAL(current_pos);
+	if (kind_length < 3 || kind_length > end - current_pos - 4) {
+		return message_size + 12;
 	}
-	/* Jump over 4 'fil\0' / 'dir\0' */
-	current_pos = current_pos + 8;
-	remaining_message_size -= 8;
-	object_info_length = DSMCC_MODULE_FETCH16BITVAL(current_pos);
-	remaining_message_size -= 2;
+	if (strncmp((char*)current_pos + 4, "fil", 3) == 0) {
+		mode = FILETYPE;
+	} else if (strncmp((char*)current_pos + 4, "dir", 3) == 0) {
+		mode = DIRTYPE;
+	} else if (strncmp((char*)current_pos + 4, "srg", 3) == 0) {
+		mode = TOPLEVELDIRTYPE;
+	} else {
 #ifdef DEBUG
-	// DumpHex(current_pos + 2, object_info_length);
+		fprintf(stderr, "Module: 0x%x (size %ld), typ %c%c%c found, jumping to: %ld\n", module_nr, length, current_pos[4], current_pos[5], current_pos[6], offset + message_size + 12);
 #endif
-	object_id = current_pos + 2;
-	current_pos = current_pos + object_info_length + 2;
-	remaining_message_size = remaining_message_size - object_info_length;
+		return message_size + 12;
+	}
+	if ((wanted == FILETYPE) != (mode == FILETYPE)) {
+		return message_size + 12;
+	}
+	current_pos += 4 + kind_length;
+	/* objectInfo and serviceContextList */
+	if (current_pos + 2 > end) {
+		return message_size + 12;
+	}
+	current_pos += 2 + DSMCC_MODULE_FETCH16BITVAL(current_pos);
+	if (current_pos + 1 > end) {
+		return message_size + 12;
+	}
 	context_list_count = current_pos[0];
-	remaining_message_size -= 1;
-	current_pos = current_pos + 1;
+	current_pos++;
 	for (i = 0; i < context_list_count; i++) {
-		current_pos = current_pos + 4; /* Skip context id */
-		remaining_message_size -= 4;
-		context_data_length = current_pos[0] <<8 | current_pos[1];
-		for (j = 0; j < context_data_length; j++) {
-			current_pos++;
-			remaining_message_size--;
+		if (current_pos + 6 > end) {
+			return message_size + 12;
 		}
+		current_pos += 6 + DSMCC_MODULE_FETCH16BITVAL((current_pos + 4));
 	}
+	/* Skip messageBody_length */
 	current_pos += 4;
-	remaining_message_size -= 4;
-	// content_length = ((uint32_t)(current_pos[0]<<24 | current_pos[1]<<16 | current_pos[2]<<8 |current_pos[3]));
-	content_length = DSMCC_MODULE_FETCH32BITVAL(current_pos);
-	/*                        */
-	/* Handle an ordinary file */
-	/*                        */
 	if (mode == FILETYPE) {
-		current_pos += 4;
-		remaining_message_size -= 4;
-		uint64_t oo;
-		uint8_t ok[2];
-		uint8_t object_key_length = 0;
-		memcpy(&oo, object_id, 8);
-		if (get_filename(oo, ok, &object_key_length, FILETYPE)) {
-			char dirname[255];
-			for (uint8_t i = 0; i < object_key_length; i++) {
-				// schmutzig, aber ist ja nur ein zwischenschritt
-				snprintf((char*)&dirname[i*2], 3, "%02x", ok[i]);
-			}
-			#ifdef DEBUG
-			fprintf(stderr, "Dirname %s, Filename %s, object_key: 0x%02x, object_key_length: %d\n", dirname, get_filename(oo, ok, &object_key_length, FILETYPE), *ok, object_key_length);
-			#endif
-			snprintf(filename, 255, CACHE_DIRECTORY "/Dir-%.10s-%.80s", dirname, get_filename(oo, ok, &object_key_length, FILETYPE));
-		} else {
-			snprintf(filename, 255, CACHE_DIRECTORY "/File-Module-0x%02x-ObjectId-0x%02x%02x%02x.data", module_nr, object_id[5], object_id[6], object_id[7]);
+		if (current_pos + 4 > end) {
+			return message_size + 12;
 		}
-		#ifdef DEBUG
-		fprintf(stderr, "biop_file_message(): Module 0x%x, Offset %ld, BIOP File, writing to %s\n", module_nr, offset, filename );
-		#endif
-		f = fopen(filename, "w");
-		if (! f) {
-			/* No code beauty contest here, error is handled elsewhere */
-			if (! errorshown) {
-				output_logmessage("biop_file_message(): fopen(): %s: %s\n", filename, strerror(errno));
-				errorshown = 1;
-			}
+		content_length = DSMCC_MODULE_FETCH32BITVAL(current_pos);
+		current_pos += 4;
+		if (content_length > end - current_pos) {
 			return message_size + 12;
 		}
-		fwrite( current_pos, 1, content_length, f);
-		fclose(f);
-	} else if ( mode == DIRTYPE || mode == TOPLEVELDIRTYPE ) {
-		/*                    */
-		/* Handle a directory */
-		/*                    */
-		uint16_t bindings_count = (current_pos[0]<<8) + current_pos[1];
-		remaining_message_size -= 2;
-		current_pos += 2;
-		char comp_filename[255];
-		char comp_kind[255];
-		uint8_t object_info[8];
-		if ( bindings_count == 0) {
-			#ifdef DEBUG
-			fprintf(stderr, "biop_file_message(): DIRECTORY, no bindings .. object key 0x%02x, object_key_len %d\n", object_key[0], object_key_length);
-			#endif
-		}
-		for ( i = 0; i < bindings_count; i++) {
-			#ifdef DEBUG
-			fprintf(stderr, "biop_file_message(): DIRECTORY - Module: 0x%x,  length: %d, bindings (entries): %d\n", module_nr, remaining_message_size - 2, bindings_count);
-			if (remaining_message_size > 2) {
-				// DumpHex(current_pos, remaining_message_size - 2);
-			}
-			#endif
-			uint8_t nameComponents_count = current_pos[0];
-			current_pos += 1;
-			remaining_message_size -= 1;
-			for ( int j = 0; j < nameComponents_count; j++) {
-				uint8_t id_length = current_pos[0];
-				current_pos += 1;
-				remaining_message_size -= 1;
-				strncpy(comp_filename, (char *)current_pos, id_length);
-				current_pos += id_length;
-				remaining_message_size -= id_length;
-			}
-			uint8_t kind_length = DSMCC_MODULE_FETCH8BITVAL(current_pos);
-			current_pos += 1;
-			remaining_message_size -= 1;
-			strncpy(comp_kind, (char *)current_pos, kind_length);
-			current_pos += kind_length;
-			remaining_message_size -= kind_length;
-			current_pos += 1; // skip binding_type
-			remaining_message_size -= 1;
-			/* Also skip IOR::IOR */
-			uint32_t type_id_length = DSMCC_MODULE_FETCH32BITVAL(current_pos);
-			if (type_id_length > length) {
-				assert(type_id_length < length);
-				return 0;
-			}
-			current_pos = current_pos + 4 + type_id_length;
-			remaining_message_size = remaining_message_size - 4 - type_id_length;
-			uint32_t taggedProfiles_count = DSMCC_MODULE_FETCH32BITVAL(current_pos);
-			assert(taggedProfiles_count < length);
-			if (taggedProfiles_count > length) {
-				assert(taggedProfiles_count < length);
-				return 0;
-			}
-			current_pos += 4;
-			remaining_message_size -= 4;
-			for (int i = 0; i < taggedProfiles_count; i++) {
-				current_pos += 4;  // profileId_tag
-				remaining_message_size -= 4;
-				uint32_t profile_data_length = DSMCC_MODULE_FETCH32BITVAL(current_pos);
-				#ifdef DEBUG
-				fprintf(stderr, "type_id_length: %d, taggedProfiles_count: %d, profile_data_length: %d\n", type_id_length, taggedProfiles_count, profile_data_length);
-				#endif
-				current_pos = current_pos + 4 + profile_data_length;
-				remaining_message_size -= 4;
+		biop_file_write(id, module_nr, object_key, current_pos, content_length);
+	} else {
+		object_add(id)->mode = mode;
+		biop_directory_bindings(id, current_pos, end);
+	}
+	return message_size + 12;
+}	
+
+/* Inflate a compressed module block by block, the compressed data is never
+ * copied into one piece. The output grows (doubling) if the size is not
+ * known from the compressed module descriptor, up to DSMCC_MAX_MODULE_SIZE.
+ * Returns NULL on errors. */
+static unsigned char* module_inflate(module_buffer_t* single_module_buffer, size_t* inflated_length) {
+	z_stream stream;
+	unsigned char* output;
+	size_t output_size = single_module_buffer->original_size;
+	uint32_t i;
+	int z_result = Z_OK;
+	if (output_size > DSMCC_MAX_MODULE_SIZE) {
+		return NULL;
+	}
+	if (output_size == 0) {
+		output_size = 4 * single_module_buffer->received;
+		if (output_size > DSMCC_MAX_MODULE_SIZE) {
+			output_size = DSMCC_MAX_MODULE_SIZE;
+		}
+	}
+	output = malloc(output_size);
+	if (output == NULL) {
+		return NULL;
+	}
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK) {
+		free(output);
+		return NULL;
+	}
+	stream.next_out = output;
+	stream.avail_out = output_size;
+	for (i = 0; i < single_module_buffer->block_count && z_result != Z_STREAM_END; i++) {
+		if (single_module_buffer->block[i].size == 0) {
+			continue;
+		}
+		stream.next_in = chunk_data(single_module_buffer->block[i].chunk);
+		stream.avail_in = single_module_buffer->block[i].size;
+		/* Output may still be pending when the input of the block is used up */
+		while ((stream.avail_in > 0 || stream.avail_out == 0) && z_result != Z_STREAM_END) {
+			if (stream.avail_out == 0) {
+				size_t grown_size = (output_size * 2 > DSMCC_MAX_MODULE_SIZE ? DSMCC_MAX_MODULE_SIZE : output_size * 2);
+				unsigned char* grown = (grown_size > output_size ? realloc(output, grown_size) : NULL);
+				if (grown == NULL) {
+					z_result = Z_MEM_ERROR;
+					break;
+				}
+				output = grown;
+				stream.next_out = output + output_size;
+				stream.avail_out = grown_size - output_size;
+				output_size = grown_size;
 			}
-			uint16_t objectInfo_length = DSMCC_MODULE_FETCH16BITVAL(current_pos);
-			current_pos += 2; //
-			remaining_message_size -= 2;
-			memcpy(object_info, current_pos, fmin(objectInfo_length, 8));
-			#ifdef DEBUG
-			if (objectInfo_length > 0) {
-				fprintf(stderr, "Dirinfo: Name: %s, Kind: %s, Object_info: 0x%02x%02x%02x, objectInfo_Length: %d\n", comp_filename, comp_kind, object_info[5], object_info[6], object_info[7], objectInfo_length);
-			} else {
-				fprintf(stderr, "Dirinfo: Name: %s, Kind: %s (no Object_info)\n", comp_filename, comp_kind);
+			z_result = inflate(&stream, Z_NO_FLUSH);
+			if (z_result == Z_BUF_ERROR && stream.avail_in == 0) {
+				/* nothing left to flush, continue with the next block */
+				z_result = Z_OK;
+				break;
 			}
-			#endif
-			// Liste mit Filenamen
-			if (strncmp(comp_kind, "fil", 3) == 0) {
-				uint64_t oo;
-				memcpy(&oo, object_info, 8);
-				add_direlement(oo, comp_filename, object_key, object_key_length, FILETYPE);
-			} else {
-				uint64_t oo = 0;
-				if (objectInfo_length > 0) {
-					memcpy(&oo, object_info, 8);
-				}
-				add_direlement(oo, comp_filename, object_key, object_key_length, mode);
-				#ifdef DEBUG
-				DumpHex(current_pos, remaining_message_size);
-				#endif
+			if (z_result != Z_OK && z_result != Z_STREAM_END) {
+				break;
 			}
-			current_pos += objectInfo_length;
-			remaining_message_size -= objectInfo_length;
-		} /* for ( i = 0; i < bindings_count; i++) */
+		}
+		if (z_result != Z_OK && z_result != Z_STREAM_END) {
+			break;
+		}
 	}
-	return message_size + 12;
-}	
+	*inflated_length = stream.total_out;
+	inflateEnd(&stream);
+	if (z_result != Z_STREAM_END) {
+		free(output);
+		return NULL;
+	}
+	return output;
+}
 
-void check_module_complete(module_buffer_t* single_module_buffer) {
-	uint16_t i = 0;
-	// uint16_t module_nr = 0;
-	size_t	length = 0;
-	// char filename[255];
-	int z_result;
-	// FILE *f;
-	// static uint8_t message_printed = 0;
+/* Copy the blocks of an uncompressed module into one piece, the BIOP messages span the blocks */
+static unsigned char* module_concatenate(module_buffer_t* single_module_buffer) {
+	unsigned char* output = malloc(single_module_buffer->received);
+	unsigned char* current_pos = output;
+	uint32_t i;
+	if (output == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < single_module_buffer->block_count; i++) {
+		if (single_module_buffer->block[i].size > 0) {
+			memcpy(current_pos, chunk_data(single_module_buffer->block[i].chunk), single_module_buffer->block[i].size);
+			current_pos += single_module_buffer->block[i].size;
+		}
+	}
+	return output;
+}
+
+/* Decode a module and write its objects to the cache, runs in the worker
+ * (or in the main thread if the worker could not be started) */
+static void job_decode(dsmcc_job_t* job) {
+	module_buffer_t* single_module_buffer = &job->module;
 	uint32_t message_offset = 0;
-	if (single_module_buffer == NULL) {
+	uint8_t pass;
+	unsigned char * current_pos = NULL;
+	size_t current_length = 0;
+	if (job->carousel_id != dsmcc.objects_carousel_id) {
+		object_clear();
+		dsmcc.objects_carousel_id = job->carousel_id;
+	}
+	if (job->cached) {
+		uint16_t i;
+		uint8_t found = 0;
+		for (i = 0; i < job->cached_count; i++) {
+			module_index_load(job->carousel_id, job->cached_module[i].module_number, job->cached_module[i].version);
+			if (! found) {
+				found = module_logo_lookup(job, job->cached_module[i].module_number, job->cached_module[i].version);
+			}
+		}
 		return;
 	}
-	// module_nr = single_module_buffer->module_number;
-	for (i = 0; i < MAX_BLOCKNR; i++) {
-		length += single_module_buffer->block_size[i];
+	/* uncompress on the fly. Without compressed module descriptor only
+	 * something looking like a zlib header (deflate, 32K window) is tried */
+	if (single_module_buffer->compressed || (single_module_buffer->block[0].size > 0 && chunk_data(single_module_buffer->block[0].chunk)[0] == 0x78)) {
+		current_pos = module_inflate(single_module_buffer, &current_length);
+		if (current_pos == NULL && single_module_buffer->compressed) {
+			output_logmessage("job_decode(): Cannot inflate DSM-CC module 0x%x\n", single_module_buffer->module_number);
+			return;
+		}
+		if (current_pos && single_module_buffer->original_size > 0 && current_length != single_module_buffer->original_size) {
+			output_logmessage("job_decode(): DSM-CC module 0x%x has %ld bytes instead of %ld\n", single_module_buffer->module_number,
+				current_length, single_module_buffer->original_size);
+		}
 	}
-	if (length != single_module_buffer->data_size) {
+	if (current_pos) {
+		job->inflated = 1;
+	} else {
+		current_pos = module_concatenate(single_module_buffer);
+		current_length = single_module_buffer->received;
+		if (current_pos == NULL) {
+			return;
+		}
+	}
+	module_output_begin(job);
+	dsmcc.unresolved = 0;
+	/* Directories first, the files of the module can then be written by their path */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			module_index_write(single_module_buffer->module_number);
+		}
+		message_offset = 0;
+		while ( message_offset < current_length ) {
+			uint32_t message_size = biop_file_message(current_pos, message_offset, current_length, single_module_buffer->module_number,
+				(pass == 0 ? DIRTYPE : FILETYPE));
+			if (message_size == 0) {
+				break;
+			}
+			message_offset += message_size;
+		}
+	}
+	free(current_pos);
+	/* Wait for the directory module, the files would end up named by their object key */
+	if (dsmcc.unresolved > 0 && dsmcc.output[0] != '\0' && single_module_buffer->deferred < DSMCC_MAX_DEFERRALS) {
+		remove_directory(dsmcc.output);
+		dsmcc.output[0] = '\0';
+		job->deferred = 1;
 		return;
 	}
-	/* Write to disk for the time being */
-	/* uncompress on the fly */
-	unsigned char * compressed_data;
-	unsigned char * current_pos;
-	unsigned char * uncompressed_data;
-	char info[15];
-	size_t uncompressed_length = 10 * length; /* Assume factor 10 (3 and 5 are not sufficient) */
-	size_t current_length = 0;
-	compressed_data = alloca(length + 1);  /* use stack */
-	current_pos = compressed_data;
-	uncompressed_data = alloca(uncompressed_length + 1);
-	/* Try to uncompress */
-	for (i = 0; i < MAX_BLOCKNR; i++) {
-		if (single_module_buffer->block_size[i] > 0) {
-			memcpy(current_pos, single_module_buffer->buffer[i], single_module_buffer->block_size[i]);
-			current_pos += single_module_buffer->block_size[i];
-		} else {
+	module_output_publish(job);
+	job->length = current_length;
+	job->decoded = 1;
+	return;
+}
+
+/* A job came back: the chunks go back to the pool and the result is announced (main thread) */
+static void job_finish(dsmcc_job_t* job) {
+	module_buffer_t* single_module_buffer = module_find(job->module.module_number);
+	uint32_t i;
+	for (i = 0; i < job->module.block_count; i++) {
+		if (job->module.block[i].chunk != DSMCC_NO_CHUNK) {
+			chunk_free(job->module.block[i].chunk);
+		}
+	}
+	free(job->module.block);
+	/* The carousel has changed in the meantime */
+	if (job->carousel_id != dsmcc.carousel_id) {
+		free(job->cached_module);
+		free(job);
+		return;
+	}
+	if (job->decoded) {
+		output_logmessage("DSM-CC: module 0x%x version %d decoded (%ld bytes%s)\n", job->module.module_number,
+			job->module.version, job->length, (job->inflated ? ", inflated" : ""));
+	}
+	if (job->decoded || job->cached) {
+		module_logo_apply(job);
+	} else if (single_module_buffer && single_module_buffer->decoded && single_module_buffer->decoded_version == job->module.version) {
+		/* Decoding failed or was deferred, collect the module again */
+		single_module_buffer->decoded = 0;
+		if (job->deferred) {
+			single_module_buffer->deferred++;
+			output_logmessage("DSM-CC: module 0x%x version %d deferred, the directories of its files are not known yet\n",
+				job->module.module_number, job->module.version);
+		}
+	}
+	free(job->cached_module);
+	free(job);
+	return;
+}
+
+static void* dsmcc_worker(void* arg) {
+	dsmcc_job_t* job;
+	while (1) {
+		if (sem_wait(&dsmcc.work_available) < 0) {
 			continue;
 		}
+		/* A wakeup without a job ends the worker */
+		job = queue_pop(&dsmcc.work);
+		if (job == NULL) {
+			break;
+		}
+		job_decode(job);
+		/* Can't be full, there are never more than DSMCC_WORKER_QUEUE_SIZE jobs */
+		queue_push(&dsmcc.done, job);
+	}
+	return NULL;
+}
+
+/* Start the worker, all signals are handled by the main thread */
+static void dsmcc_worker_start() {
+	sigset_t all_signals;
+	sigset_t old_signals;
+	sigfillset(&all_signals);
+	if (sem_init(&dsmcc.work_available, 0, 0) < 0) {
+		dsmcc.worker_state = 2;
+		return;
 	}
-	z_result = uncompress(uncompressed_data, &uncompressed_length, compressed_data, length);
-	if (z_result == Z_OK) {
-		snprintf(info, 14, "-unzipped");
-		current_pos = uncompressed_data;
-		current_length = uncompressed_length;
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	if (pthread_create(&dsmcc.worker, NULL, dsmcc_worker, NULL) != 0) {
+		output_logmessage("dsmcc_worker_start(): Can't start the DSM-CC worker, decoding in the main thread\n");
+		sem_destroy(&dsmcc.work_available);
+		dsmcc.worker_state = 2;
 	} else {
-		// fprintf(stderr, "Cannot uncompress module 0x%x: %d\n", single_module_buffer->module_number, z_result);
-		strcpy(info, "");
-		current_pos = compressed_data;
-		current_length = length;
+		dsmcc.worker_state = 1;
 	}
-	#if 0
-	snprintf(filename, 255, CACHE_DIRECTORY "/Module-0x%x%s.bin", single_module_buffer->module_number, info);
-	#ifdef DEBUG
-	fprintf(stderr, "check_module_complete(): Module 0x%x complete, writing to %s!\n", single_module_buffer->module_number, filename);
-	#endif
-	f = fopen(filename, "w");
-	if (! f) {
-		if (! message_printed) {
-			output_logmessage("Write problem in " CACHE_DIRECTORY ". This message will only be logged once\n");
-			output_logmessage("fopen file `%s' for writing in check_module_complete(): %s\n", filename, strerror(errno));
-			message_printed = 1;
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	return;
+}
+
+/* Collect the jobs the worker has finished */
+static void dsmcc_worker_collect() {
+	dsmcc_job_t* job;
+	while ((job = queue_pop(&dsmcc.done)) != NULL) {
+		dsmcc.in_flight--;
+		if (job->cached) {
+			dsmcc.cached_in_flight = 0;
+		}
+		job_finish(job);
+	}
+	return;
+}
+
+/* Queue a job for the worker, or do it right away without worker */
+static void job_submit(dsmcc_job_t* job) {
+	if (dsmcc.worker_state != 1) {
+		job_decode(job);
+		job_finish(job);
+		return;
+	}
+	dsmcc.in_flight++;
+	if (job->cached) {
+		dsmcc.cached_in_flight = 1;
+	}
+	queue_push(&dsmcc.work, job);
+	sem_post(&dsmcc.work_available);
+	return;
+}
+
+/* Hand a module over to the worker, its blocks move to the job. Until the
+ * result is back (or the DII announces a new version) the blocks of the
+ * module are skipped. Returns 0 if the queue is full. */
+static int module_submit(module_buffer_t* single_module_buffer) {
+	dsmcc_job_t* job;
+	if (dsmcc.worker_state == 0) {
+		dsmcc_worker_start();
+	}
+	/* The last slot is kept for the modules found in the cache */
+	if (dsmcc.in_flight - dsmcc.cached_in_flight == DSMCC_WORKER_QUEUE_SIZE - 1) {
+		if (dsmcc.dropped_modules++ == 0) {
+			output_logmessage("module_submit(): DSM-CC worker busy, dropping module 0x%x\n", single_module_buffer->module_number);
+		}
+		return 0;
+	}
+	job = calloc(1, sizeof(dsmcc_job_t));
+	if (job == NULL) {
+		return 0;
+	}
+	job->module = *single_module_buffer;
+	job->carousel_id = dsmcc.carousel_id;
+	single_module_buffer->block = NULL;
+	single_module_buffer->block_count = 0;
+	single_module_buffer->received = 0;
+	single_module_buffer->decoded = 1;
+	single_module_buffer->decoded_version = single_module_buffer->version;
+	job_submit(job);
+	return 1;
+}
+
+/* Hand the modules of a DII found in the cache over to the worker, it
+ * indexes their directories and looks for the logo. The modules count as
+ * decoded once the job is queued, the job owns the list. Returns 0 if the
+ * job of the last DII is still in progress, they are tried again with the
+ * next DII then. */
+static int module_submit_cached(dsmcc_cached_module_t* cached_module, uint16_t cached_count) {
+	dsmcc_job_t* job;
+	uint16_t i;
+	if (dsmcc.worker_state == 0) {
+		dsmcc_worker_start();
+	}
+	if (dsmcc.cached_in_flight) {
+		return 0;
+	}
+	job = calloc(1, sizeof(dsmcc_job_t));
+	if (job == NULL) {
+		return 0;
+	}
+	job->carousel_id = dsmcc.carousel_id;
+	job->cached = 1;
+	job->cached_count = cached_count;
+	job->cached_module = cached_module;
+	for (i = 0; i < cached_count; i++) {
+		module_buffer_t* single_module_buffer = module_find(cached_module[i].module_number);
+		if (single_module_buffer == NULL) {
+			continue;
 		}
 		cleanup_download_module_buffer(single_module_buffer);
+		single_module_buffer->version = cached_module[i].version;
+		single_module_buffer->decoded = 1;
+		single_module_buffer->decoded_version = cached_module[i].version;
+		output_logmessage("DSM-CC: module 0x%x version %d found in the cache\n", cached_module[i].module_number, cached_module[i].version);
+	}
+	job_submit(job);
+	return 1;
+}
+
+void check_module_complete(module_buffer_t* single_module_buffer) {
+	if (single_module_buffer == NULL) {
+		return;
+	}
+	if (single_module_buffer->received == 0 || single_module_buffer->received != single_module_buffer->data_size) {
+		return;
+	}
+	if (! module_submit(single_module_buffer)) {
+		/* collect it again in the next cycle of the carousel */
+		cleanup_download_module_buffer(single_module_buffer);
+	}
+	return;
+}
+
+/* Look for the compressed module descriptor in the BIOP::ModuleInfo of a module,
+ * module_info points to the module entry of the DII (see DSMCC_MODULE_INFO_TAPS) */
+static void module_info_decode(module_buffer_t* single_module_buffer, unsigned char* module_info, unsigned char* end) {
+	unsigned char* tap = DSMCC_MODULE_INFO_TAPS(module_info);
+	unsigned char* user_info_end;
+	uint8_t i;
+	single_module_buffer->compressed = 0;
+	single_module_buffer->original_size = 0;
+	if (tap > end) {
 		return;
 	}
-	fwrite( current_pos, 1, current_length, f);
-	fclose(f);
-	#endif
-	message_offset = biop_file_message(current_pos, 0, current_length, single_module_buffer->module_number);
-	while ( message_offset > 0 && message_offset < ( current_length - 28)  ) {
-		size_t new_offset;
-		new_offset = biop_file_message(current_pos, message_offset, current_length, single_module_buffer->module_number);
-		message_offset = message_offset + new_offset;
+	for (i = 0; i < DSMCC_MODULE_INFO_TAPS_COUNT(module_info); i++) {
+		if (tap + 7 > end) {
+			return;
+		}
+		tap += 7 + DSMCC_TAP_SELECTOR_LENGTH(tap);
+	}
+	if (tap + 1 > end) {
+		return;
+	}
+	user_info_end = tap + 1 + tap[0];
+	if (user_info_end > end) {
+		return;
+	}
+	tap++;
+	while (tap + 2 <= user_info_end && tap + 2 + tap[1] <= user_info_end) {
+		if (tap[0] == DSMCC_COMPRESSED_MODULE_DESCRIPTOR && tap[1] >= 5) {
+			single_module_buffer->compressed = 1;
+			single_module_buffer->original_size = DSMCC_MODULE_FETCH32BITVAL((tap + 3));
+		}
+		tap += 2 + tap[1];
 	}
-	cleanup_download_module_buffer(single_module_buffer);
 	return;
 }
 
 void handle_server_initate(unsigned char *buf, size_t len) {
 	uint16_t module_count;
 	uint16_t i = 0;
-	uint16_t j = 0;
 	unsigned char * current_module;
+	unsigned char * end;
+	uint16_t dii;
+	dsmcc_cached_module_t* cached_module = NULL;
+	uint16_t cached_count = 0;
 	if (DSMCC_MESSAGE_TYPE(buf) != 0x3b) {
 		output_logmessage("handle_server_initiate(): internal error, called with wrong message type 0x%x\n", DSMCC_MESSAGE_TYPE(buf));
 		return;
@@ -528,12 +1352,33 @@ void handle_server_initate(unsigned char *buf, size_t len) {
 	if (DSMCC_TABLE_EXTENSION(buf) == 0) {
 		return;
 	}
+	end = buf + 20 + DSMCC_MESSAGE_SIZE(buf);
+	if (DSMCC_MESSAGE_SIZE(buf) + 20 > len || DSMCC_DII_MODULES_START(buf) > end) {
+		output_logmessage("handle_server_initate(): invalid MPEG Frame, message size %d > len (%d)\n", DSMCC_MESSAGE_SIZE(buf), len);
+		return;
+	}
 	module_count = DSMCC_DII_MODULE_COUNT(buf);
+	if (dsmcc.carousel_id != DSMCC_DII_DOWNLOAD_ID(buf)) {
+		if (dsmcc.used > 0) {
+			output_logmessage("DSM-CC: carousel 0x%08x replaces 0x%08x, dropping its modules\n", DSMCC_DII_DOWNLOAD_ID(buf), dsmcc.carousel_id);
+			module_clear();
+		}
+		dsmcc.carousel_id = DSMCC_DII_DOWNLOAD_ID(buf);
+	}
+	dsmcc.dii_count++;
+	/* The lowest bit of the transactionId is the update flag */
+	dii = DSMCC_TABLE_EXTENSION(buf) >> 1;
 	//fprintf(stderr, "handle_server_initate(): transaction_id 0x%x, message_id 0x%x, module_count 0x%x\n", transaction_id, message_id, module_count);
 	current_module = DSMCC_DII_MODULES_START(buf);
 
 	for (i = 0; i < module_count; i++) {
 		uint16_t module_nr;
+		uint8_t module_version;
+		if (current_module + 8 > end || current_module + 8 + DSMCC_MODULE_INFO_LENGTH(current_module) > end) {
+			output_logmessage("handle_server_initate(): invalid MPEG Frame, module %d exceeds the message\n", i);
+			free(cached_module);
+			return;
+		}
 	#if 0
 	#ifdef DEBUG
 		fprintf(stderr, "Module_id  0x%x, Module size %d, Module_version 0x%x, module info_length %d\n",
@@ -544,22 +1389,53 @@ void handle_server_initate(unsigned char *buf, size_t len) {
 	#endif
 	#endif
 		module_nr = DSMCC_MODULE_MODULE_ID(current_module);
+		module_version = DSMCC_MODULE_MODULE_VERSION(current_module);
 		/* Spec says that a list of descriptors follows in length DSMCC_MODULE_INFO_LENGTH(current_module) */
-		if (module_buffer[module_nr]) {
-			module_buffer[module_nr]->data_size = DSMCC_MODULE_MODULE_SIZE(current_module);
-			check_module_complete(module_buffer[module_nr]);
+		module_buffer_t* single_module_buffer = module_find(module_nr);
+		if (single_module_buffer == NULL && module_cached(dsmcc.carousel_id, module_nr, module_version)) {
+			single_module_buffer = module_add(module_nr);
 		}
-		current_module = current_module + DSMCC_MODULE_INFO_LENGTH(current_module) + 8;
-		j += DSMCC_MODULE_INFO_LENGTH(current_module);
-		if ( j > len) {
-			output_logmessage("handle_server_initate(): invalid MPEG Frame, j (%d) > len (%d)\n", j, len);
-			return;
+		if (single_module_buffer) {
+			single_module_buffer->listed = 1;
+			single_module_buffer->dii = dii;
+			single_module_buffer->dii_seen = dsmcc.dii_count;
+			/* The broadcaster changed the module, collect it again */
+			if (single_module_buffer->decoded && single_module_buffer->decoded_version != module_version) {
+				single_module_buffer->decoded = 0;
+			}
+			/* Decoded by an earlier run or another process, no need to wait for the carousel */
+			if (! single_module_buffer->decoded && module_cached(dsmcc.carousel_id, module_nr, module_version)) {
+				if (cached_module == NULL) {
+					cached_module = malloc(module_count * sizeof(dsmcc_cached_module_t));
+				}
+				if (cached_module) {
+					cached_module[cached_count].module_number = module_nr;
+					cached_module[cached_count].version = module_version;
+					cached_count++;
+					current_module = current_module + DSMCC_MODULE_INFO_LENGTH(current_module) + 8;
+					continue;
+				}
+			}
+			if (single_module_buffer->decoded) {
+				current_module = current_module + DSMCC_MODULE_INFO_LENGTH(current_module) + 8;
+				continue;
+			}
+			single_module_buffer->data_size = DSMCC_MODULE_MODULE_SIZE(current_module);
+			module_info_decode(single_module_buffer, current_module, current_module + 8 + DSMCC_MODULE_INFO_LENGTH(current_module));
+			check_module_complete(single_module_buffer);
 		}
+		current_module = current_module + DSMCC_MODULE_INFO_LENGTH(current_module) + 8;
 	}
+	if (cached_count > 0 && module_submit_cached(cached_module, cached_count)) {
+		cached_module = NULL;
+	}
+	free(cached_module);
+	module_sweep(dii);
 	return;
 }
 
 void handle_dsmcc_message(unsigned char *buf, size_t len) {
+	dsmcc_worker_collect();
 	/* If you want to test it ... uncomment the return */
 	// return;	/* TODO: With this "return" no DSM-CC will be handled */
 	if (DSMCC_MESSAGE_TYPE(buf) == 0x3c) {
@@ -581,6 +1457,30 @@ void init_dsmcc() {
 }
 
 void close_dsmcc() {
+	uint32_t i;
+	if (dsmcc.worker_state == 1) {
+		sem_post(&dsmcc.work_available);
+		pthread_join(dsmcc.worker, NULL);
+		sem_destroy(&dsmcc.work_available);
+	}
+	dsmcc_worker_collect();
+	if (dsmcc.used > 0) {
+		output_logmessage("DSM-CC: %d modules, %d objects, %lu blocks of already decoded modules skipped, %d blocks dropped (memory limit), %d modules dropped (worker busy), %d incomplete modules dropped by the carousel\n",
+			dsmcc.used, dsmcc.objects_used, dsmcc.skipped_blocks, dsmcc.dropped_blocks, dsmcc.dropped_modules, dsmcc.swept_modules);
+	}
+	for (i = 0; i < dsmcc.objects_size; i++) {
+		free(dsmcc.object[i].name);
+	}
+	free(dsmcc.object);
+	for (i = 0; i < dsmcc.size; i++) {
+		free(dsmcc.module[i].block);
+	}
+	free(dsmcc.module);
+	for (i = 0; i < dsmcc.slabs; i++) {
+		free(dsmcc.slab[i]);
+	}
+	free(dsmcc.free_chunk);
+	memset(&dsmcc, 0, sizeof(dsmcc));
 	return;
 }
 
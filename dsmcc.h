@@ -23,20 +23,86 @@
 #define _DSMCC_H
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include "mpa_header.h"
 
-#define MAX_BLOCKNR 255
+/* The data of the download data blocks is kept in chunks of fixed size out of a
+ * pool that grows slab by slab up to a maximum, this bounds the memory used by DSM-CC */
+#define DSMCC_CHUNK_SIZE        4096    /* a download data block carries at most 4066 bytes */
+#define DSMCC_CHUNKS_PER_SLAB   64
+#define DSMCC_MAX_SLABS         32      /* 8 MiB */
+#define DSMCC_NO_CHUNK          0xffff
 
+/* Maximum size of an inflated module, the size in the compressed module
+ * descriptor comes from the broadcast */
+#define DSMCC_MAX_MODULE_SIZE   (16 * 1024 * 1024)
+
+/* Initial size of the module hash table, must be a power of two */
+#define DSMCC_MODULES_INITIAL_SIZE 16
+
+typedef struct dsmcc_block_s {
+	uint16_t chunk;                    /* chunk holding the data, DSMCC_NO_CHUNK if not received */
+	uint16_t size;                     /* size of the block */
+} dsmcc_block_t;
 
 typedef struct module_buffer {
-	uint8_t  valid;                    /* All blocks received, i.e. data valid? */
+	uint8_t  used;                     /* Slot of the hash table is used */
 	uint16_t module_number;            /* Number of data module */
-	size_t	 data_size;                /* Overall size of data */
-	uint16_t max_blocknr;              /* Maximum number of block */
-	uint16_t block_size[MAX_BLOCKNR];  /* the size of the current block */
-	char *   buffer[MAX_BLOCKNR];      /* Buffer holding the data in length given in block_size */
+	size_t	 data_size;                /* Overall size of data (from DII, 0 if unknown) */
+	uint8_t  version;                  /* module version of the received blocks */
+	uint8_t  decoded;                  /* module has been decoded in version decoded_version */
+	uint8_t  decoded_version;
+	uint8_t  compressed;               /* DII has a compressed module descriptor */
+	size_t   original_size;            /* size after inflating (from compressed module descriptor) */
+	size_t   received;                 /* Sum of the sizes of the received blocks */
+	uint32_t block_count;              /* Number of entries in block */
+	dsmcc_block_t* block;              /* The blocks, index is the block number */
+	uint8_t  listed;                   /* a DII has listed the module */
+	uint16_t dii;                      /* identification of the transactionId of that DII */
+	uint32_t dii_seen;                 /* DII counter when the module was listed (or its blocks started) */
+	uint8_t  deferred;                 /* decoding was deferred, the directories of its files were unknown */
 } module_buffer_t;
 
+/* Blocks of a module no DII lists are freed after this number of DIIs */
+#define DSMCC_UNLISTED_DIIS 16
+
+/* A module with files whose directories are unknown is collected again this
+ * often (until its directory module is decoded), then written by object key */
+#define DSMCC_MAX_DEFERRALS 3
+
+/* Completed modules are decoded by a worker thread, this is the number of
+ * jobs that may wait for or be in decoding, must be a power of two. One of
+ * them is kept for the modules a DII lists that are found in the cache. */
+#define DSMCC_WORKER_QUEUE_SIZE 8
+
+/* A module version found in the cache */
+typedef struct dsmcc_cached_module_s {
+	uint16_t module_number;
+	uint8_t  version;
+} dsmcc_cached_module_t;
+
+/* A module handed over to the worker. The job owns the blocks (and their
+ * chunks) until it is returned, the chunks go back to the pool afterwards */
+typedef struct dsmcc_job_s {
+	module_buffer_t module;            /* the module as it was completed */
+	uint32_t carousel_id;
+	uint8_t  cached;                   /* the modules are already in the cache, index them and look for the logo */
+	uint16_t cached_count;             /* number of entries in cached_module */
+	dsmcc_cached_module_t* cached_module;
+	uint8_t  decoded;                  /* result: module is written to the cache */
+	uint8_t  deferred;                 /* result: not written, the directories of its files are unknown */
+	uint8_t  inflated;                 /* result: module was compressed */
+	size_t   length;                   /* result: size of the decoded module */
+	char     logo[1024];               /* result: station logo found in the module, relative to DSMCC_CACHE_DIRECTORY */
+} dsmcc_job_t;
+
+/* A lock free ring of jobs between exactly one producer and one consumer */
+typedef struct dsmcc_queue_s {
+	dsmcc_job_t* job[DSMCC_WORKER_QUEUE_SIZE];
+	atomic_uint head;                  /* next job to take, written by the consumer */
+	atomic_uint tail;                  /* next free slot, written by the producer */
+} dsmcc_queue_t;
+
 typedef struct server_initiate_buffer {
 
 } server_initiate_buffer_t;
@@ -46,13 +112,29 @@ typedef enum {
 	DIRTYPE,
 	FILETYPE } modetype_t;
 
-typedef struct dir_element {
-	uint64_t object_id;
-	uint8_t object_key_length;
-	uint8_t object_key[2];
-	char	filename[255];
+/* Initial size of the object index, must be a power of two */
+#define DSMCC_OBJECTS_INITIAL_SIZE 64
+/* DVB limits the object key to 4 bytes */
+#define DSMCC_MAX_OBJECT_KEY_LENGTH 4
+/* Maximum directory depth when a path is resolved (protects against loops) */
+#define DSMCC_MAX_PATH_DEPTH 16
+/* The directories and bindings of a module, in its cache directory. A module
+ * found in the cache is indexed from it, without the BIOP messages. */
+#define DSMCC_INDEX_FILE ".index"
+
+/* A BIOP object is identified by its module and its object key (IOR ObjectLocation) */
+#define DSMCC_OBJECT_ID(module, key_length, key) (((uint64_t)(module) << 40) | ((uint64_t)(key_length) << 32) | (key))
+
+/* An entry of the object index, name and parent are known from the
+ * binding of the directory containing the object */
+typedef struct dsmcc_object_s {
+	uint8_t  used;                     /* Slot of the hash table is used */
+	uint8_t  linked;                   /* name and parent are known */
 	modetype_t mode;
-} dir_element_t;
+	uint64_t id;                       /* DSMCC_OBJECT_ID */
+	uint64_t parent;                   /* id of the directory */
+	char*    name;
+} dsmcc_object_t;
 
 /* Makros for accessing DSM-CC packets */
 #define DSMCC_MESSAGE_TYPE(b)       (b[0])
@@ -60,6 +142,7 @@ typedef struct dir_element {
 #define DSMCC_SECTION_NUMBER(b)     (b[6])
 #define DSMCC_LAST_SECTION_NUMBER(b) (b[7])
 #define DSMCC_MODULE_ID(b)          (b[20]<<8 | b[21])
+#define DSMCC_MODULE_VERSION(b)     (b[22])
 #define DSMCC_BLOCKNR(b)            (b[24]<<8 | b[25])
 
 #define DSMCC_MESSAGE_SIZE(b)		(b[18]<<8 | b[19])
@@ -68,6 +151,7 @@ typedef struct dir_element {
 #define DSMCC_PROTOCOL_DISCRIMINATOR(b)	(b[8])
 #define DSMCC_PROTOCOL_MESSAGE_ID(b) (b[10]<<8 | b[11])
 #define DSMCC_TRANSACTION_ID(b)     ((uint32_t)((b[12]<<24) | (b[13]<<16) | (b[14]<<8) | b[15]))
+#define DSMCC_DII_DOWNLOAD_ID(b)    ((uint32_t)((b[20]<<24) | (b[21]<<16) | (b[22]<<8) | b[23]))
 #define DSMCC_DII_MODULE_COUNT(b)	(b[38]<<8 | b[39])
 #define DSMCC_DII_MODULES_START(b)  (b+40)
 
@@ -76,6 +160,15 @@ typedef struct dir_element {
 #define DSMCC_MODULE_MODULE_VERSION(b)  (b[6])
 #define DSMCC_MODULE_INFO_LENGTH(b)     (b[7])
 #define DSMCC_MODULE_INFO_DESCRIPTOR(b) (b[8])
+/* BIOP::ModuleInfo: moduleTimeOut, blockTimeOut, minBlockTime, taps_count */
+#define DSMCC_MODULE_INFO_TAPS_COUNT(b) (b[20])
+#define DSMCC_MODULE_INFO_TAPS(b)       (b+21)
+#define DSMCC_TAP_SELECTOR_LENGTH(b)    (b[6])
+/* Tags of the IOR profile and its ObjectLocation */
+#define DSMCC_TAG_BIOP_PROFILE          0x49534f06
+#define DSMCC_TAG_OBJECT_LOCATION       0x49534f50
+/* Compressed module descriptor in the userInfo of the ModuleInfo */
+#define DSMCC_COMPRESSED_MODULE_DESCRIPTOR 0x09
 
 /* Universal Makros */
 #define DSMCC_MODULE_FETCH8BITVAL(b)	(b[0])
@@ -85,5 +178,7 @@ typedef struct dir_element {
 
 /* In dsmcc.c */
 void handle_dsmcc_message(unsigned char *buf, size_t len);
+int dsmcc_section_wanted(unsigned char *buf);
+void close_dsmcc();
 
 #endif
@@ -0,0 +1,378 @@
+/*
+ *  Latency measurement
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  Measures how long the audio data stays inside ts2shout: Every batch of
+ *  input data (one read() in filter mode, one curl callback in CGI mode) gets
+ *  a timestamp. When payload data of that batch is put into the audio buffer
+ *  a mark with the byte offset is queued. As soon as the audio output passed
+ *  that offset the delay is recorded. The time spent in fwrite() is
+ *  recorded separately. Both go into log-linear histograms (like HDR histograms)
+ *  that are printed on SIGUSR1 and at exit.
+ *
+ *  Independent of that the time of each tune-in milestone (PAT, PMT, SDT,
+ *  first audio...) is logged in one line per session. CGI sessions with latency
+ *  measurement add their times to histograms in a file shared by all processes.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ts2shout.h"
+#include "latency.h"
+
+/* A mark: payload data up to offset arrived at time */
+typedef struct latency_mark_s {
+	uint64_t offset;
+	uint64_t time;
+} latency_mark_t;
+
+static struct {
+	uint8_t enabled;
+	uint64_t batch_time;            /* arrival of the current input batch */
+	uint64_t marked_time;           /* batch time of the last queued mark */
+	uint64_t buffered;              /* payload bytes put into the audio buffer */
+	uint64_t written;               /* payload bytes written */
+	uint64_t write_start;
+	uint32_t head;                  /* next mark to be written */
+	uint32_t tail;                  /* oldest mark */
+	uint64_t dropped;               /* marks dropped because the queue was full */
+	latency_mark_t mark[LATENCY_MARKS];
+	latency_histogram_t delay;
+	latency_histogram_t write;
+} latency;
+
+static volatile sig_atomic_t latency_report_requested = 0;
+
+static const char *milestone_name[MILESTONE_COUNT] = {
+	"start", "packet", "pat", "pmt", "payload", "sdt", "sync", "headers", "audio"
+};
+
+/* Time of each milestone in us since the process start, 0 = not reached */
+static uint64_t milestone_time[MILESTONE_COUNT];
+
+#define LATENCY_TIMELINE_MAGIC "ts2stl01"
+
+typedef struct latency_timeline_file_s {
+	char magic[8];
+	_Atomic uint64_t sessions;
+	latency_shared_histogram_t milestone[MILESTONE_COUNT];
+} latency_timeline_file_t;
+
+static uint64_t now_us() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/* Values below 2 * LATENCY_SUB_BUCKETS get their own bucket, above that every
+ * power of two is divided in LATENCY_SUB_BUCKETS linear buckets */
+static uint32_t bucket_index(uint64_t value) {
+	uint8_t msb;
+	uint8_t shift;
+	if (value < 2 * LATENCY_SUB_BUCKETS) {
+		return value;
+	}
+	if (value >= ((uint64_t)1 << LATENCY_MAX_BITS)) {
+		value = ((uint64_t)1 << LATENCY_MAX_BITS) - 1;
+	}
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - 4;
+	return (shift + 1) * LATENCY_SUB_BUCKETS + (value >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+/* Highest value that is counted in bucket index */
+static uint64_t bucket_value(uint32_t index) {
+	uint8_t shift;
+	if (index < 2 * LATENCY_SUB_BUCKETS) {
+		return index;
+	}
+	shift = index / LATENCY_SUB_BUCKETS - 1;
+	return (((uint64_t)(index % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS + 1)) << shift) - 1;
+}
+
+static void histogram_record(latency_histogram_t *h, uint64_t value) {
+	if (h->count == 0 || value < h->min) {
+		h->min = value;
+	}
+	if (value > h->max) {
+		h->max = value;
+	}
+	h->count++;
+	h->sum += value;
+	h->bucket[bucket_index(value)]++;
+	return;
+}
+
+static uint64_t histogram_percentile(const latency_histogram_t *h, double percentile) {
+	uint64_t wanted = (uint64_t)(h->count * percentile / 100.0 + 0.5);
+	uint64_t seen = 0;
+	uint32_t i;
+	if (wanted == 0) {
+		wanted = 1;
+	}
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= wanted) {
+			/* The bucket may reach beyond the real maximum */
+			return (bucket_value(i) < h->max) ? bucket_value(i) : h->max;
+		}
+	}
+	return h->max;
+}
+
+static void histogram_print(const latency_histogram_t *h) {
+	if (h->count == 0) {
+		output_logmessage("latency: %s: no values\n", h->name);
+		return;
+	}
+	output_logmessage("latency: %s: %lu values, min %lu us, avg %lu us, p50 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n",
+		h->name, h->count, h->min, h->sum / h->count, histogram_percentile(h, 50.0),
+		histogram_percentile(h, 99.0), histogram_percentile(h, 99.9), h->max);
+	return;
+}
+
+static void latency_signal_handler(int signum) {
+	latency_report_requested = 1;
+	signal(signum, latency_signal_handler);
+}
+
+void latency_init(uint8_t enable) {
+	memset(&latency, 0, sizeof(latency));
+	latency.enabled = enable;
+	latency.delay.name = "packet arrival to audio write";
+	latency.write.name = "duration of audio write";
+	if (enable) {
+		signal(SIGUSR1, latency_signal_handler);
+		output_logmessage("latency: measurement enabled, send SIGUSR1 (kill -USR1 %d) for a report\n", getpid());
+	}
+	return;
+}
+
+/* A new batch of input data arrived */
+void latency_ingest() {
+	if (! latency.enabled) {
+		return;
+	}
+	latency.batch_time = now_us();
+	if (latency_report_requested) {
+		latency_report_requested = 0;
+		latency_report();
+	}
+	return;
+}
+
+/* bytes of payload of the current batch were put into the audio buffer */
+void latency_buffered(uint32_t bytes) {
+	if (! latency.enabled) {
+		return;
+	}
+	latency.buffered += bytes;
+	/* One mark per batch is enough, just move its offset */
+	if (latency.head != latency.tail && latency.marked_time == latency.batch_time) {
+		latency.mark[(latency.head - 1) % LATENCY_MARKS].offset = latency.buffered;
+		return;
+	}
+	if (latency.head - latency.tail == LATENCY_MARKS) {
+		latency.tail++;
+		latency.dropped++;
+	}
+	latency.mark[latency.head % LATENCY_MARKS].offset = latency.buffered;
+	latency.mark[latency.head % LATENCY_MARKS].time = latency.batch_time;
+	latency.marked_time = latency.batch_time;
+	latency.head++;
+	return;
+}
+
+void latency_write_begin() {
+	if (latency.enabled) {
+		latency.write_start = now_us();
+	}
+	return;
+}
+
+/* bytes of payload were written, all marks up to this offset are done */
+void latency_written(uint32_t bytes) {
+	uint64_t now;
+	if (! latency.enabled) {
+		return;
+	}
+	now = now_us();
+	histogram_record(&latency.write, now - latency.write_start);
+	latency.written += bytes;
+	while (latency.head != latency.tail && latency.mark[latency.tail % LATENCY_MARKS].offset <= latency.written) {
+		histogram_record(&latency.delay, now - latency.mark[latency.tail % LATENCY_MARKS].time);
+		latency.tail++;
+	}
+	return;
+}
+
+/* bytes of payload were put into the audio buffer but thrown away, their
+ * marks are done without a delay */
+void latency_dropped(uint32_t bytes) {
+	if (! latency.enabled) {
+		return;
+	}
+	latency.written += bytes;
+	while (latency.head != latency.tail && latency.mark[latency.tail % LATENCY_MARKS].offset <= latency.written) {
+		latency.tail++;
+	}
+	return;
+}
+
+void latency_report() {
+	if (! latency.enabled) {
+		return;
+	}
+	histogram_print(&latency.delay);
+	histogram_print(&latency.write);
+	if (latency.dropped) {
+		output_logmessage("latency: %lu marks dropped (queue full)\n", latency.dropped);
+	}
+	return;
+}
+
+/* Remember the first time a milestone is reached, cheap enough for every packet */
+void latency_milestone(latency_milestone_t milestone) {
+	static uint64_t start = 0;
+	if (milestone == MILESTONE_START) {
+		start = now_us();
+		return;
+	}
+	if (milestone_time[milestone] == 0) {
+		/* Never 0, that means "not reached" */
+		milestone_time[milestone] = now_us() - start + 1;
+	}
+	return;
+}
+
+/* Milliseconds from the start to a milestone, -1 if not reached */
+double latency_milestone_ms(latency_milestone_t milestone) {
+	if (milestone_time[milestone] == 0) {
+		return -1;
+	}
+	return (milestone_time[milestone] - 1) / 1000.0;
+}
+
+static void shared_histogram_record(latency_shared_histogram_t *h, uint64_t value) {
+	uint64_t current;
+	atomic_fetch_add(&h->count, 1);
+	atomic_fetch_add(&h->sum, value);
+	atomic_fetch_add(&h->bucket[bucket_index(value)], 1);
+	current = atomic_load(&h->min);
+	while ( (current == 0 || value < current) && ! atomic_compare_exchange_weak(&h->min, &current, value) );
+	current = atomic_load(&h->max);
+	while ( value > current && ! atomic_compare_exchange_weak(&h->max, &current, value) );
+	return;
+}
+
+/* Map the shared timeline file, creating it if necessary */
+static latency_timeline_file_t* timeline_map() {
+	latency_timeline_file_t *timeline = NULL;
+	struct stat st;
+	int fd;
+
+	fd = open(LATENCY_TIMELINE_FILENAME, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+	if (fd < 0) {
+		output_logmessage("timeline: Cannot open %s (ignored): %s\n", LATENCY_TIMELINE_FILENAME, strerror(errno));
+		return NULL;
+	}
+	/* Concurrent processes may both extend the new file, it is zero filled either way */
+	if (fstat(fd, &st) < 0
+		|| (st.st_size == 0 && ftruncate(fd, sizeof(latency_timeline_file_t)) < 0)
+		|| (st.st_size != 0 && st.st_size != sizeof(latency_timeline_file_t)) ) {
+		output_logmessage("timeline: %s has a wrong size, remove it (ignored)\n", LATENCY_TIMELINE_FILENAME);
+		close(fd);
+		return NULL;
+	}
+	timeline = mmap(NULL, sizeof(latency_timeline_file_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (timeline == MAP_FAILED) {
+		output_logmessage("timeline: Cannot map %s (ignored): %s\n", LATENCY_TIMELINE_FILENAME, strerror(errno));
+		return NULL;
+	}
+	if (timeline->magic[0] == 0) {
+		memcpy(timeline->magic, LATENCY_TIMELINE_MAGIC, sizeof(timeline->magic));
+	}
+	if (memcmp(timeline->magic, LATENCY_TIMELINE_MAGIC, sizeof(timeline->magic)) != 0) {
+		output_logmessage("timeline: %s has a wrong format, remove it (ignored)\n", LATENCY_TIMELINE_FILENAME);
+		munmap(timeline, sizeof(latency_timeline_file_t));
+		return NULL;
+	}
+	return timeline;
+}
+
+/* One line with all milestones of this session. CGI sessions measuring the
+ * latency are added to the shared histograms, which are printed too */
+void latency_timeline_report(uint8_t cgi_mode) {
+	latency_timeline_file_t *timeline = NULL;
+	char line[STR_BUF_SIZE];
+	size_t pos = 0;
+	int i, j;
+
+	for (i = MILESTONE_PACKET; i < MILESTONE_COUNT; i++) {
+		if (milestone_time[i]) {
+			pos += snprintf(line + pos, sizeof(line) - pos, " %s=%.1f", milestone_name[i], latency_milestone_ms(i));
+		} else {
+			pos += snprintf(line + pos, sizeof(line) - pos, " %s=-", milestone_name[i]);
+		}
+	}
+	output_logmessage("timeline:%s (ms since start)\n", line);
+	if (! cgi_mode || ! latency.enabled) {
+		return;
+	}
+	timeline = timeline_map();
+	if (! timeline) {
+		return;
+	}
+	atomic_fetch_add(&timeline->sessions, 1);
+	for (i = MILESTONE_PACKET; i < MILESTONE_COUNT; i++) {
+		if (milestone_time[i]) {
+			shared_histogram_record(&timeline->milestone[i], milestone_time[i] - 1);
+		}
+	}
+	output_logmessage("timeline: %lu sessions so far\n", atomic_load(&timeline->sessions));
+	for (i = MILESTONE_PACKET; i < MILESTONE_COUNT; i++) {
+		/* A snapshot, other processes may add values meanwhile */
+		latency_histogram_t h;
+		char name[32];
+		memset(&h, 0, sizeof(h));
+		snprintf(name, sizeof(name), "start to %s", milestone_name[i]);
+		h.name = name;
+		h.count = atomic_load(&timeline->milestone[i].count);
+		h.min = atomic_load(&timeline->milestone[i].min);
+		h.max = atomic_load(&timeline->milestone[i].max);
+		h.sum = atomic_load(&timeline->milestone[i].sum);
+		for (j = 0; j < LATENCY_BUCKETS; j++) {
+			h.bucket[j] = atomic_load(&timeline->milestone[i].bucket[j]);
+		}
+		histogram_print(&h);
+	}
+	munmap(timeline, sizeof(latency_timeline_file_t));
+	return;
+}
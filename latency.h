@@ -0,0 +1,84 @@
+/*
+ *  Latency measurement header
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Histogram with 16 linear sub buckets per power of two (about 6% precision),
+ * values in microseconds up to 2^36 us */
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - 3) * LATENCY_SUB_BUCKETS)
+
+/* Number of ingest marks waiting for their audio data to be written */
+#define LATENCY_MARKS 4096
+
+typedef struct latency_histogram_s {
+	const char * name;
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	uint64_t bucket[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+/* Milestones of the tune-in, the time of the first occurrence is kept */
+typedef enum {
+	MILESTONE_START,        /* process start */
+	MILESTONE_PACKET,       /* first transport stream packet */
+	MILESTONE_PAT,          /* PAT accepted */
+	MILESTONE_PMT,          /* PMT accepted */
+	MILESTONE_PAYLOAD,      /* audio PID subscribed */
+	MILESTONE_SDT,          /* station name found in the SDT */
+	MILESTONE_SYNC,         /* first audio frame header found */
+	MILESTONE_HEADERS,      /* HTTP headers sent (CGI mode) */
+	MILESTONE_AUDIO,        /* first audio data written */
+	MILESTONE_COUNT
+} latency_milestone_t;
+
+/* The tune-in times of all CGI sessions are summed up in this file */
+#define LATENCY_TIMELINE_FILENAME "/var/tmp/ts2shout.timeline"
+
+/* A histogram shared by all processes in LATENCY_TIMELINE_FILENAME */
+typedef struct latency_shared_histogram_s {
+	_Atomic uint64_t count;
+	_Atomic uint64_t min;
+	_Atomic uint64_t max;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t bucket[LATENCY_BUCKETS];
+} latency_shared_histogram_t;
+
+/* In latency.c */
+void latency_init(uint8_t enable);
+void latency_ingest();
+void latency_buffered(uint32_t bytes);
+void latency_write_begin();
+void latency_written(uint32_t bytes);
+void latency_dropped(uint32_t bytes);
+void latency_report();
+void latency_milestone(latency_milestone_t milestone);
+double latency_milestone_ms(latency_milestone_t milestone);
+void latency_timeline_report(uint8_t cgi_mode);
+
+#endif
@@ -0,0 +1,471 @@
+/*
+ *  AAC LATM/LOAS parser
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  DVB radio stations using HE-AAC transport their audio as LOAS/LATM
+ *  (ISO/IEC 14496-3, 1.7). The stream parameters (samplerate, channels)
+ *  are part of the AudioMuxConfig inside the stream itself, so we
+ *  read them out of the stream instead of guessing them from the PMT.
+ *
+ *  RDS data is transported as UECP messages in a data stream element (DSE)
+ *  of the raw AAC data block. As long as the DSE is placed in front of the
+ *  audio elements (that's the case for the stations I know) we can fetch
+ *  it without decoding the audio. Audio elements (SCE, CPE, ...) cannot be
+ *  skipped without Huffman decoding, so everything behind them is out of reach.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ts2shout.h"
+#include "latm.h"
+#include "rds.h"
+
+extern programm_info_t *global_state;
+
+/* Number of LOAS frames used to measure the bitrate */
+#define LATM_BITRATE_FRAMES 200
+
+/* AAC syntax elements (id_syn_ele) */
+#define AAC_ID_DSE 4
+#define AAC_ID_FIL 6
+
+static const uint32_t latm_samplerate[] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350, 0, 0, 0 };
+
+static const uint8_t latm_channels[] = { 0, 1, 2, 3, 4, 5, 6, 8, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+/* Reading single bits out of a buffer */
+typedef struct bitreader_s {
+	const uint8_t *buf;
+	uint32_t size;          /* size of buffer in bits */
+	uint32_t pos;           /* current read position in bits */
+	uint8_t  error;         /* tried to read behind the end of the buffer */
+} bitreader_t;
+
+static struct {
+	uint8_t  buffer[LATM_MAX_FRAME_SIZE + 2]; /* Collects a complete LOAS frame and the syncword of the next one */
+	uint32_t used;
+	latm_config_t config;
+	uint32_t frames;                        /* LOAS frames seen (for the bitrate measurement) */
+	uint64_t frame_bytes;                   /* bytes of these frames */
+	uint32_t dse_count;                     /* data stream elements with RDS data found */
+	uint8_t  uecp_scan;                     /* search the LOAS frames for UECP frames */
+	uint32_t uecp_frames;                   /* LOAS frames with an UECP frame found by the scan */
+} latm;
+
+static uint32_t get_bits(bitreader_t *br, uint8_t n) {
+	uint32_t value = 0;
+	if (br->pos + n > br->size) {
+		br->error = 1;
+		br->pos = br->size;
+		return 0;
+	}
+	while (n > 0) {
+		uint8_t avail = 8 - (br->pos & 7);
+		uint8_t take = (n < avail) ? n : avail;
+		uint8_t byte = br->buf[br->pos >> 3];
+		value = (value << take) | ((byte >> (avail - take)) & ((1 << take) - 1));
+		br->pos += take;
+		n -= take;
+	}
+	return value;
+}
+
+static uint32_t latm_get_value(bitreader_t *br) {
+	uint8_t bytes_for_value = get_bits(br, 2);
+	uint32_t value = 0;
+	uint8_t i;
+	for (i = 0; i <= bytes_for_value; i++) {
+		value = (value << 8) | get_bits(br, 8);
+	}
+	return value;
+}
+
+static uint8_t get_audio_object_type(bitreader_t *br) {
+	uint8_t aot = get_bits(br, 5);
+	if (aot == 31) {
+		aot = 32 + get_bits(br, 6);
+	}
+	return aot;
+}
+
+static uint32_t get_samplerate(bitreader_t *br) {
+	uint8_t index = get_bits(br, 4);
+	if (index == 0x0f) {
+		return get_bits(br, 24);
+	}
+	return latm_samplerate[index];
+}
+
+/* AudioSpecificConfig() with GASpecificConfig(), only General Audio object types are supported */
+static int parse_audio_specific_config(bitreader_t *br, latm_config_t *config) {
+	uint8_t extension_flag;
+	config->sbr = 0;
+	config->ps = 0;
+	config->audio_object_type = get_audio_object_type(br);
+	config->core_samplerate = get_samplerate(br);
+	config->samplerate = config->core_samplerate;
+	config->channel_config = get_bits(br, 4);
+	if (config->audio_object_type == 5 || config->audio_object_type == 29) {
+		/* Explicit hierarchical SBR (HE-AAC) / PS (HE-AACv2) signalling */
+		config->sbr = 1;
+		config->ps = (config->audio_object_type == 29);
+		config->samplerate = get_samplerate(br);
+		config->audio_object_type = get_audio_object_type(br);
+	}
+	switch (config->audio_object_type) {
+		case 1: case 2: case 3: case 4: case 6: case 7:
+		case 17: case 19: case 20: case 21: case 22: case 23:
+			break;
+		default:
+			return 0;
+	}
+	config->frame_length_flag = get_bits(br, 1);
+	if (get_bits(br, 1)) {
+		get_bits(br, 14);   /* coreCoderDelay */
+	}
+	extension_flag = get_bits(br, 1);
+	if (config->channel_config == 0) {
+		/* A program_config_element() follows, not supported */
+		return 0;
+	}
+	if (config->audio_object_type == 6 || config->audio_object_type == 20) {
+		get_bits(br, 3);    /* layerNr */
+	}
+	if (extension_flag) {
+		if (config->audio_object_type == 22) {
+			get_bits(br, 16);   /* numOfSubFrame, layer_length */
+		}
+		if (config->audio_object_type == 17 || config->audio_object_type == 19
+			|| config->audio_object_type == 20 || config->audio_object_type == 23) {
+			get_bits(br, 3);    /* resilience flags */
+		}
+		get_bits(br, 1);        /* extensionFlag3 */
+	}
+	return (! br->error);
+}
+
+/* StreamMuxConfig(), we support one program with one layer (that's what DVB uses) */
+static int parse_stream_mux_config(bitreader_t *br, latm_config_t *config) {
+	uint8_t num_program;
+	uint8_t num_layer;
+	config->audio_mux_version = get_bits(br, 1);
+	if (config->audio_mux_version == 1 && get_bits(br, 1) == 1) {
+		/* audioMuxVersionA = 1 is reserved */
+		return 0;
+	}
+	if (config->audio_mux_version == 1) {
+		latm_get_value(br);     /* taraBufferFullness */
+	}
+	get_bits(br, 1);            /* allStreamsSameTimeFraming */
+	config->num_subframes = get_bits(br, 6);
+	num_program = get_bits(br, 4);
+	num_layer = get_bits(br, 3);
+	if (num_program != 0 || num_layer != 0) {
+		return 0;
+	}
+	if (config->audio_mux_version == 0) {
+		if (! parse_audio_specific_config(br, config)) {
+			return 0;
+		}
+	} else {
+		uint32_t asc_length = latm_get_value(br);
+		uint32_t asc_start = br->pos;
+		if (! parse_audio_specific_config(br, config)) {
+			return 0;
+		}
+		/* Backward compatible SBR signalling behind the AudioSpecificConfig */
+		if (br->pos + 16 <= asc_start + asc_length && get_bits(br, 11) == 0x2b7) {
+			if (get_audio_object_type(br) == 5 && get_bits(br, 1) == 1) {
+				config->sbr = 1;
+				config->samplerate = get_samplerate(br);
+			}
+		}
+		br->pos = asc_start + asc_length;
+	}
+	config->frame_length_type = get_bits(br, 3);
+	if (config->frame_length_type != 0) {
+		/* Only variable frame length (AAC) supported, CELP and HVXC are not */
+		return 0;
+	}
+	get_bits(br, 8);            /* latmBufferFullness */
+	if (get_bits(br, 1)) {
+		/* otherDataPresent */
+		if (config->audio_mux_version == 1) {
+			latm_get_value(br);
+		} else {
+			uint8_t escape;
+			do {
+				escape = get_bits(br, 1);
+				get_bits(br, 8);
+			} while (escape && ! br->error);
+		}
+	}
+	if (get_bits(br, 1)) {
+		get_bits(br, 8);        /* crcCheckSum */
+	}
+	config->valid = (! br->error);
+	return config->valid;
+}
+
+static void latm_config_changed() {
+	const char * name = "AAC";
+	if (latm.config.ps) {
+		name = "HE-AACv2";
+	} else if (latm.config.sbr) {
+		name = "HE-AAC";
+	} else if (latm.config.audio_object_type == 2) {
+		name = "AAC-LC";
+	}
+	global_state->sr = latm.config.samplerate;
+	output_logmessage("latm_parse(): %s (object type %d), %d Hz (core %d Hz), %d channel(s), %d frame(s) per LOAS frame\n",
+		name, latm.config.audio_object_type, latm.config.samplerate, latm.config.core_samplerate,
+		latm_channels[latm.config.channel_config], latm.config.num_subframes + 1);
+	return;
+}
+
+/* Walk through the syntax elements at the start of a raw_data_block() and
+ * hand data stream elements over to the RDS decoder. Byte alignment of the
+ * DSE is relative to the start of the raw_data_block. */
+static void parse_raw_data_block(const bitreader_t *payload, uint32_t length) {
+	bitreader_t br = *payload;
+	uint32_t start = br.pos;
+	br.size = start + length * 8;
+	while (! br.error && br.pos + 3 <= br.size) {
+		uint8_t id = get_bits(&br, 3);
+		if (id == AAC_ID_DSE) {
+			uint8_t dse[512];
+			uint16_t count;
+			uint16_t i;
+			uint8_t align;
+			get_bits(&br, 4);   /* element_instance_tag */
+			align = get_bits(&br, 1);
+			count = get_bits(&br, 8);
+			if (count == 255) {
+				count += get_bits(&br, 8);
+			}
+			if (align) {
+				br.pos = start + (((br.pos - start) + 7) & ~7);
+			}
+			if (br.pos + count * 8 > br.size) {
+				return;
+			}
+			for (i = 0; i < count; i++) {
+				dse[i] = get_bits(&br, 8);
+			}
+			if (count >= 2 && dse[0] == 0xfe) {
+				latm.dse_count++;
+				rds_convert_from_ancillary_data(dse, count);
+			}
+		} else if (id == AAC_ID_FIL) {
+			uint16_t count = get_bits(&br, 4);
+			if (count == 15) {
+				count += get_bits(&br, 8) - 1;
+			}
+			br.pos += count * 8;
+		} else {
+			/* SCE, CPE, CCE, LFE, PCE or END. We cannot skip audio elements without decoding them */
+			return;
+		}
+	}
+	return;
+}
+
+/* AudioMuxElement(1) of one LOAS frame (without the 3 byte LOAS header) */
+static void parse_audio_mux_element(const uint8_t *frame, uint32_t length) {
+	bitreader_t br = { frame, length * 8, 0, 0 };
+	uint8_t i;
+	if (get_bits(&br, 1) == 0) {
+		/* useSameStreamMux == 0, a StreamMuxConfig follows */
+		latm_config_t config;
+		memset(&config, 0, sizeof(latm_config_t));
+		if (! parse_stream_mux_config(&br, &config)) {
+			return;
+		}
+		if (memcmp(&config, &latm.config, sizeof(latm_config_t)) != 0) {
+			latm.config = config;
+			latm_config_changed();
+		}
+	}
+	if (! latm.config.valid) {
+		return;
+	}
+	for (i = 0; i <= latm.config.num_subframes; i++) {
+		/* PayloadLengthInfo() */
+		uint32_t slot_length = 0;
+		uint8_t tmp;
+		do {
+			tmp = get_bits(&br, 8);
+			slot_length += tmp;
+		} while (tmp == 255 && ! br.error);
+		if (br.error || br.pos + slot_length * 8 > br.size) {
+			return;
+		}
+		/* PayloadMux() */
+		if (global_state->prefer_rds) {
+			parse_raw_data_block(&br, slot_length);
+		}
+		br.pos += slot_length * 8;
+	}
+	return;
+}
+
+/* Measure the bitrate out of the frame sizes, it is nowhere given in the stream */
+static void latm_measure_bitrate(uint32_t length) {
+	uint64_t samples;
+	if (latm.frames > LATM_BITRATE_FRAMES || ! latm.config.valid) {
+		return;
+	}
+	latm.frames++;
+	latm.frame_bytes += length;
+	if (latm.frames == LATM_BITRATE_FRAMES) {
+		samples = (uint64_t)(latm.config.frame_length_flag ? 960 : 1024)
+			* (latm.config.num_subframes + 1) * latm.frames;
+		global_state->br = (latm.frame_bytes * 8 * latm.config.core_samplerate) / samples / 1000;
+		output_logmessage("latm_parse(): measured bitrate %d kBit/s\n", global_state->br);
+	}
+	return;
+}
+
+/* Is there a complete UECP frame (0xfe, stuffed message with valid CRC, 0xff)? */
+static int uecp_find(const uint8_t *data, uint32_t size) {
+	const uint8_t *end = data + size;
+	const uint8_t *start = data;
+	while ((start = memchr(start, 0xfe, end - start)) != NULL) {
+		uint8_t message[255];
+		uint16_t used = 0;
+		const uint8_t *p = start + 1;
+		while (p < end && *p < 0xfe && used < sizeof(message)) {
+			if (*p == 0xfd) {
+				/* 0xfd 0x00..0x02 stands for 0xfd..0xff */
+				if (p + 1 == end || p[1] > 2) {
+					break;
+				}
+				p++;
+				message[used++] = 0xfd + *p++;
+			} else {
+				message[used++] = *p++;
+			}
+		}
+		/* address (2), sequence, length, message element, CRC (2) */
+		if (p < end && *p == 0xff && used >= 7 && used == message[3] + 6
+			&& crc16(message, used) == 0) {
+			return 1;
+		}
+		start++;
+	}
+	return 0;
+}
+
+/* The native parser only finds DSEs in front of the audio elements, DSEs
+ * behind them need the decoder. Look for UECP frames anywhere in the
+ * AudioMuxElement instead, the DSE bytes may start at any bit */
+static void uecp_prescan(const uint8_t *frame, uint32_t length) {
+	uint8_t shifted[LATM_MAX_FRAME_SIZE];
+	uint8_t shift;
+	uint32_t i;
+	if (uecp_find(frame, length)) {
+		latm.uecp_frames++;
+		return;
+	}
+	for (shift = 1; shift < 8 && length > 1; shift++) {
+		for (i = 0; i < length - 1; i++) {
+			shifted[i] = (frame[i] << shift) | (frame[i + 1] >> (8 - shift));
+		}
+		if (uecp_find(shifted, length - 1)) {
+			latm.uecp_frames++;
+			return;
+		}
+	}
+	return;
+}
+
+/* Cut the collected data into LOAS frames (AudioSyncStream) and parse them */
+static void latm_process_buffer() {
+	uint32_t offset = 0;
+	while (latm.used - offset >= 3) {
+		uint8_t *frame = latm.buffer + offset;
+		uint32_t length;
+		if (frame[0] != 0x56 || (frame[1] & 0xe0) != 0xe0) {
+			/* Lost sync, search the next syncword 0x2b7 */
+			uint8_t *next = memchr(frame + 1, 0x56, latm.used - offset - 1);
+			offset = (next ? next - latm.buffer : latm.used);
+			continue;
+		}
+		length = (((frame[1] & 0x1f) << 8) | frame[2]) + 3;
+		if (latm.used - offset < length + 2) {
+			/* wait for the complete frame and the start of the next one */
+			break;
+		}
+		if (frame[length] != 0x56 || (frame[length + 1] & 0xe0) != 0xe0) {
+			/* Not followed by a syncword, so it wasn't one */
+			offset += 1;
+			continue;
+		}
+		parse_audio_mux_element(frame + 3, length - 3);
+		if (latm.uecp_scan && latm.dse_count == 0) {
+			uecp_prescan(frame + 3, length - 3);
+		}
+		latm_measure_bitrate(length);
+		offset += length;
+	}
+	if (offset > 0) {
+		memmove(latm.buffer, latm.buffer + offset, latm.used - offset);
+		latm.used -= offset;
+	}
+	return;
+}
+
+/* Feed elementary stream data of a LATM/LOAS audio stream */
+void latm_parse(const unsigned char *data, size_t len) {
+	while (len > 0) {
+		size_t take = sizeof(latm.buffer) - latm.used;
+		if (take > len) {
+			take = len;
+		}
+		memcpy(latm.buffer + latm.used, data, take);
+		latm.used += take;
+		data += take;
+		len -= take;
+		latm_process_buffer();
+		if (latm.used == sizeof(latm.buffer)) {
+			/* No frame found in a full buffer, throw it away */
+			latm.used = 0;
+		}
+	}
+	return;
+}
+
+/* Number of data stream elements with RDS data found */
+uint32_t latm_data_stream_elements() {
+	return latm.dse_count;
+}
+
+/* Switch the search for UECP frames the native parser can't find on or off */
+void latm_uecp_scan(uint8_t enable) {
+	latm.uecp_scan = enable;
+	return;
+}
+
+/* Number of LOAS frames the search found UECP frames in */
+uint32_t latm_uecp_frames() {
+	return latm.uecp_frames;
+}
@@ -0,0 +1,51 @@
+/*
+ *  AAC LATM/LOAS parser header
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef _LATM_H
+#define _LATM_H
+
+#include <stdint.h>
+
+/* A LOAS frame has a 13 bit length field plus 3 byte header */
+#define LATM_MAX_FRAME_SIZE (8191 + 3)
+
+/* The stream parameters as found in the AudioMuxConfig */
+typedef struct latm_config_s {
+	uint8_t  valid;                 /* A StreamMuxConfig was parsed successfully */
+	uint8_t  audio_mux_version;
+	uint8_t  audio_object_type;     /* AOT of the core codec, 2 = AAC-LC */
+	uint8_t  sbr;                   /* Spectral band replication (HE-AAC) signalled */
+	uint8_t  ps;                    /* Parametric stereo (HE-AACv2) signalled */
+	uint8_t  channel_config;
+	uint8_t  frame_length_flag;     /* 960 instead of 1024 samples per frame */
+	uint8_t  num_subframes;         /* number of AAC frames in a LOAS frame - 1 */
+	uint8_t  frame_length_type;
+	uint32_t core_samplerate;
+	uint32_t samplerate;            /* output samplerate, doubled if SBR is used */
+} latm_config_t;
+
+/* In latm.c */
+void latm_parse(const unsigned char *data, size_t len);
+uint32_t latm_data_stream_elements();
+void latm_uecp_scan(uint8_t enable);
+uint32_t latm_uecp_frames();
+
+#endif
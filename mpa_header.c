@@ -284,6 +284,37 @@ int mpa_header_parse( const unsigned char* buf, mpa_header_t *mh)
 	}
 }
 
+/* Get the length of the MPEG audio frame starting at buf, if it belongs to
+ * the stream we are synced to (same version, layer and samplerate as given in mh).
+ * Only the first three bytes of buf are read.
+ * The bitrate and padding are taken from the header itself. Returns 0 if buf
+ * does not start with a matching frame header. Used by the RDS frame walker. */
+unsigned int mpa_frame_length( const unsigned char* buf, const mpa_header_t *mh)
+{
+	unsigned int bitrate;
+	unsigned int samplerate;
+	unsigned int padding;
+
+	if (buf[0] != 0xff || buf[1] != mh->sync1)
+		return 0;
+	if ((buf[2] & 0x0c) != (mh->sync2 & 0x0c))
+		return 0;
+	bitrate = mp2_bitrate[mh->version][mh->layer][(buf[2] >> 4) & 0x0f];
+	samplerate = mp2_samplerate[mh->version][(buf[2] >> 2) & 0x03];
+	padding = (buf[2] >> 1) & 0x01;
+	if (bitrate == 0 || samplerate == 0)
+		return 0;
+	if (mh->layer == 3) {
+		/* Layer I, slots are 4 bytes long */
+		return ((12 * bitrate * 1000 / samplerate) + padding) * 4;
+	}
+	if (mh->layer == 1 && mh->version != 3) {
+		/* Layer III with MPEG-2/2.5 only has 576 samples per frame */
+		return (72 * bitrate * 1000 / samplerate) + padding;
+	}
+	return (144 * bitrate * 1000 / samplerate) + padding;
+}
+
 // Parse AC-3 Audio header
 // returns 1 if valid, or 0 if invalid
 // Header info found at http://stnsoft.com/DVD/ac3hdr.html#bsmod
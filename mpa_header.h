@@ -60,6 +60,9 @@ int mpa_header_parse( const unsigned char* buf, mpa_header_t *mh);
 
 void mpa_header_print( mpa_header_t *mh );
 
+// Get the length of a frame of the synced mpeg audio stream (0 if no matching header)
+unsigned int mpa_frame_length( const unsigned char* buf, const mpa_header_t *mh);
+
 /* AC-3 parsing */
 int ac3_header_parse( const unsigned char* buf, mpa_header_t *mh);
 void ac3_header_print( mpa_header_t *mh );
@@ -0,0 +1,304 @@
+/*
+ *  Now playing event output
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  Home automation or display systems want to know the station and the
+ *  current title without opening an audio stream or parsing the log.
+ *  ts2shout listens on a Unix domain socket and sends Server-Sent Events
+ *  (text/event-stream) to every connected consumer, one JSON object per
+ *  change of station or StreamTitle:
+ *
+ *    curl -N --unix-socket /run/ts2shout.sock http://localhost/
+ *
+ *  The socket is never allowed to block the audio output, consumers that
+ *  don't read their events are disconnected.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* accept4() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ts2shout.h"
+#include "rds.h"
+#include "services.h"
+#include "nowplaying.h"
+
+extern programm_info_t *global_state;
+
+static const char nowplaying_header[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: text/event-stream; charset=utf-8\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n";
+
+static struct {
+	int listen_fd;
+	int client[NOWPLAYING_MAX_CLIENTS];
+	uint32_t id;                            /* event id, counts the changes */
+	char event[NOWPLAYING_EVENT_SIZE];      /* the last event, sent to new consumers */
+	size_t event_length;
+	char multiplex[NOWPLAYING_MULTIPLEX_SIZE]; /* the last event with all radio services of the multiplex */
+	size_t multiplex_length;
+	struct sockaddr_un address;
+} nowplaying = { .listen_fd = -1 };
+
+/* Append a JSON string (UTF-8) with quotes and escapes */
+static size_t json_string(char* out, size_t pos, size_t size, const char* in) {
+	const unsigned char* c = (const unsigned char*)in;
+	if (pos + 8 >= size) {
+		return pos;
+	}
+	out[pos++] = '"';
+	for (; *c && pos + 8 < size; c++) {
+		if (*c == '"' || *c == '\\') {
+			out[pos++] = '\\';
+			out[pos++] = *c;
+		} else if (*c < 0x20) {
+			pos += snprintf(out + pos, size - pos, "\\u%04x", *c);
+		} else {
+			out[pos++] = *c;
+		}
+	}
+	out[pos++] = '"';
+	out[pos] = 0;
+	return pos;
+}
+
+/* Append to the event, the output is cut if it doesn't fit */
+static size_t json_printf(char* out, size_t pos, size_t size, const char* fmt, ...) {
+	va_list argp;
+	int length;
+	if (pos + 1 >= size) {
+		return pos;
+	}
+	va_start(argp, fmt);
+	length = vsnprintf(out + pos, size - pos, fmt, argp);
+	va_end(argp);
+	if (length < 0) {
+		return pos;
+	}
+	return (pos + length < size) ? pos + length : size - 1;
+}
+
+/* Send data to a consumer, a consumer that can't take it is disconnected */
+static void nowplaying_send(int i, const char* data, size_t length) {
+	ssize_t sent = send(nowplaying.client[i], data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent != (ssize_t)length) {
+		close(nowplaying.client[i]);
+		nowplaying.client[i] = -1;
+	}
+	return;
+}
+
+void nowplaying_init(const char* path) {
+	int i;
+	int fd;
+	int result;
+	for (i = 0; i < NOWPLAYING_MAX_CLIENTS; i++) {
+		nowplaying.client[i] = -1;
+	}
+	if (path == NULL || path[0] == 0) {
+		return;
+	}
+	if (strlen(path) >= sizeof(nowplaying.address.sun_path)) {
+		output_logmessage("nowplaying_init(): Socket path %s too long\n", path);
+		return;
+	}
+	nowplaying.address.sun_family = AF_UNIX;
+	strcpy(nowplaying.address.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		output_logmessage("nowplaying_init(): socket() failed: %s\n", strerror(errno));
+		return;
+	}
+	result = bind(fd, (struct sockaddr*)&nowplaying.address, sizeof(nowplaying.address));
+	if (result < 0 && errno == EADDRINUSE) {
+		/* Another ts2shout may be serving the socket (e.g. a second listener in CGI mode),
+		 * otherwise it's a leftover of a previous run */
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (probe >= 0 && connect(probe, (struct sockaddr*)&nowplaying.address, sizeof(nowplaying.address)) == 0) {
+			output_logmessage("nowplaying_init(): %s is served by another process\n", path);
+			close(probe);
+			close(fd);
+			return;
+		}
+		if (probe >= 0) {
+			close(probe);
+		}
+		unlink(path);
+		result = bind(fd, (struct sockaddr*)&nowplaying.address, sizeof(nowplaying.address));
+	}
+	if (result < 0 || listen(fd, NOWPLAYING_MAX_CLIENTS) < 0) {
+		output_logmessage("nowplaying_init(): Can't listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return;
+	}
+	nowplaying.listen_fd = fd;
+	output_logmessage("nowplaying_init(): Sending now playing events on %s\n", path);
+	return;
+}
+
+/* Accept new consumers and discard whatever they send us (e.g. a HTTP request),
+ * called every 64 transport stream packets */
+void nowplaying_poll() {
+	char discard[512];
+	int fd;
+	int i;
+	if (nowplaying.listen_fd < 0) {
+		return;
+	}
+	while ((fd = accept4(nowplaying.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		for (i = 0; i < NOWPLAYING_MAX_CLIENTS && nowplaying.client[i] >= 0; i++);
+		if (i == NOWPLAYING_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		nowplaying.client[i] = fd;
+		nowplaying_send(i, nowplaying_header, sizeof(nowplaying_header) - 1);
+		if (nowplaying.client[i] >= 0 && nowplaying.event_length > 0) {
+			nowplaying_send(i, nowplaying.event, nowplaying.event_length);
+		}
+		if (nowplaying.client[i] >= 0 && nowplaying.multiplex_length > 0) {
+			nowplaying_send(i, nowplaying.multiplex, nowplaying.multiplex_length);
+		}
+	}
+	for (i = 0; i < NOWPLAYING_MAX_CLIENTS; i++) {
+		ssize_t received;
+		if (nowplaying.client[i] < 0) {
+			continue;
+		}
+		while ((received = recv(nowplaying.client[i], discard, sizeof(discard), MSG_DONTWAIT)) > 0);
+		/* 0 is an orderly shutdown of the consumer */
+		if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			close(nowplaying.client[i]);
+			nowplaying.client[i] = -1;
+		}
+	}
+	if (services_changed()) {
+		nowplaying_publish_multiplex();
+	}
+	return;
+}
+
+/* Station or StreamTitle have changed, build the event and send it to all consumers */
+void nowplaying_publish() {
+	char* event = nowplaying.event;
+	size_t pos;
+	int i;
+	if (nowplaying.listen_fd < 0) {
+		return;
+	}
+	nowplaying.id++;
+	pos = json_printf(event, 0, NOWPLAYING_EVENT_SIZE, "id: %u\nevent: nowplaying\ndata: {\"station\":", nowplaying.id);
+	pos = json_string(event, pos, NOWPLAYING_EVENT_SIZE, global_state->station_name);
+	pos = json_printf(event, pos, NOWPLAYING_EVENT_SIZE, ",\"title\":");
+	pos = json_string(event, pos, NOWPLAYING_EVENT_SIZE, global_state->stream_title);
+	pos = json_printf(event, pos, NOWPLAYING_EVENT_SIZE, ",\"artist\":");
+	pos = json_string(event, pos, NOWPLAYING_EVENT_SIZE, global_state->stream_artist);
+	pos = json_printf(event, pos, NOWPLAYING_EVENT_SIZE, ",\"song\":");
+	pos = json_string(event, pos, NOWPLAYING_EVENT_SIZE, global_state->stream_song);
+	pos = json_printf(event, pos, NOWPLAYING_EVENT_SIZE, ",\"source\":\"%s\"", global_state->found_rds ? "rds" : "eit");
+	if (rds_programme_identification() != 0) {
+		pos = json_printf(event, pos, NOWPLAYING_EVENT_SIZE, ",\"rds_pi\":\"%04X\",\"rds_ps\":", rds_programme_identification());
+		pos = json_string(event, pos, NOWPLAYING_EVENT_SIZE, rds_programme_service_name());
+	}
+	if (global_state->stream_logo[0] != 0) {
+		char logo[sizeof(DSMCC_CACHE_DIRECTORY) + STR_BUF_SIZE];
+		snprintf(logo, sizeof(logo), DSMCC_CACHE_DIRECTORY "/%s", global_state->stream_logo);
+		pos = json_printf(event, pos, NOWPLAYING_EVENT_SIZE, ",\"logo\":");
+		pos = json_string(event, pos, NOWPLAYING_EVENT_SIZE, logo);
+	}
+	pos = json_printf(event, pos, NOWPLAYING_EVENT_SIZE, ",\"playtime\":%u}\n\n", global_state->playtime_s);
+	nowplaying.event_length = pos;
+	for (i = 0; i < NOWPLAYING_MAX_CLIENTS; i++) {
+		if (nowplaying.client[i] >= 0) {
+			nowplaying_send(i, event, pos);
+		}
+	}
+	return;
+}
+
+/* Names and titles of the radio services in the multiplex have changed (option multiplex),
+ * send all of them. Services that don't fit into the event are left out */
+void nowplaying_publish_multiplex() {
+	char* event = nowplaying.multiplex;
+	char one[NOWPLAYING_EVENT_SIZE];
+	const service_entry_t *entry;
+	uint32_t position = 0;
+	size_t pos;
+	size_t length;
+	int i;
+	if (nowplaying.listen_fd < 0) {
+		return;
+	}
+	nowplaying.id++;
+	pos = json_printf(event, 0, NOWPLAYING_MULTIPLEX_SIZE, "id: %u\nevent: multiplex\ndata: {\"services\":[", nowplaying.id);
+	while ((entry = services_next(&position)) != NULL) {
+		length = json_printf(one, 0, sizeof(one), "%s{\"transport_stream_id\":%u,\"service_id\":%u,\"station\":",
+			(event[pos - 1] == '[' ? "" : ","), entry->transport_stream_id, entry->service_id);
+		length = json_string(one, length, sizeof(one), entry->name);
+		length = json_printf(one, length, sizeof(one), ",\"provider\":");
+		length = json_string(one, length, sizeof(one), entry->provider);
+		length = json_printf(one, length, sizeof(one), ",\"present\":");
+		length = json_string(one, length, sizeof(one), entry->present);
+		length = json_printf(one, length, sizeof(one), ",\"following\":");
+		length = json_string(one, length, sizeof(one), entry->following);
+		length = json_printf(one, length, sizeof(one), "}");
+		/* Keep room for the end of the event */
+		if (pos + length + 8 >= NOWPLAYING_MULTIPLEX_SIZE) {
+			break;
+		}
+		memcpy(event + pos, one, length);
+		pos += length;
+	}
+	pos = json_printf(event, pos, NOWPLAYING_MULTIPLEX_SIZE, "]}\n\n");
+	nowplaying.multiplex_length = pos;
+	for (i = 0; i < NOWPLAYING_MAX_CLIENTS; i++) {
+		if (nowplaying.client[i] >= 0) {
+			nowplaying_send(i, event, pos);
+		}
+	}
+	return;
+}
+
+void nowplaying_close() {
+	int i;
+	if (nowplaying.listen_fd < 0) {
+		return;
+	}
+	for (i = 0; i < NOWPLAYING_MAX_CLIENTS; i++) {
+		if (nowplaying.client[i] >= 0) {
+			close(nowplaying.client[i]);
+		}
+	}
+	close(nowplaying.listen_fd);
+	unlink(nowplaying.address.sun_path);
+	nowplaying.listen_fd = -1;
+	return;
+}
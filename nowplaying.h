@@ -0,0 +1,39 @@
+/*
+ *  Now playing event output header
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef _NOWPLAYING_H
+#define _NOWPLAYING_H
+
+/* Maximum number of connected consumers */
+#define NOWPLAYING_MAX_CLIENTS 8
+/* Size of one event (JSON with station, title, artist, song and RDS info) */
+#define NOWPLAYING_EVENT_SIZE 16384
+/* Size of the event with all radio services of the multiplex */
+#define NOWPLAYING_MULTIPLEX_SIZE 65536
+
+/* In nowplaying.c */
+void nowplaying_init(const char* path);
+void nowplaying_poll();
+void nowplaying_publish();
+void nowplaying_publish_multiplex();
+void nowplaying_close();
+
+#endif
@@ -0,0 +1,402 @@
+/*
+ *  PSI (PAT/PMT) tables
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  The sections of the PAT and the PMTs are assembled per PID, a section may
+ *  span several transport stream packets and several sections may share one
+ *  packet (pointer_field). All sections of the PAT are collected, the PMT of
+ *  every programme is parsed once per version into a fixed table without any
+ *  allocation. Out of these the programme to be played is picked by its
+ *  service_id: the wanted one if it is given, otherwise the lowest service_id
+ *  with an audio stream. A multi programme stream (not rewritten by tvheadend
+ *  or vdr) thus always plays the same station, no matter which PMT comes first.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ts2shout.h"
+#include "psi.h"
+
+typedef void (*psi_section_handler_t)(uint16_t pid, unsigned char *section, uint16_t length);
+
+static struct {
+	psi_assembler_t pat_assembler;
+	uint8_t  pat_valid;                 /* a PAT section was accepted, version and transport_stream_id are set */
+	uint8_t  pat_version;
+	uint16_t transport_stream_id;
+	uint8_t  pat_last_section;
+	uint8_t  pat_section_seen[256 / 8]; /* bitmap of the received PAT sections */
+	uint8_t  pat_complete;              /* all sections of the PAT are there */
+	uint8_t  pat_changed;               /* the PAT became complete in this packet */
+	uint32_t pat_repetitions;           /* PAT repetitions since it is complete */
+	uint8_t  program_overflow;          /* more than PSI_MAX_PROGRAMS programmes in the PAT (logged once) */
+	uint16_t wanted_service_id;         /* 0 = the lowest service_id with audio */
+	uint8_t  wanted_missing;            /* the wanted service_id is not available (logged once) */
+	const psi_program_t *selected;
+	uint32_t program_count;
+	psi_program_t program[PSI_MAX_PROGRAMS];
+} psi;
+
+/* Append data to a section spanning several packets, the section is handed
+ * over as soon as it is complete */
+static void psi_append(psi_assembler_t *assembler, uint16_t pid, unsigned char *data, size_t len, psi_section_handler_t handler) {
+	size_t section_size;
+	size_t take;
+
+	/* The first three bytes give the size of the section */
+	if (assembler->used < 3) {
+		take = 3 - assembler->used;
+		take = (len < take) ? len : take;
+		memcpy(assembler->buffer + assembler->used, data, take);
+		assembler->used += take;
+		data += take;
+		len -= take;
+		if (assembler->used < 3) {
+			return;
+		}
+	}
+	section_size = PAT_SECTION_LENGTH(assembler->buffer) + 3;
+	if (section_size > PSI_SECTION_SIZE) {
+		assembler->used = 0;
+		return;
+	}
+	take = section_size - assembler->used;
+	take = (len < take) ? len : take;
+	memcpy(assembler->buffer + assembler->used, data, take);
+	assembler->used += take;
+	if (assembler->used == section_size) {
+		assembler->used = 0;
+		handler(pid, assembler->buffer, section_size);
+	}
+	return;
+}
+
+/* Feed the payload of one transport stream packet into the assembler */
+static void psi_assemble(psi_assembler_t *assembler, uint16_t pid, unsigned char *payload, size_t len, int unit_start, psi_section_handler_t handler) {
+	size_t pointer;
+	size_t section_size;
+
+	if (! unit_start) {
+		/* Only the continuation of a section is of interest */
+		if (assembler->used > 0) {
+			psi_append(assembler, pid, payload, len, handler);
+		}
+		return;
+	}
+	if (len < 1 || payload[0] >= len) {
+		assembler->used = 0;
+		return;
+	}
+	pointer = payload[0];
+	payload += 1;
+	len -= 1;
+	/* The bytes up to the pointer finish the section of the last packet(s) */
+	if (assembler->used > 0) {
+		psi_append(assembler, pid, payload, pointer, handler);
+		assembler->used = 0;
+	}
+	payload += pointer;
+	len -= pointer;
+	/* Several sections may follow, the rest of the packet is stuffed with 0xff */
+	while (len > 0 && payload[0] != 0xff) {
+		if (len < 3) {
+			psi_append(assembler, pid, payload, len, handler);
+			return;
+		}
+		section_size = PAT_SECTION_LENGTH(payload) + 3;
+		if (section_size > PSI_SECTION_SIZE) {
+			return;
+		}
+		if (section_size > len) {
+			psi_append(assembler, pid, payload, len, handler);
+			return;
+		}
+		handler(pid, payload, section_size);
+		payload += section_size;
+		len -= section_size;
+	}
+	return;
+}
+
+static psi_program_t* psi_find_program(uint16_t service_id) {
+	uint32_t i;
+	for (i = 0; i < psi.program_count; i++) {
+		if (psi.program[i].service_id == service_id) {
+			return &psi.program[i];
+		}
+	}
+	return NULL;
+}
+
+/* Start over with a new version of the PAT */
+static void psi_reset() {
+	psi.pat_valid = 0;
+	psi.pat_complete = 0;
+	psi.pat_repetitions = 0;
+	psi.program_overflow = 0;
+	psi.wanted_missing = 0;
+	memset(psi.pat_section_seen, 0, sizeof(psi.pat_section_seen));
+	memset(psi.program, 0, sizeof(psi_program_t) * psi.program_count);
+	psi.program_count = 0;
+	return;
+}
+
+static void psi_pat_section(uint16_t pid, unsigned char *section, uint16_t length) {
+	uint8_t version = (section[5] >> 1) & 0x1f;
+	uint8_t section_number = PAT_SECTION_NUMBER(section);
+	unsigned char *one_program;
+	uint32_t i;
+
+	/* Only the currently valid table 0 */
+	if (PAT_TABLE_ID(section) != 0 || (section[5] & 0x01) == 0 || length < 12) {
+		return;
+	}
+	if (dvb_crc32(section, length) != 0) {
+		output_logmessage("psi_pat_section(): crc32 does not match, PAT section ignored\n");
+		return;
+	}
+	if (psi.pat_valid && (psi.pat_version != version || psi.transport_stream_id != PAT_TRANSPORT_STREAM_ID(section))) {
+		/* The streams are subscribed already, stay with them */
+		if (psi.selected) {
+			return;
+		}
+		output_logmessage("psi_pat_section(): PAT changed (transport_stream_id %d, version %d), collecting it again\n",
+			PAT_TRANSPORT_STREAM_ID(section), version);
+		psi_reset();
+	}
+	if (! psi.pat_valid) {
+		psi.pat_valid = 1;
+		psi.pat_version = version;
+		psi.transport_stream_id = PAT_TRANSPORT_STREAM_ID(section);
+		psi.pat_last_section = PAT_LAST_SECTION_NUMBER(section);
+	}
+	if (section_number == 0 && psi.pat_complete) {
+		psi.pat_repetitions += 1;
+	}
+	if (section_number > psi.pat_last_section || (psi.pat_section_seen[section_number / 8] & (1 << (section_number % 8)))) {
+		return;
+	}
+	psi.pat_section_seen[section_number / 8] |= 1 << (section_number % 8);
+	/* 8 bytes header, 4 bytes CRC, 4 bytes per programme */
+	one_program = PAT_PROGRAMME_START(section);
+	for (i = 0; i + 4 <= length - 12u; i += 4) {
+		uint16_t service_id = (one_program[i] << 8) | one_program[i + 1];
+		uint16_t pmt_pid = PAT_PROGRAMME_PMT( (one_program + i) );
+		/* Only normal programmes, not the NIT et.al. */
+		if (service_id == 0 || pmt_pid <= 0x11 || psi_find_program(service_id)) {
+			continue;
+		}
+		if (psi.program_count == PSI_MAX_PROGRAMS) {
+			if (! psi.program_overflow) {
+				output_logmessage("psi_pat_section(): More than %d programmes in the PAT, ignoring the rest\n", PSI_MAX_PROGRAMS);
+				psi.program_overflow = 1;
+			}
+			break;
+		}
+		psi.program[psi.program_count].service_id = service_id;
+		psi.program[psi.program_count].pmt_pid = pmt_pid;
+		psi.program_count += 1;
+	}
+	for (i = 0; i <= psi.pat_last_section; i++) {
+		if ((psi.pat_section_seen[i / 8] & (1 << (i % 8))) == 0) {
+			return;
+		}
+	}
+	psi.pat_complete = 1;
+	psi.pat_changed = 1;
+	return;
+}
+
+static void psi_pmt_section(uint16_t pid, unsigned char *section, uint16_t length) {
+	uint8_t version = (section[5] >> 1) & 0x1f;
+	psi_program_t *program;
+	uint32_t offset;
+	uint32_t end;
+
+	/* Each programme has exactly one section (number 0) of table 2 */
+	if (PMT_TABLE_ID(section) != 2 || (section[5] & 0x01) == 0 || PMT_SECTION_NUMBER(section) != 0 || length < 16) {
+		return;
+	}
+	program = psi_find_program(PMT_PROGRAM_NUMBER(section));
+	if (! program || program->pmt_pid != pid) {
+		return;
+	}
+	/* Every programme is parsed only once */
+	if (program->complete && program->version == version) {
+		return;
+	}
+	if (dvb_crc32(section, length) != 0) {
+		output_logmessage("psi_pmt_section(): crc32 does not match, PMT section of service_id %d ignored\n", program->service_id);
+		return;
+	}
+	memcpy(program->section, section, length);
+	program->version = version;
+	program->pcr_pid = PMT_PCR_PID(section);
+	program->stream_count = 0;
+	/* The elementary streams follow the programme descriptors, the CRC ends the section */
+	offset = 12 + PMT_PROGRAMME_INFO_LENGTH(section);
+	end = length - 4;
+	while (offset + 5 <= end && program->stream_count < PSI_MAX_STREAMS) {
+		unsigned char *es = program->section + offset;
+		if (offset + 5 + PMT_INFO_LENGTH(es) > end) {
+			break;
+		}
+		program->stream[program->stream_count] = es;
+		program->stream_count += 1;
+		offset += 5 + PMT_INFO_LENGTH(es);
+	}
+	program->complete = 1;
+#ifdef DEBUG
+	fprintf(stderr, "psi_pmt_section(): PMT of service_id %d (PID %d, version %d) with %d stream(s)\n",
+		program->service_id, pid, version, program->stream_count);
+#endif
+	return;
+}
+
+/* Does the programme carry audio ts2shout is able to stream? */
+static int psi_program_has_audio(const psi_program_t *program) {
+	uint32_t i;
+	for (i = 0; i < program->stream_count; i++) {
+		unsigned char *es = program->stream[i];
+		uint32_t offset = 0;
+		switch (PMT_STREAM_TYPE(es)) {
+			case 0x03:	/* MPEG 1 audio */
+			case 0x04:	/* MPEG 2 audio */
+			case 0x0f:	/* MPEG 2 AAC */
+			case 0x11:	/* MPEG 4 AAC LATM */
+				return 1;
+			case 0x06:	/* AC-3, if there is an AC-3 descriptor */
+				while (offset < PMT_INFO_LENGTH(es)) {
+					unsigned char *descriptor_pointer = PMT_FIRST_STREAM_DESCRIPTORP(es) + offset;
+					if (DESCRIPTOR_TAG(descriptor_pointer) == 0x6a) {
+						return 1;
+					}
+					offset += DESCRIPTOR_LENGTH(descriptor_pointer) + 2;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	return 0;
+}
+
+/* The programme to be played, 0 selects the lowest service_id with audio */
+void psi_want_service(uint16_t service_id) {
+	psi.wanted_service_id = service_id;
+	return;
+}
+
+/* Feed a packet of PID 0, returns 1 if the PAT has just become complete */
+int psi_pat_packet(unsigned char *payload, size_t len, int unit_start) {
+	psi.pat_changed = 0;
+	psi_assemble(&psi.pat_assembler, 0, payload, len, unit_start, psi_pat_section);
+	return psi.pat_changed;
+}
+
+/* Feed a packet of a PMT PID, several programmes may share it */
+void psi_pmt_packet(uint16_t pid, unsigned char *payload, size_t len, int unit_start) {
+	uint32_t i;
+	for (i = 0; i < psi.program_count; i++) {
+		if (psi.program[i].pmt_pid == pid) {
+			psi_assemble(&psi.program[i].assembler, pid, payload, len, unit_start, psi_pmt_section);
+			return;
+		}
+	}
+	return;
+}
+
+/* Packets are lost, throw away the partially collected section */
+void psi_discontinuity(uint16_t pid) {
+	uint32_t i;
+	if (pid == 0) {
+		psi.pat_assembler.used = 0;
+		return;
+	}
+	for (i = 0; i < psi.program_count; i++) {
+		if (psi.program[i].pmt_pid == pid) {
+			psi.program[i].assembler.used = 0;
+			return;
+		}
+	}
+	return;
+}
+
+uint16_t psi_transport_stream_id() {
+	return psi.transport_stream_id;
+}
+
+uint32_t psi_program_count() {
+	return psi.program_count;
+}
+
+const psi_program_t* psi_program(uint32_t index) {
+	return (index < psi.program_count) ? &psi.program[index] : NULL;
+}
+
+/* Pick the programme to be played. The wanted service_id is taken as soon as
+ * its PMT is there, otherwise the lowest service_id with audio once all PMTs
+ * are parsed. If some PMTs don't show up (some systems remove the PMTs but
+ * keep the PAT) the PMTs seen so far are used after a few PAT repetitions.
+ * Returns NULL as long as there is no decision. */
+const psi_program_t* psi_select() {
+	const psi_program_t *best = NULL;
+	uint8_t all_complete = 1;
+	uint8_t timeout;
+	uint32_t i;
+
+	if (psi.selected || ! psi.pat_complete) {
+		return psi.selected;
+	}
+	timeout = (psi.pat_repetitions >= PSI_SELECT_PAT_REPETITIONS);
+	if (psi.wanted_service_id && ! psi.wanted_missing) {
+		const psi_program_t *wanted = psi_find_program(psi.wanted_service_id);
+		if (wanted && wanted->complete && psi_program_has_audio(wanted)) {
+			psi.selected = wanted;
+			output_logmessage("psi_select(): Using service_id %d (PMT PID %d) out of %d programme(s)\n",
+				wanted->service_id, wanted->pmt_pid, psi.program_count);
+			return psi.selected;
+		}
+		if (wanted && ! wanted->complete && ! timeout) {
+			return NULL;
+		}
+		output_logmessage("psi_select(): service_id %d %s, using the lowest service_id with audio\n", psi.wanted_service_id,
+			(! wanted ? "is not in the PAT" : (wanted->complete ? "has no audio stream" : "has no PMT")));
+		psi.wanted_missing = 1;
+	}
+	for (i = 0; i < psi.program_count; i++) {
+		const psi_program_t *program = &psi.program[i];
+		if (! program->complete) {
+			all_complete = 0;
+			continue;
+		}
+		if (psi_program_has_audio(program) && (! best || program->service_id < best->service_id)) {
+			best = program;
+		}
+	}
+	if ((! all_complete && ! timeout) || ! best) {
+		return NULL;
+	}
+	psi.selected = best;
+	output_logmessage("psi_select(): Using service_id %d (PMT PID %d) out of %d programme(s)%s\n",
+		best->service_id, best->pmt_pid, psi.program_count, (all_complete ? "" : ", not all PMTs found"));
+	return psi.selected;
+}
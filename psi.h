@@ -0,0 +1,70 @@
+/*
+ *  PSI (PAT/PMT) tables header
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef _PSI_H
+#define _PSI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A PAT or PMT section is at most 1024 bytes (section_length <= 1021) */
+#define PSI_SECTION_SIZE 1024
+
+/* Programmes of the PAT we keep track of, further ones are ignored */
+#define PSI_MAX_PROGRAMS 64
+
+/* Elementary streams of one programme */
+#define PSI_MAX_STREAMS 32
+
+/* If not all PMTs show up the programme is picked out of the PMTs seen
+ * after this number of PAT repetitions (the PAT is repeated every 100ms, at most every 500ms) */
+#define PSI_SELECT_PAT_REPETITIONS 4
+
+/* Collects the sections of one PID out of the transport stream packets */
+typedef struct psi_assembler_s {
+	uint16_t used;                      /* bytes of the current section in buffer, 0 = none pending */
+	unsigned char buffer[PSI_SECTION_SIZE];
+} psi_assembler_t;
+
+/* One programme of the PAT and its PMT */
+typedef struct psi_program_s {
+	uint16_t service_id;                /* program_number in the PAT, service_id in SDT and EIT */
+	uint16_t pmt_pid;
+	uint8_t  complete;                  /* PMT section received and parsed */
+	uint8_t  version;                   /* version_number of the parsed PMT */
+	uint16_t pcr_pid;
+	uint8_t  stream_count;
+	unsigned char *stream[PSI_MAX_STREAMS]; /* elementary stream entries in section (see PMT_STREAM_TYPE etc.) */
+	psi_assembler_t assembler;          /* sections of pmt_pid, only used in the first programme with this PID */
+	unsigned char section[PSI_SECTION_SIZE]; /* the PMT section */
+} psi_program_t;
+
+/* In psi.c */
+void psi_want_service(uint16_t service_id);
+int psi_pat_packet(unsigned char *payload, size_t len, int unit_start);
+void psi_pmt_packet(uint16_t pid, unsigned char *payload, size_t len, int unit_start);
+void psi_discontinuity(uint16_t pid);
+uint16_t psi_transport_stream_id();
+uint32_t psi_program_count();
+const psi_program_t* psi_program(uint32_t index);
+const psi_program_t* psi_select();
+
+#endif
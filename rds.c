@@ -35,15 +35,29 @@
 #include <stdbool.h>
 
 #include "ts2shout.h"
+#include "charset.h"
 
 // #define DEBUG
 
 extern programm_info_t *global_state;
 
+/* RadioText+ is an open data application, it marks artist and title inside the radiotext */
+#define RTPLUS_AID           0x4bd7
+#define RTPLUS_ITEM_TITLE    1
+#define RTPLUS_ITEM_ARTIST   4
+#define RDS_RT_SIZE          0x40
+
 static struct {
-	uint8_t rt[255];
-	uint8_t ps[255];
+	uint8_t rt[255];                /* radiotext (EBU Latin), two parts of 64 characters */
+	uint8_t rt_raw[RDS_RT_SIZE];    /* radiotext as received, the RT+ markers refer to this */
 	bool rt_changed;
+	uint16_t pi;                    /* programme identification */
+	char ps[4 * 8 + 1];             /* programme service name (UTF-8) */
+	uint8_t ct[8];                  /* last clock time message */
+	bool ct_valid;
+	uint8_t rtplus_group;           /* application group type code of RT+ (0 = not announced) */
+	bool rtplus;                    /* RT+ tags received, artist/title are taken from them */
+	uint8_t rtplus_toggle;          /* item toggle bit, changes on every new item */
 } rds_info; 
 
 /* This is just a debug function, not needed for normal operation */
@@ -77,37 +91,6 @@ void DumpHex(const void* data, size_t size) {
 }
 
 
-/* Convert EBU table 1 to latin 1
- * Taken out of http://www.interactive-radio-system.com/docs/EN50067_RDS_Standard.pdf 
- * non latin1 characters are translated to "." */
-
-static uint8_t ebutable1[] = {
-	/* 0    1    2    3    4    5    6    7    8    9    a    b    c    d    e    f     */
-	0xe1,0xe0,0xe9,0xe8,0xed,0xec,0xf3,0xf2,0xfa,0xf9,0xd1,0xc7,0x2e,0xdf,0xa1,0x2e,	/* 0x80 - 0x8f */
-	0xe2,0xe4,0xea,0xeb,0xee,0xef,0xf4,0xf6,0xfb,0xfc,0xf1,0xe7,0x2e,0x2e,0x2e,0x2e,	/* 0x90 - 0x9f */
-	0xaa,0x2e,0xa9,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x24,0x2e,0x2e,0x2e,0x2e,	/* 0xa0 - 0xaf */
-	0xba,0xb9,0xb2,0xb3,0xb1,0x2e,0x2e,0x2e,0xb5,0xbf,0xf7,0xb0,0xbc,0xbd,0xbe,0xa7,	/* 0xb0 - 0xbf */
-	0xc1,0xc0,0xc9,0xc8,0xcd,0xcc,0xd3,0xd2,0xda,0xd9,0x2e,0x2e,0x2e,0x2e,0xd0,0x2d,	/* 0xc0 - 0xcf */
-	0xc2,0xc4,0xca,0xcb,0xce,0xcf,0xd4,0xd6,0xdb,0xdc,0x2d,0x2e,0x2e,0x2e,0x2e,0x2e,	/* 0xd0 - 0xdf */
-	0xc3,0xc5,0xc6,0x2e,0x2e,0xdd,0xd5,0xd8,0xde,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0xf0,	/* 0xe0 - 0xef */
-	0xe3,0xe5,0xe6,0x2e,0x2e,0xfd,0xf5,0xf8,0xfe,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,0x2e,	/* 0xf0 - 0xff */
-};
-
-static uint8_t ebu2latin1(uint8_t character) {
-	if (character < 0x20) {
-		if (character == 0x0d || character == 0x0a) {
-			/* NDR2 uses this. It's documented as proposed linefeed or CR. 
-			   We replace it with space because we use a single line display */
-			return ' '; 
-		}
-		return '.';
-	}
-	if (character >= 0x80) {
-		return ebutable1[(character & 0x7f)];
-	}
-	return character;
-}
-
 bool check_message(uint8_t* rds_message, uint8_t size) {
 	/* Calculate the CRC16 of the RDS frame to get rid of wrong frames */
 	uint16_t crc_result = crc16(rds_message, size);
@@ -121,9 +104,107 @@ bool check_message(uint8_t* rds_message, uint8_t size) {
 	return true;
 }
 
-void handle_rt(uint8_t* rds_message, uint8_t size) {
-	uint8_t msg_len = rds_message[7]; 
-	uint8_t index   = rds_message[8]; 
+/* Publish a new StreamTitle from RDS, log it if it has changed */
+static void rds_publish(const char* artist, const char* title) {
+	const char* stream_title = global_state->stream_title;
+	/* The first radiotext message disables EIT scan and 
+	 * enables RDS text (if prefer_rds is enabled) */
+	if (global_state->found_rds == false) {
+		global_state->found_rds = true;
+		output_logmessage("RDS: RDS data found, using RDS instead of EIT.\n");
+	}
+	if (! set_stream_title_parts(artist, title)) {
+		return;
+	}
+	/* Log this only in filter mode */
+	if (! global_state->cgi_mode) {
+		if ( global_state->playtime_s < 60) {
+			output_logmessage("RDS (%d s): %s\n", global_state->playtime_s, stream_title);
+		} else {
+			output_logmessage("RDS (%02d:%02d s): %s\n", (global_state->playtime_s / 60), global_state->playtime_s % 60, stream_title);
+		}
+	}
+	else {
+		output_logmessage("RDS: %s\n", stream_title);
+	}
+	return;
+}
+
+/* Publish the radiotext, multiple spaces are removed */
+static void rds_publish_rt() {
+	unsigned char short_rt[STR_BUF_SIZE]; 
+	char title[STR_BUF_SIZE];
+	uint8_t i = 0; 
+	uint8_t j = 0;
+	bool space = false;
+	for (i = 0; i < strlen((char*)rds_info.rt); i++) {
+		if (rds_info.rt[i] == 0x20 && space == false) {
+			space = true; 
+			short_rt[j] = 0x20; 
+			j++;
+			continue;
+		} else if ( rds_info.rt[i] != 0x20 ) {
+			space = false; 
+			short_rt[j] = rds_info.rt[i]; 
+			j++;
+		}
+	}
+	/* trailing space */
+	if (j > 0 && short_rt[j - 1] == 0x20) {
+		j--;
+	}
+	/* convert from the EBU Latin RDS charset */
+	rds_text_to_utf8(short_rt, j, title, STR_BUF_SIZE);
+	rds_publish("", title);
+	return;
+}
+
+/* Copy a RT+ tag out of the radiotext, returns the length of the UTF-8 text */
+static size_t rds_rtplus_tag(uint8_t start, uint8_t length, char* out, size_t out_size) {
+	uint8_t end = start + length + 1;
+	if (end > RDS_RT_SIZE) {
+		out[0] = 0;
+		return 0;
+	}
+	/* Strip leading and trailing spaces */
+	while (start < end && rds_info.rt_raw[start] == ' ') {
+		start++;
+	}
+	while (end > start && rds_info.rt_raw[end - 1] == ' ') {
+		end--;
+	}
+	return rds_text_to_utf8(rds_info.rt_raw + start, end - start, out, out_size);
+}
+
+/* PI code, MEC 0x01: DSN, PSN, PI */
+static void handle_pi(uint8_t* msg, uint8_t length) {
+	uint16_t pi = (msg[3] << 8) | msg[4];
+	if (pi != rds_info.pi) {
+		rds_info.pi = pi;
+		output_logmessage("RDS: Programme identification 0x%04X\n", pi);
+	}
+	return;
+}
+
+/* Programme service name, MEC 0x02: DSN, PSN, 8 characters */
+static void handle_ps(uint8_t* msg, uint8_t msg_length) {
+	char ps[sizeof(rds_info.ps)];
+	size_t length = rds_text_to_utf8(msg + 3, 8, ps, sizeof(ps));
+	while (length > 0 && ps[length - 1] == ' ') {
+		ps[--length] = 0;
+	}
+	/* Some stations use PS for scrolling texts, so only log the first one */
+	if (rds_info.ps[0] == 0) {
+		output_logmessage("RDS: Programme service name %s\n", ps);
+	}
+	strcpy(rds_info.ps, ps);
+	return;
+}
+
+/* Radiotext, MEC 0x0a: DSN, PSN, MEL, flags, text */
+static void handle_rt(uint8_t* msg, uint8_t length) {
+	uint8_t msg_len = msg[3]; 
+	uint8_t index   = msg[4]; 
 	/* Radiotext consists of two message parts with 64 characters each
 	 * indexed by an index being either 0 or 1 */
 	if (index > 1) index = 1; 
@@ -131,24 +212,31 @@ void handle_rt(uint8_t* rds_message, uint8_t size) {
 	if (msg_len > 0x41) {
 		msg_len = 0x41;
 	}
+	if (msg_len + 4 > length) {
+		return;
+	}
+	/* 0x0d is the end of the radiotext */
+	for (i = 5; i < 4 + msg_len; i++) {
+		if (msg[i] == 0x0d) {
+			msg_len = i - 4;
+			break;
+		}
+	}
 	/* Cleanup old message */
 	if (msg_len > 0) {
 		for (i = msg_len - 1; i < 0x40; i++) {
 			rds_info.rt[i + index * 0x40] = ' ';
+			rds_info.rt_raw[i] = ' ';
 		}
 	}
-	/* Check and convert message to latin1 */
-	for (i = 9; i < 8 + msg_len; i++) {
+	/* The text is kept in the EBU Latin RDS charset, it's converted when published */
+	for (i = 5; i < 4 + msg_len; i++) {
 		/* is some character different? */
-#ifdef DEBUG
-		if (( rds_message[i] < 0x20 || rds_message[i] > 0x7f) && ebu2latin1(rds_message[i]) == 0x2e) {
-			fprintf(stderr, "RDS: SORRY could not convert character code 0x%x into latin1.\n", rds_message[i]); 
-		}
-#endif 
-		if (rds_info.rt[i - 9 + index * 0x40] != ebu2latin1(rds_message[i])) {
+		if (rds_info.rt[i - 5 + index * 0x40] != msg[i]) {
 			rds_info.rt_changed = true; 
 		}
-		rds_info.rt[i - 9 + index * 0x40] = ebu2latin1(rds_message[i]); 
+		rds_info.rt[i - 5 + index * 0x40] = msg[i]; 
+		rds_info.rt_raw[i - 5] = msg[i];
 	}
 	/* Shorten message
 	 * Check whether the "first" RT message is the same as the "second"
@@ -232,66 +320,113 @@ void handle_rt(uint8_t* rds_message, uint8_t size) {
 	}
 	return; 
 }
-	
-/* Handle a RDS data chunk. */
+
+/* Clock time and date, MEC 0x0d: year, month, day, hour, minute, second, centisecond, local time offset */
+static void handle_ct(uint8_t* msg, uint8_t length) {
+	if (! rds_info.ct_valid) {
+		/* The local time offset is given in half hours, bit 5 is the sign */
+		output_logmessage("RDS: Clock time 20%02d-%02d-%02d %02d:%02d:%02d UTC%c%d.%d\n", msg[1], msg[2], msg[3], msg[4], msg[5], msg[6],
+			(msg[8] & 0x20) ? '-' : '+', (msg[8] & 0x1f) / 2, (msg[8] & 0x01) * 5);
+	}
+	memcpy(rds_info.ct, msg + 1, 8);
+	rds_info.ct_valid = true;
+	return;
+}
+
+/* ODA configuration, MEC 0x40: AID, application group type code, ... */
+static void handle_oda_config(uint8_t* msg, uint8_t length) {
+	uint16_t aid = (msg[1] << 8) | msg[2];
+	if (aid == RTPLUS_AID && rds_info.rtplus_group != msg[3]) {
+		rds_info.rtplus_group = msg[3];
+		output_logmessage("RDS: RadioText+ announced in group %d%c\n", msg[3] >> 1, (msg[3] & 1) ? 'B' : 'A');
+	}
+	return;
+}
+
+/* ODA free format group, MEC 0x42: application group type code, buffer configuration,
+ * 37 bits of group data. For RT+ these are: item toggle, item running, and two tags with
+ * content type (6 bits), start marker (6 bits) and length marker (6 bits, 5 bits for the second) */
+static void handle_oda_data(uint8_t* msg, uint8_t length) {
+	uint64_t bits;
+	uint8_t running;
+	uint8_t k;
+	char artist[4 * RDS_RT_SIZE];
+	char title[4 * RDS_RT_SIZE];
+	if (rds_info.rtplus_group == 0 || msg[1] != rds_info.rtplus_group) {
+		return;
+	}
+	bits = ((uint64_t)(msg[3] & 0x1f) << 32) | ((uint64_t)msg[4] << 24) | (msg[5] << 16) | (msg[6] << 8) | msg[7];
+	running = (bits >> 35) & 1;
+	rds_info.rtplus_toggle = (bits >> 36) & 1;
+	rds_info.rtplus = true;
+	artist[0] = 0;
+	title[0] = 0;
+	for (k = 0; k < 2 && running; k++) {
+		uint8_t content_type = (k == 0) ? (bits >> 29) & 0x3f : (bits >> 11) & 0x3f;
+		uint8_t start        = (k == 0) ? (bits >> 23) & 0x3f : (bits >> 5) & 0x3f;
+		uint8_t tag_length   = (k == 0) ? (bits >> 17) & 0x3f : bits & 0x1f;
+		if (content_type == RTPLUS_ITEM_TITLE) {
+			rds_rtplus_tag(start, tag_length, title, sizeof(title));
+		} else if (content_type == RTPLUS_ITEM_ARTIST) {
+			rds_rtplus_tag(start, tag_length, artist, sizeof(artist));
+		}
+	}
+#ifdef DEBUG
+	fprintf(stderr, "RDS: RT+ running %d, toggle %d, artist '%s', title '%s'\n", running, rds_info.rtplus_toggle, artist, title);
+#endif
+	/* No item running (e.g. news, moderation, ads), use the radiotext */
+	if (title[0] == 0) {
+		if (rds_info.rt_changed) {
+			rds_publish_rt();
+			rds_info.rt_changed = false;
+		}
+		return;
+	}
+	rds_publish(artist, title);
+	rds_info.rt_changed = false;
+	return;
+}
+
+/* The UECP message element codes we decode, min_length is the length of the
+ * message including the MEC byte */
+static const struct {
+	uint8_t mec;
+	uint8_t min_length;
+	void (*handler)(uint8_t* msg, uint8_t length);
+} uecp_handlers[] = {
+	{ 0x01,  5, handle_pi },            /* PI code */
+	{ 0x02, 11, handle_ps },            /* PS (programme service name) */
+	{ 0x0a,  5, handle_rt },            /* RT (Radiotext) */
+	{ 0x0d,  9, handle_ct },            /* CT (Clock time and date) */
+	{ 0x40,  4, handle_oda_config },    /* ODA configuration (RT+ announcement) */
+	{ 0x42,  8, handle_oda_data },      /* ODA free format group (RT+ tags) */
+};
+
+/* Handle a RDS data chunk. A UECP frame consists of address (2 bytes),
+ * sequence counter, message length, the message and crc16. */
 void rds_handle_message(uint8_t* rds_message, uint8_t size) {
-	uint8_t type = rds_message[4];
-	if (! check_message(rds_message, size))  
+	uint8_t* msg = rds_message + 4;
+	uint8_t length = rds_message[3];
+	uint8_t i;
+	if (size < 7 || ! check_message(rds_message, size))  
 		return;
 #ifdef DEBUG
 	DumpHex(rds_message, size);
 #endif
-	switch (type) {
-		case 0x0a: // RT (Radiotexta)
-			handle_rt(rds_message, size); 
-			break;
-		case 0x01: // PI Code
-			//handle_pi(rds_message, size); 
-			break;
-		case 0x02:
-			//handle_ps(rds_message, size); 
-			break;
+	if (length + 6 > size) {
+		return;
 	}
-	if (rds_info.rt_changed == true) {
-		unsigned char utf8_rt[STR_BUF_SIZE];
-		unsigned char short_rt[STR_BUF_SIZE]; 
-		uint8_t i = 0; 
-		uint8_t j = 0;
-		bool space = false;
-		for (i = 0; i < strlen((char*)rds_info.rt); i++) {
-			if (rds_info.rt[i] == 0x20 && space == false) {
-				space = true; 
-				short_rt[j] = 0x20; 
-				j++;
-				continue;
-			} else if ( rds_info.rt[i] != 0x20 ) {
-				space = false; 
-				short_rt[j] = rds_info.rt[i]; 
-				j++;
-			}
-		}
-		short_rt[j] = 0;
-		/* The first radiotext message disables EIT scan and 
-		 * enables RDS text (if prefer_rds is enabled) */
-		if (global_state->found_rds == false) {
-			global_state->found_rds = true;
-			output_logmessage("RDS: RDS data found, using RDS instead of EIT.\n");
-		}
-		/* copy RDS to stream_title */
-		strcpy(global_state->stream_title, (char*)short_rt);
-        utf8((unsigned char*)short_rt, utf8_rt);
-		/* Log this only in filter mode */
-		if (! global_state->cgi_mode) {
-			if ( global_state->playtime_s < 60) {
-				output_logmessage("RDS (%d s): %s\n", global_state->playtime_s, utf8_rt);
-			} else {
-				output_logmessage("RDS (%02d:%02d s): %s\n", (global_state->playtime_s / 60), global_state->playtime_s % 60, utf8_rt);
+	for (i = 0; i < sizeof(uecp_handlers) / sizeof(uecp_handlers[0]); i++) {
+		if (uecp_handlers[i].mec == msg[0]) {
+			if (length >= uecp_handlers[i].min_length) {
+				uecp_handlers[i].handler(msg, length);
 			}
+			break;
 		}
-		else {
-			output_logmessage("RDS: %s\n", utf8_rt);
-		}
-		// fprintf(stderr, "NEW RT(%s)\n", rds_info.rt);
+	}
+	/* With RT+ the radiotext is published with the next RT+ tags */
+	if (rds_info.rt_changed == true && ! rds_info.rtplus) {
+		rds_publish_rt();
 		rds_info.rt_changed = false;
 	}
 	return;
@@ -325,6 +460,40 @@ void rds_convert_from_extra_pes(uint8_t* buffer, size_t size) {
 	return;
 }
 
+/* Handle the ancillary data of an AAC frame (a data stream element). It
+ * contains one or more UECP messages framed by 0xfe and 0xff.
+ * Sometimes more than one UECP message is found in the data,
+ * therefore we try to split it up. */
+void rds_convert_from_ancillary_data(uint8_t* data, int size) {
+	if ( size >= 2) {
+		int startval = 1;
+		int used = 0;
+		int count = 0; // ensure termination, also for broken data
+		while ( startval < (size - 1) && count < 15 ) {
+			int i = startval;
+			for (; i < (size - 1); i++) {
+				if (   data[i] == 0xff
+					&& data[i+1] == 0xfe) {
+					// fprintf(stderr, "Splitup @%d (size %d, maxsize %ld)\n", startval, i - startval, size);
+					rds_convert_from_extra_pes(data + startval, i - startval);
+					used += 1;
+					startval = i + 2;
+					break;
+				}
+			}
+			count++;
+		}
+		if (used > 0) {
+			// Last element
+			// fprintf(stderr, "Last Element %d (size %ld)\n", startval, size - startval - 1);
+			rds_convert_from_extra_pes(data + startval, size - startval - 1);
+		} else {
+			rds_convert_from_extra_pes(data + 1, size - 2);
+		}
+	}
+	return;
+}
+
 /* decode exactly one frame -  char * text points to 255 byte of char
  * buffer is the buffer of the mpeg-frame and offset is the current read offset
  * it points to the "0xff" of the mpeg frame start! */
@@ -406,80 +575,155 @@ void rds_decode_oneframe(uint8_t* buffer, int offset) {
   The sequence of the individual bytes is to be reversed. The data must be extracted from the individual
   MPEG frames and then appended to each other. The start marker is "0xfe" and the end marker is "0xff".
   The bytes inbetween 0xfe und 0xff have to be collected and stored into a buffer and handled as RDS message.
+
+  We don't search every offset of the buffer for the sync bytes (that found "ff fx" inside frames
+  from time to time). The frame size is known from the frame header, so once we found the first
+  frame we simply walk from frame header to frame header. Only if the expected header is not where
+  it should be (continuity error, transport error) we search again for a frame start.
 */
 
+/* Maximum amount of bytes in front of a frame header we need for one RDS chunk:
+ * 255 bytes of data + length byte + 0xfd marker */
+#define RDS_HISTORY_SIZE 257
+
+static struct {
+	bool locked;                           /* we know where the next frame header is */
+	int next_offset;                       /* offset of the next frame header in the next buffer */
+	unsigned int last_length;              /* length of the last frame we walked over */
+	uint8_t history[RDS_HISTORY_SIZE];     /* the last bytes of the previous buffer */
+	bool history_valid;
+} rds_walk;
+
+/* Decode the RDS data in front of the frame header found at offset pos of buffer.
+ * If the data is not completely in the current buffer, it is taken from the
+ * tail of the previous buffer. */
+static void rds_frame_ancillary(uint8_t* buffer, int pos) {
+	uint8_t helper[RDS_HISTORY_SIZE + RDS_HISTORY_SIZE];
+	uint8_t rds_data_size;
+	if (pos >= RDS_HISTORY_SIZE) {
+		if (buffer[pos - 1] == 0xfd && buffer[pos - 2] > 0) {
+			rds_decode_oneframe(buffer, pos);
+		}
+		return;
+	}
+	if (pos >= 2 && buffer[pos - 1] == 0xfd) {
+		rds_data_size = buffer[pos - 2];
+		if (rds_data_size == 0) {
+			return;
+		}
+		if (rds_data_size + 2 <= pos) {
+			rds_decode_oneframe(buffer, pos);
+			return;
+		}
+	}
+	if (! rds_walk.history_valid) {
+		return;
+	}
+	/* The frame header is near the start of the buffer, the RDS data is (partly) in the last buffer */
+	memcpy(helper, rds_walk.history, RDS_HISTORY_SIZE);
+	memcpy(helper + RDS_HISTORY_SIZE, buffer, pos);
+	if (helper[RDS_HISTORY_SIZE + pos - 1] == 0xfd && helper[RDS_HISTORY_SIZE + pos - 2] > 0) {
+		rds_decode_oneframe(helper, RDS_HISTORY_SIZE + pos);
+	}
+	return;
+}
+
+/* Search for the next frame header between from and size. A candidate is only
+ * accepted if the following frame header is also found where it is expected
+ * (as long as it is inside the data we have). Returns -1 if nothing is found.
+ * Candidates without a following header are most likely the last frame before
+ * a damaged one, the RDS data in front of them is still used (the UECP crc16
+ * protects us from garbage), but we don't lock on them. */
+static int rds_find_frame(ts2shout_channel_t *chan, int from, int size) {
+	uint8_t * buffer = chan->buf;
+	int used = chan->buf_used;
+	while (from < size) {
+		uint8_t* candidate = memchr(buffer + from, 0xff, size - from);
+		unsigned int length;
+		int pos;
+		if (candidate == NULL) {
+			return -1;
+		}
+		pos = candidate - buffer;
+		from = pos + 1;
+		if (pos + 3 > used) {
+			return -1;
+		}
+		length = mpa_frame_length(candidate, &chan->mpah);
+		if (length == 0) {
+			continue;
+		}
+		if (pos + length + 3 <= used && mpa_frame_length(candidate + length, &chan->mpah) == 0) {
+			rds_frame_ancillary(buffer, pos);
+			continue;
+		}
+		return pos;
+	}
+	return -1;
+}
+
 void rds_data_scan(ts2shout_channel_t *chan) {
 
 	/* RDS globally enabled? Command line option or
 	 * environment variable */
 	if (! global_state->prefer_rds) 
 		return;
-	static uint8_t oldbuffer[60];
-
-	int i = 0;
 
 	// Easier handling 
 	uint8_t * buffer = chan->buf; 
 	int size = chan->payload_size;
-	if (size < 60) {
+	int used = chan->buf_used;
+	int pos = 0;
+	if (size < RDS_HISTORY_SIZE) {
 		return;
 	}
-	for (i = 0; i < size - 3; i++) {
-		if( ( buffer[i] == chan->mpah.sync0 )
-			&& (buffer[i+1] == chan->mpah.sync1 )
-			&& (buffer[i+2] == chan->mpah.sync2 )
-			&& (buffer[i+3] == chan->mpah.sync3 ) ) {
-			/* Sometimes we find ff fx data somewhere inside the frame ... this happens not very often, but
-			   could corrupt the display of a RDS message. As we calculate the crc16 the use of a corrupted
-			   message is unlikely (but not impossible).
-			   Correct solution would be to count the bytes and align it with frame sizes, but it's
-			   hard to keep this correct if MPEG frame sync is lost in main reception loop. Therefore
-			   we just ignore this problem. In very rare cases the mpeg frame border is directly on the
-			   buffer border. Some RDS message will be lost then. This can happen if you've continuity errors. */
-			/* Found mpeg frame start. The RDS data is RIGHT IN FRONT OF IT */
-			if ( i < 32 ) {
-				/* If we find the marker at the very beginning of the buffer
-				 * we can expect that the current buffer does not contain all necessary data.
-				 * In this case we also use data from last frame. */
-				uint8_t helper[512];       /* with this size we cannot ever read outside our memory */
-				memset(helper, 0xff, 512); /* write termination character all over the buffer */
-				memcpy(helper + 255 , oldbuffer + i, 60 - i); /* Fill in old buffer contents from last call */
-				memcpy(helper + 255 + 60 - i, buffer, i);     /* and append the new buffer contents */
-				if (helper[255 + 59 - i] == 0xfd) {
-					uint8_t rds_data_size = helper[255 + 58 -i];
-					if (rds_data_size > 0) {
-						rds_decode_oneframe(helper, 255 + 60 - i);
-					}
-				} else {
-				}
-			} else { /* if (i < 32) */
-				if ( buffer[i-1] == 0xfd ) {	
-					/* yes: RDS data */
-					uint8_t rds_data_size = buffer[i-2]; 
-					if (rds_data_size > 0) {
-						rds_decode_oneframe(buffer, i);
-						if ( rds_data_size > 0 ) {
-							// fprintf(stderr, "RDS-Frame (0x%x, %d)\n", i, rds_data_size);
-						} 
-					} else {
-						// fprintf(stderr, "No RDS Data (0x%x)\n", i); 
-					}
-				} else {
-					// fprintf(stderr, "No 0xfd? Data (0x%x)\n", i); 
-				}
-			}
-			// offset = i;			// current offset 
-			// matchcount += 1;    // current match
+	if (rds_walk.locked) {
+		pos = rds_walk.next_offset;
+	} else {
+		pos = rds_find_frame(chan, 0, size);
+		rds_walk.locked = (pos >= 0);
+	}
+	while (rds_walk.locked && pos < size) {
+		unsigned int length = 0;
+		if (pos + 3 <= used) {
+			length = mpa_frame_length(buffer + pos, &chan->mpah);
+		} else {
+			/* Header is not completely in buffer, we trust our walk */
+			length = rds_walk.last_length;
+		}
+		if (length == 0) {
+			/* Lost the frame border, search again */
+			pos = rds_find_frame(chan, pos + 1, size);
+			rds_walk.locked = (pos >= 0);
+			continue;
 		}
+		/* Found mpeg frame start. The RDS data is RIGHT IN FRONT OF IT */
+		rds_frame_ancillary(buffer, pos);
+		rds_walk.last_length = length;
+		pos += length;
 	}
-	/* Store last 60 bytes from the end of the frame into "oldbuffer"
-	 * to have it at hand if we find a MPEG header near the start
-	 * of the next frame. */
-	memcpy(oldbuffer, buffer + size - 60, 60); 
+	if (rds_walk.locked) {
+		rds_walk.next_offset = pos - size;
+	}
+	/* Store the last bytes of the buffer to have it at hand if we find
+	 * a MPEG header near the start of the next buffer. */
+	memcpy(rds_walk.history, buffer + size - RDS_HISTORY_SIZE, RDS_HISTORY_SIZE);
+	rds_walk.history_valid = true;
 	return;  
 }
 
+/* PI code, 0 if no PI code was received */
+uint16_t rds_programme_identification() {
+	return rds_info.pi;
+}
+
+/* PS (UTF-8), empty if no PS was received */
+const char* rds_programme_service_name() {
+	return rds_info.ps;
+}
+
 void init_rds() {
 	memset(rds_info.rt, ' ', 0x80);
+	memset(rds_info.rt_raw, ' ', RDS_RT_SIZE);
 	return;
 }
@@ -27,6 +27,9 @@ void rds_data_scan( ts2shout_channel_t * chan);
 void init_rds();
 void rds_decode_oneframe(uint8_t* buffer, int offset);
 void rds_convert_from_extra_pes(uint8_t* buffer, uint8_t size);
+void rds_convert_from_ancillary_data(uint8_t* data, int size);
+uint16_t rds_programme_identification();
+const char* rds_programme_service_name();
 // void rds_handle_message(uint8_t* rds_message, uint8_t size);
 void DumpHex(const void* data, size_t size);
 #endif
@@ -0,0 +1,265 @@
+/*
+ *  Index of all services of a multiplex (SDT and EIT present/following)
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  If a complete multiplex is fed into ts2shout (option "multiplex") the
+ *  station names of all services (SDT actual 0x42 and other 0x46) and their
+ *  present/following titles (EIT 0x4e and 0x4f) are collected in a hash
+ *  table keyed by transport_stream_id and service_id. The table is updated
+ *  with every section, changes of radio services are logged.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ts2shout.h"
+#include "services.h"
+#include "charset.h"
+
+static struct {
+	uint8_t enabled;
+	uint32_t size;                      /* number of slots, power of two */
+	uint32_t used;
+	uint8_t changed;                    /* name or title of a radio service changed since services_changed() */
+	service_entry_t *entry;
+} services;
+
+static uint32_t services_hash(uint16_t transport_stream_id, uint16_t service_id) {
+	uint32_t key = ((uint32_t)transport_stream_id << 16) | service_id;
+	/* Fibonacci hashing, the service_ids of a multiplex are often consecutive */
+	return (key * 2654435769u) >> 16;
+}
+
+static service_entry_t* services_lookup(uint16_t transport_stream_id, uint16_t service_id) {
+	uint32_t i = services_hash(transport_stream_id, service_id) & (services.size - 1);
+	while (services.entry[i].used) {
+		if (services.entry[i].service_id == service_id && services.entry[i].transport_stream_id == transport_stream_id) {
+			return &services.entry[i];
+		}
+		i = (i + 1) & (services.size - 1);
+	}
+	return &services.entry[i];
+}
+
+/* Double the size of the table and insert all entries again */
+static void services_grow() {
+	service_entry_t *old = services.entry;
+	uint32_t old_size = services.size;
+	uint32_t i;
+	services.size *= 2;
+	services.entry = calloc(services.size, sizeof(service_entry_t));
+	if (services.entry == NULL) {
+		output_logmessage("services_grow(): Failed to allocate memory for %d services\n", services.size);
+		exit(-1);
+	}
+	for (i = 0; i < old_size; i++) {
+		if (old[i].used) {
+			*services_lookup(old[i].transport_stream_id, old[i].service_id) = old[i];
+		}
+	}
+	free(old);
+	return;
+}
+
+static service_entry_t* services_add(uint16_t transport_stream_id, uint16_t service_id) {
+	service_entry_t *entry = services_lookup(transport_stream_id, service_id);
+	if (entry->used) {
+		return entry;
+	}
+	/* Keep the load factor below 3/4 */
+	if ((services.used + 1) * 4 > services.size * 3) {
+		services_grow();
+		entry = services_lookup(transport_stream_id, service_id);
+	}
+	entry->used = 1;
+	entry->transport_stream_id = transport_stream_id;
+	entry->service_id = service_id;
+	entry->eit_version[0] = 0xff;
+	entry->eit_version[1] = 0xff;
+	services.used++;
+	return entry;
+}
+
+/* Digital radio, FM radio or advanced codec radio service */
+static int services_is_radio(service_entry_t *entry) {
+	return (entry->service_type == 0x02 || entry->service_type == 0x07 || entry->service_type == 0x0a);
+}
+
+void services_init(uint8_t enable) {
+	services.enabled = enable;
+	if (! enable) {
+		return;
+	}
+	services.size = SERVICES_INITIAL_SIZE;
+	services.entry = calloc(services.size, sizeof(service_entry_t));
+	if (services.entry == NULL) {
+		output_logmessage("services_init(): Failed to allocate memory\n");
+		exit(-1);
+	}
+	output_logmessage("services_init(): Collecting station names and titles of all services in the multiplex\n");
+	return;
+}
+
+/* A complete SDT section (actual 0x42 or other 0x46) with valid crc32 */
+void services_sdt(unsigned char* section) {
+	uint16_t transport_stream_id;
+	unsigned char* service;
+	unsigned char* end;
+	if (! services.enabled || (PMT_TABLE_ID(section) != 0x42 && PMT_TABLE_ID(section) != 0x46)) {
+		return;
+	}
+	transport_stream_id = PMT_PROGRAM_NUMBER(section);
+	service = SDT_FIRST_DESCRIPTOR(section);
+	/* 4 bytes crc32 at the end of the section */
+	end = section + 3 + PMT_SECTION_LENGTH(section) - 4;
+	while (service + 5 <= end) {
+		unsigned char* descriptor = SDT_DESCRIPTOR_CONTENT(service);
+		unsigned char* descriptors_end = descriptor + SDT_DESCRIPTOR_LOOP_LENGTH(service);
+		if (descriptors_end > end) {
+			break;
+		}
+		while (descriptor + 2 <= descriptors_end) {
+			/* 0x48 = service descriptor */
+			if (SDT_DC_TAG(descriptor) == 0x48 && descriptor + 4 + SDT_DC_PROVIDER_NAME_LENGTH(descriptor) < descriptors_end) {
+				service_entry_t *entry = services_add(transport_stream_id, SDT_DESCRIPTOR_SERVICE_ID(service));
+				unsigned char* name = descriptor + 4 + SDT_DC_PROVIDER_NAME_LENGTH(descriptor);
+				char service_name[SERVICE_NAME_SIZE];
+				if (name + 1 + name[0] > descriptors_end) {
+					break;
+				}
+				if (entry->service_type != SDT_DC_SERVICE_TYPE(descriptor)) {
+					entry->service_type = SDT_DC_SERVICE_TYPE(descriptor);
+					services.changed |= services_is_radio(entry);
+				}
+				dvb_text_to_utf8(SDT_DC_PROVIDER_NAME(descriptor), SDT_DC_PROVIDER_NAME_LENGTH(descriptor), entry->provider, SERVICE_NAME_SIZE);
+				dvb_text_to_utf8(name + 1, name[0], service_name, SERVICE_NAME_SIZE);
+				if (strcmp(service_name, entry->name) != 0) {
+					strcpy(entry->name, service_name);
+					if (services_is_radio(entry)) {
+						output_logmessage("services: %d/%d is station %s\n", transport_stream_id, entry->service_id, entry->name);
+						services.changed = 1;
+					}
+				}
+			}
+			descriptor += SDT_DC_LENGTH(descriptor) + 2;
+		}
+		service = descriptors_end;
+	}
+	return;
+}
+
+/* A complete EIT present/following section (actual 0x4e or other 0x4f) with valid crc32 */
+void services_eit(unsigned char* section) {
+	service_entry_t *entry;
+	unsigned char* event_start = EIT_PACKET_EVENTSP(section);
+	unsigned char* descriptor;
+	unsigned char* descriptors_end;
+	uint8_t section_number = EIT_SECTION_NUMBER(section);
+	char title[SERVICE_TITLE_SIZE];
+	if (! services.enabled || (EIT_PACKET_TABLEID(section) != 0x4e && EIT_PACKET_TABLEID(section) != 0x4f)
+		|| section_number > 1) {
+		return;
+	}
+	entry = services_add(EIT_TRANSPORT_STREAM_ID(section), EIT_SERVICE_ID(section));
+	if (entry->eit_version[section_number] == EIT_VERSION_NUMBER(section)) {
+		return;
+	}
+	title[0] = 0;
+	/* An empty section means there is no event */
+	if (EIT_SECTION_LENGTH(section) > 15 + 12) {
+		descriptor = EIT_EVENT_DESCRIPTORP(event_start);
+		descriptors_end = descriptor + EIT_EVENT_LOOPLENGTH(event_start);
+		if (descriptors_end > section + 3 + EIT_SECTION_LENGTH(section) - 4) {
+			return;
+		}
+		while (descriptor + EIT_SIZE_DESCRIPTOR_HEADER <= descriptors_end) {
+			/* 0x4d = short event descriptor, event name and text */
+			if (DESCRIPTOR_TAG(descriptor) == 0x4d) {
+				unsigned char* text = EIT_NAME_CONTENT(descriptor) + EIT_NAME_LENGTH(descriptor);
+				size_t length;
+				if (text + 1 + text[0] > descriptors_end) {
+					return;
+				}
+				length = dvb_text_to_utf8(EIT_NAME_CONTENT(descriptor), EIT_NAME_LENGTH(descriptor), title, SERVICE_TITLE_SIZE);
+				/* "name - text", but only if there is a text */
+				if (length + 4 < SERVICE_TITLE_SIZE) {
+					strcpy(title + length, " - ");
+					if (dvb_text_to_utf8(text + 1, text[0], title + length + 3, SERVICE_TITLE_SIZE - length - 3) == 0) {
+						title[length] = 0;
+					}
+				}
+				break;
+			}
+			descriptor += descriptor[1] + 2;
+		}
+	}
+	if (section_number == 0 && strcmp(title, entry->present) != 0) {
+		strcpy(entry->present, title);
+		if (services_is_radio(entry)) {
+			output_logmessage("services: %d/%d (%s) now: %s\n", entry->transport_stream_id, entry->service_id,
+				entry->name, entry->present);
+			services.changed = 1;
+		}
+	} else if (section_number == 1 && strcmp(title, entry->following) != 0) {
+		strcpy(entry->following, title);
+		services.changed |= services_is_radio(entry);
+	}
+	/* Only a parsed section is not looked at again */
+	entry->eit_version[section_number] = EIT_VERSION_NUMBER(section);
+	return;
+}
+
+/* Iterate over the radio services, start with *position = 0, NULL at the end */
+const service_entry_t* services_next(uint32_t *position) {
+	if (! services.enabled) {
+		return NULL;
+	}
+	while (*position < services.size) {
+		service_entry_t *entry = &services.entry[(*position)++];
+		if (entry->used && services_is_radio(entry)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Has a radio service changed since the last call? */
+uint8_t services_changed() {
+	uint8_t changed = services.changed;
+	services.changed = 0;
+	return changed;
+}
+
+/* Log all radio services of the multiplex */
+void services_report() {
+	uint32_t i;
+	if (! services.enabled) {
+		return;
+	}
+	output_logmessage("services: %d services found in the multiplex\n", services.used);
+	for (i = 0; i < services.size; i++) {
+		service_entry_t *entry = &services.entry[i];
+		if (entry->used && services_is_radio(entry)) {
+			output_logmessage("services: %d/%d %s: %s, next: %s\n", entry->transport_stream_id, entry->service_id,
+				entry->name, entry->present, entry->following);
+		}
+	}
+	return;
+}
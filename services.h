@@ -0,0 +1,53 @@
+/*
+ *  Index of all services of a multiplex (SDT and EIT present/following)
+ *
+ *  Copyright (C) 2021 Carsten Gross <carsten at siski.de>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef _SERVICES_H
+#define _SERVICES_H
+
+#include <stdint.h>
+
+#define SERVICE_NAME_SIZE 128
+#define SERVICE_TITLE_SIZE 256
+
+/* Initial size of the hash table, must be a power of two */
+#define SERVICES_INITIAL_SIZE 64
+
+typedef struct service_entry_s {
+	uint8_t  used;
+	uint16_t transport_stream_id;
+	uint16_t service_id;
+	uint8_t  service_type;              /* from the service descriptor, 0 if not known yet */
+	uint8_t  eit_version[2];            /* version of the present/following section */
+	char     name[SERVICE_NAME_SIZE];
+	char     provider[SERVICE_NAME_SIZE];
+	char     present[SERVICE_TITLE_SIZE];
+	char     following[SERVICE_TITLE_SIZE];
+} service_entry_t;
+
+/* In services.c */
+void services_init(uint8_t enable);
+void services_sdt(unsigned char* section);
+void services_eit(unsigned char* section);
+const service_entry_t* services_next(uint32_t *position);
+uint8_t services_changed();
+void services_report();
+
+#endif
@@ -39,6 +39,13 @@
 
 #include "ts2shout.h"
 #include "rds.h"
+#include "latm.h"
+#include "latency.h"
+#include "services.h"
+#include "charset.h"
+#include "nowplaying.h"
+#include "aac_rds.h"
+#include "psi.h"
 
 #define XSTR(s) STR(s)
 #define STR(s) #s
@@ -87,23 +94,33 @@ static void parse_args(int argc, char **argv)
 		if (strcmp("rds", argv[i]) == 0) {
 			global_state->prefer_rds = 1;
 		}
-	}
-}
-
-void cleanup_mpeg_string(char *string) {
-	uint32_t i = 0;
-	if (string == NULL)
-		return;
-	for (i = 0; i < strlen(string); i++) {
-		/* replace control character "LF/CR" by Space */
-		if ((unsigned char)string[i] == 0x8a) {
-			string[i] = 0x20;
+		if (strcmp("realtime", argv[i]) == 0) {
+			global_state->realtime = 1;
+		}
+		if (strcmp("latency", argv[i]) == 0) {
+			global_state->latency = 1;
+		}
+		if (strcmp("multiplex", argv[i]) == 0) {
+			global_state->multiplex = 1;
+		}
+		if (strcmp("faststart", argv[i]) == 0) {
+			global_state->faststart = 1;
+		}
+		if (strncmp("nowplaying=", argv[i], 11) == 0) {
+			global_state->nowplaying = argv[i] + 11;
+		}
+		if (strncmp("logourl=", argv[i], 8) == 0) {
+			global_state->logo_url = argv[i] + 8;
+		}
+		if (strncmp("rdsidle=", argv[i], 8) == 0) {
+			global_state->aac_rds_idle = atoi(argv[i] + 8);
+		}
+		if (strncmp("serviceid=", argv[i], 10) == 0) {
+			global_state->wanted_service_id = atoi(argv[i] + 10);
 		}
 	}
-	return;
 }
 
-
 /* Output logmessage in apache errorlog compatible format */
 void output_logmessage(const char *fmt, ... ) {
 	char s[STR_BUF_SIZE];
@@ -111,8 +128,10 @@ void output_logmessage(const char *fmt, ... ) {
 	char current_time[STR_BUF_SIZE];
 	va_list argp;
 	struct timespec t;
+	struct tm local_time;
 	clock_gettime(CLOCK_REALTIME, &t);
-	strftime(current_time_fmt, STR_BUF_SIZE, "%a %b %d %H:%M:%S.%%6.6d %Y", localtime(&t.tv_sec));
+	/* The DSM-CC worker logs as well */
+	strftime(current_time_fmt, STR_BUF_SIZE, "%a %b %d %H:%M:%S.%%6.6d %Y", localtime_r(&t.tv_sec, &local_time));
 	snprintf(current_time, STR_BUF_SIZE, current_time_fmt, (t.tv_nsec / 1000));
 	va_start(argp, fmt);
 	vsnprintf(s, STR_BUF_SIZE, fmt, argp);
@@ -126,64 +145,110 @@ void output_logmessage(const char *fmt, ... ) {
 	return;
 }
 
-static void ts_continuity_check( ts2shout_channel_t *chan, int ts_cc )
+/* Data of a channel is missing: the audio continues with the next frame
+ * header, the buffered audio is kept, tables in assembly are thrown away */
+static void ts_discontinuity( ts2shout_channel_t *chan )
 {
-	if (chan->continuity_count != ts_cc) {
+	switch (chan->channel_type) {
+		case CHANNEL_TYPE_PAYLOAD:
+			/* Keep the buffered audio and continue with the next frame header */
+			if (chan->synced) {
+				chan->resync = 1;
+			}
+			break;
+		case CHANNEL_TYPE_EIT:
+			memset(eit_table, 0, sizeof(section_aggregate_t));
+			break;
+		case CHANNEL_TYPE_SDT:
+			memset(sdt_table, 0, sizeof(section_aggregate_t));
+			break;
+		case CHANNEL_TYPE_DSMCC:
+			memset(dsmcc_table, 0, sizeof(section_aggregate_t));
+			break;
+		case CHANNEL_TYPE_PAT:
+		case CHANNEL_TYPE_PMT:
+			psi_discontinuity(chan->pid);
+			break;
+		default:
+			break;
+	}
+	return;
+}
+
+/* Check the continuity counter of a TS packet with payload. Adaptation field only
+ * packets don't increment the counter and must not be checked. A packet may be sent
+ * twice (same counter), the duplicate has to be discarded. Everything else is a gap,
+ * the number of lost packets is only known modulo 16. The discontinuity indicator
+ * in the adaptation field allows the counter to jump. */
+static int ts_continuity_check( ts2shout_channel_t *chan, unsigned char *buf )
+{
+	int ts_cc = TS_PACKET_CONT_COUNT(buf);
+	int expected = chan->continuity_count;
+	int lost;
 
-		// Only display an error after we gain sync
-		if (chan->synced) {
-			output_logmessage("ts_continuity_check: TS continuity error (pid: %d)\n", chan->pid );
-			chan->synced=0;
+	chan->continuity_count = (ts_cc + 1) & 0x0f;
+	if (expected < 0 || ts_cc == expected || TS_PACKET_ADAPT_DISCONTINUITY(buf)) {
+		return TS_CC_OK;
+	}
+	if (ts_cc == ((expected + 15) & 0x0f)) {
+		chan->cc_duplicates += 1;
+		return TS_CC_DUPLICATE;
+	}
+	lost = (ts_cc - expected) & 0x0f;
+	chan->cc_gaps += 1;
+	chan->cc_lost += lost;
+	output_logmessage("ts_continuity_check: TS continuity error (pid: %d, %s), %d packet(s) lost\n",
+		chan->pid, channel_name(chan->channel_type), lost);
+	ts_discontinuity(chan);
+	return TS_CC_DISCONTINUITY;
+}
+
+/* Print the continuity statistics of all channels */
+static void ts_continuity_summary()
+{
+	int i;
+	for (i = 0; i < channel_count; i++) {
+		if (channels[i]->cc_gaps || channels[i]->cc_duplicates || channels[i]->cc_errors) {
+			output_logmessage("PID %d (%s): %u continuity error(s), at least %u packet(s) lost, %u duplicate packet(s), %u transport error(s)\n",
+				channels[i]->pid, channel_name(channels[i]->channel_type),
+				channels[i]->cc_gaps, channels[i]->cc_lost, channels[i]->cc_duplicates, channels[i]->cc_errors);
 		}
-		chan->continuity_count = ts_cc;
 	}
-	chan->continuity_count++;
-	if (chan->continuity_count >= 16)
-		chan->continuity_count = 0;
+	return;
 }
 
 
+static void select_programme();
+
+/* The PAT is assembled by the PSI engine. As soon as it is complete the PMTs of
+ * all programmes are subscribed: tvheadend and vdr rewrite the PAT, but some mp2t
+ * serving systems only remove PMT pids and leave PAT as it is. Out of the PMTs
+ * the programme is picked by its service_id, see psi_select(). */
 static void extract_pat_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout_channel_t *chan, int start_of_pes ) {
-	unsigned char* start = NULL;
-	start = pes_ptr + start_of_pes;
 	unsigned int possible_pmt = 0;
-#ifdef DEBUG
-    fprintf (stderr, "PAT: Found data, table 0x%2.2d (Section length %d), transport_stream_id %d, section %d, last section %d\n",
-		PAT_TABLE_ID(start),
-		PAT_SECTION_LENGTH(start),
-		PAT_TRANSPORT_STREAM_ID(start),
-		PAT_SECTION_NUMBER(start),
-		PAT_LAST_SECTION_NUMBER(start));
-#endif
-	unsigned char* one_program = PAT_PROGRAMME_START(start);
-	/* tvheadend and vdr rewrite PAT, but some mp2t serving systems only remove PMT pids and leave PAT as it is.
-	 * Therefore we have to scan PAT for alle PMT pids. If there are also more than one PMT in the stream a
-	 * "random" (the first seen PMT) program is selected. */
-	// if (! channel_map[PAT_PROGRAMME_PMT(one_program)] ) { // This was here before, but does not work anymore, because we allow more than one PMT result
-	/* Add PMT if we don't have a valid transport_stream_id already */
-	if ( global_state->transport_stream_id  != PAT_TRANSPORT_STREAM_ID(start)) {
-		if (dvb_crc32(start, PAT_SECTION_LENGTH(start) + 3) == 0) {
-			unsigned int i = 0;
-#ifdef DEBUG
-			// DumpHex(one_program, PAT_SECTION_LENGTH(start) - 8);
-#endif
-			/* Scan for possible, valid PMTs */
-			global_state->transport_stream_id = PAT_TRANSPORT_STREAM_ID(start);
-			for (i = 0; i < ( PAT_SECTION_LENGTH(start) - 8 - 2 /* CRC */ ); i += 4) {
-				if (PAT_PROGRAMME_PMT( (one_program + i) ) > 0x11) { // Only add normal tables, not NIT et.al.
-					add_channel(CHANNEL_TYPE_PMT, PAT_PROGRAMME_PMT( (one_program + i) ));
-					possible_pmt += 1;
-				}
+	uint32_t i;
+
+	if (psi_pat_packet(pes_ptr, pes_len, start_of_pes)) {
+		latency_milestone(MILESTONE_PAT);
+		global_state->transport_stream_id = psi_transport_stream_id();
+		for (i = 0; i < psi_program_count(); i++) {
+			const psi_program_t *program = psi_program(i);
+			if (! channel_map[program->pmt_pid]) {
+				add_channel(CHANNEL_TYPE_PMT, program->pmt_pid);
+				possible_pmt += 1;
 			}
 		}
-		output_logmessage("extract_pat_payload(): Added %d possible PMT id(s) with transport_stream_id: %d.\n", possible_pmt, global_state->transport_stream_id);
+		output_logmessage("extract_pat_payload(): Added %d possible PMT id(s) for %d programme(s) with transport_stream_id: %d.\n",
+			possible_pmt, psi_program_count(), global_state->transport_stream_id);
 	}
+	/* Picking a programme without all PMTs depends on the PAT repetitions */
+	select_programme();
 	return;
 }
 
 /* Let's hate software patents. This table is guessed out of real world radio DVB-S reception
- * It's not correct, but if someone wants this fixed, please provide me a description of how
- * the streaming parameters are read out of the LATM stream or mpeg-ts stream PMT.
+ * It's only a first guess to get the stream started, the samplerate and bitrate are
+ * corrected by latm_parse() as soon as the AudioMuxConfig of the stream is read.
  */
 
 static void set_latm_parameters(uint8_t aac_profile) {
@@ -211,13 +276,11 @@ static void set_latm_parameters(uint8_t aac_profile) {
 /* Get the info about one stream back out of the PMT
  * Make a quality estimation to select the best stream afterwards */
 
-audio_quality_t * analyze_stream_from_pmt(unsigned char *pmt_stream_info_offset, unsigned char *start) {
+void analyze_stream_from_pmt(unsigned char *pmt_stream_info_offset, audio_quality_t * stream_quality) {
 	unsigned int stream_type;
-	audio_quality_t * stream_quality = NULL;
 	enum_audio_checks audio_all_checks = NO_AUDIO_STREAM;
 
 	stream_type = PMT_STREAM_TYPE(pmt_stream_info_offset);
-	stream_quality = calloc(1, sizeof(audio_quality_t));
 	memset(stream_quality, 0, sizeof(audio_quality_t));
 	/* Search for audio streams and make an assumption about preference
 	 * We want MP1/2, AAC-LATM, AAC, AC-3 (in this order)
@@ -266,7 +329,7 @@ audio_quality_t * analyze_stream_from_pmt(unsigned char *pmt_stream_info_offset,
 			break;
 		default:
 			/* No useful stream found */
-			return stream_quality;
+			return;
 			break;
 	}
 	/* We found a supported media or data stream */
@@ -367,12 +430,90 @@ audio_quality_t * analyze_stream_from_pmt(unsigned char *pmt_stream_info_offset,
 		default:
 			break;
 	}
-	return stream_quality;
+	return;
+}
+
+/* Is nobody but a warm start subscription listening on this PID? */
+static int stream_unsubscribed(uint16_t pid) {
+	return (! channel_map[pid]) || channel_map[pid]->speculative;
+}
+
+/* Forget a warm start subscription, the PMT has not confirmed it */
+static void drop_speculative_stream(ts2shout_channel_t *chan) {
+	output_logmessage("drop_speculative_stream(): %s PID %d of the last session is not in the PMT any longer\n",
+		channel_name(chan->channel_type), chan->pid);
+	if (channel_map[chan->pid] == chan) {
+		channel_map[chan->pid] = NULL;
+	}
+	chan->speculative = 0;
+	return;
+}
+
+/* Subscribe a stream found in the PMT. A warm start subscription of the same
+ * type is confirmed or moved over to the PID given by the PMT */
+static void subscribe_stream(enum_channel_type channel_type, uint16_t pid) {
+	int i;
+	if (channel_map[pid] && channel_map[pid]->speculative
+		&& channel_map[pid]->channel_type != channel_type) {
+		drop_speculative_stream(channel_map[pid]);
+	}
+	for (i = 0; i < channel_count; i++) {
+		ts2shout_channel_t *chan = channels[i];
+		if (! chan->speculative || chan->channel_type != channel_type) {
+			continue;
+		}
+		chan->speculative = 0;
+		if (chan->pid == pid) {
+			output_logmessage("subscribe_stream(): %s PID %d of the last session confirmed by PMT\n", channel_name(channel_type), pid);
+			return;
+		}
+		output_logmessage("subscribe_stream(): %s PID changed from %d to %d since the last session\n", channel_name(channel_type), chan->pid, pid);
+		channel_map[chan->pid] = NULL;
+		chan->pid = pid;
+		chan->continuity_count = -1;
+		chan->pes_remaining = 0;
+		chan->synced = 0;
+		chan->resync = 0;
+		latency_dropped(chan->buf_used);
+		chan->buf_used = 0;
+		channel_map[pid] = chan;
+		return;
+	}
+	add_channel(channel_type, pid);
+	return;
+}
+
+/* Subscribe the streams of the last session before PAT and PMT arrive. The
+ * audio starts with its first frame, the PMT confirms or corrects the PIDs later */
+static void warm_start_subscribe() {
+	stream_layout_t *layout = &global_state->warm_start;
+	uint16_t pids[] = { layout->payload_pid, (global_state->prefer_rds ? layout->rds_pid : 0), layout->dsmcc_pid };
+	enum_channel_type types[] = { CHANNEL_TYPE_PAYLOAD, CHANNEL_TYPE_RDS, CHANNEL_TYPE_DSMCC };
+	unsigned int i;
+
+	if (layout->payload_pid == 0 || global_state->stream_type == STREAM_MODE_NONE) {
+		return;
+	}
+	output_logmessage("warm_start_subscribe(): Using the PIDs of the last session (transport_stream_id %d, service_id %d)\n",
+		layout->transport_stream_id, layout->service_id);
+	for (i = 0; i < sizeof(pids)/sizeof(pids[0]); i++) {
+		/* Below 0x20 are the PSI/SI tables */
+		if (pids[i] < 0x20 || pids[i] >= MAX_PID_COUNT) {
+			continue;
+		}
+		if (add_channel(types[i], pids[i])) {
+			channel_map[pids[i]]->speculative = 1;
+			if (types[i] == CHANNEL_TYPE_PAYLOAD) {
+				latency_milestone(MILESTONE_PAYLOAD);
+			}
+		}
+	}
+	return;
 }
 
 /* Get info about an available media stream (we want mp1/mp2/mp4 or AC-3) */
 
-static void add_payload_from_pmt(audio_quality_t * stream_quality, unsigned char *start) {
+static void add_payload_from_pmt(audio_quality_t * stream_quality, uint16_t service_id) {
 
 	enum_audio_checks audio_all_checks = NO_AUDIO_STREAM;
 
@@ -438,158 +579,127 @@ static void add_payload_from_pmt(audio_quality_t * stream_quality, unsigned char
 	}
 	/* If all parameters are ok, add the payload stream */
 	if ( audio_all_checks == AUDIO_STREAM ) {
-		global_state->service_id = PMT_PROGRAM_NUMBER(start);
+		global_state->service_id = service_id;
 		global_state->mime_type = mime_type(global_state->stream_type);
 		global_state->payload_added = 1;
+		latency_milestone(MILESTONE_PAYLOAD);
 		output_logmessage("add_payload_from_pmt(): Found %s audio stream in PID %d (service_id %d)\n", stream_quality->stream_type_name, PMT_PID(stream_quality->ptr), global_state->service_id);
-		add_channel(CHANNEL_TYPE_PAYLOAD, PMT_PID(stream_quality->ptr));
+		subscribe_stream(CHANNEL_TYPE_PAYLOAD, PMT_PID(stream_quality->ptr));
 	} else if ( audio_all_checks == RDS_STREAM ) {
 		if ( global_state->prefer_rds > 0) {
 			output_logmessage("add_payload_from_pmt(): Found RDS data stream in PID %d\n", PMT_PID(stream_quality->ptr));
-			add_channel(CHANNEL_TYPE_RDS, PMT_PID(stream_quality->ptr));
+			subscribe_stream(CHANNEL_TYPE_RDS, PMT_PID(stream_quality->ptr));
 		} else {
 			output_logmessage("add_payload_from_pmt(): Ignoring RDS data stream in PID %d, RDS disabled by configuration\n", PMT_PID(stream_quality->ptr));
 		}
 	} else if ( audio_all_checks == DSMCC_STREAM ) {
 		output_logmessage("add_payload_from_pmt(): Found DSM-CC data stream in PID %d\n", PMT_PID(stream_quality->ptr));
-		add_channel(CHANNEL_TYPE_DSMCC, PMT_PID(stream_quality->ptr));
+		subscribe_stream(CHANNEL_TYPE_DSMCC, PMT_PID(stream_quality->ptr));
 	}
 	return;
 }
 
-/* Get stream info out of the PMT (program map table). We are only interested in mp1/mp2/aac and ac-3 streams */
+/* Get stream info out of the PMT (program map table). The sections are collected by
+ * the PSI engine, each programme is parsed once */
 
 static void extract_pmt_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout_channel_t *chan, int start_of_pes ) {
-	unsigned char* start = NULL;
+	/* Only check for possible streaming payload in PMT if not one is added yet */
+	if ( global_state->payload_added) {
+		return;
+	}
+	psi_pmt_packet(chan->pid, pes_ptr, pes_len, start_of_pes);
+	select_programme();
+	return;
+}
+
+/* Subscribe the streams of the programme picked by psi_select(). We are only
+ * interested in mp1/mp2/aac and ac-3 streams, RDS and DSM-CC */
+
+static void select_programme() {
+	static const psi_program_t *analyzed = NULL;
+	const psi_program_t *program;
 	uint8_t found_streams_counter = 0;
 	uint8_t i = 0;
-	uint32_t section_length = 0;
-	uint32_t current_offset = 9; /* Size of PMT "header" */
 	uint32_t best_quality = 0;
-	audio_quality_t* quality[10]; /* Maximum of 10 streams possible */
+	audio_quality_t quality[PSI_MAX_STREAMS];
 	char aac_info_message[STR_BUF_SIZE] = "";
 
-	/* Only check for possible streaming payload in PMT if not one is added yet */
 	if ( global_state->payload_added) {
 		return;
 	}
-	start = pes_ptr + start_of_pes;
+	program = psi_select();
+	if (! program || program == analyzed) {
+		return;
+	}
+	analyzed = program;
+	latency_milestone(MILESTONE_PMT);
+	for (i = 0; i < program->stream_count; i++) {
+		analyze_stream_from_pmt(program->stream[i], &quality[i]);
+	}
+	found_streams_counter = program->stream_count;
+	/* Search for best audio */
+	for (i = 0; i < found_streams_counter; i++) {
 #ifdef DEBUG
-    fprintf (stderr, "PMT: Found data, table 0x%2.2x (Section length %d), program number %d, section %d, last section %d, INFO Length %d\n",
-		PMT_TABLE_ID(start),
-		PMT_SECTION_LENGTH(start),
-		PMT_PROGRAM_NUMBER(start),
-		PMT_SECTION_NUMBER(start),
-		PMT_LAST_SECTION_NUMBER(start),
-		PMT_PROGRAMME_INFO_LENGTH(start));
+		fprintf(stderr, "Found Stream in Mode %d with Preference %d as number %d\n", quality[i].stream_type, quality[i].audio_preference, i);
 #endif
-	section_length = PMT_SECTION_LENGTH(start);
-	/* Look into table 0x02 containing the PID to be read */
-	if ( PMT_TABLE_ID(start) == 2) {
-		/* Check crc32 to avoid checking it later on */
-		if (dvb_crc32(start, PAT_SECTION_LENGTH(start) + 3) != 0) {
-			output_logmessage("extract_pmt_payload(): crc32 does not match %d found, 0 expected\n", dvb_crc32(start, PAT_SECTION_LENGTH(start) + 3));
-			return;
+
+		if (quality[i].audio_preference > best_quality) {
+			best_quality = quality[i].audio_preference ;
 		}
-		if (PMT_SECTION_NUMBER(start) == 0 && PMT_LAST_SECTION_NUMBER(start) == 0) {
-			unsigned char* pmt_stream_info_offset = PMT_DESCRIPTOR(start);
-			/* Search for stream description */
-			while ((pmt_stream_info_offset != NULL) && found_streams_counter < 10 && current_offset < section_length) {
-				quality[found_streams_counter] = analyze_stream_from_pmt(pmt_stream_info_offset, start);
-				found_streams_counter += 1;
-				current_offset += PMT_INFO_LENGTH(pmt_stream_info_offset);
-				pmt_stream_info_offset = PMT_FIRST_STREAM_DESCRIPTORP(pmt_stream_info_offset) + PMT_INFO_LENGTH(pmt_stream_info_offset);
+	}
+	/* Search for Audio in best quality */
+	for (i = 0; i < found_streams_counter; i++) {
+		if (quality[i].stream_type != STREAM_MODE_NONE
+			&& quality[i].stream_type != STREAM_MODE_RDS
+			&& quality[i].stream_type != STREAM_MODE_DSMCC
+			&& quality[i].audio_preference == best_quality) {
+			/* Add audio */
+			if (stream_unsubscribed(PMT_PID(quality[i].ptr))) {
+				add_payload_from_pmt(&quality[i], program->service_id);
 			}
-		}
-		if ( found_streams_counter > 0) {
-			found_streams_counter -= 1;
-		}
-		/* Search for best audio */
-		for (i = 0; i < found_streams_counter; i++) {
-#ifdef DEBUG
-			fprintf(stderr, "Found Stream in Mode %d with Preference %d as number %d\n", quality[i]->stream_type, quality[i]->audio_preference, i);
-#endif
-
-			if (quality[i]->audio_preference > best_quality) {
-				best_quality = quality[i]->audio_preference ;
+			if (quality[i].stream_type == STREAM_MODE_AACP) {
+				/* With FFmpeg the decoder is set up as soon as the LATM parser finds UECP data */
+				global_state->aac_inline_rds = 1;
 			}
 		}
-		/* Search for Audio in best quality */
-		for (i = 0; i < found_streams_counter; i++) {
-			if (quality[i]->stream_type != STREAM_MODE_NONE
-				&& quality[i]->stream_type != STREAM_MODE_RDS
-				&& quality[i]->stream_type != STREAM_MODE_DSMCC
-				&& quality[i]->audio_preference == best_quality) {
-				/* Add audio */
-				if (! channel_map[PMT_PID(quality[i]->ptr)]) {
-					add_payload_from_pmt(quality[i], start);
-				}
-				if (quality[i]->stream_type == STREAM_MODE_AACP) {
-#ifdef FFMPEG
-					/* Prepare ffmpeg */
-					global_state->ffmpeg.pkt = av_packet_alloc();
-					/* find the MPEG audio decoder */
-					global_state->ffmpeg.codec = avcodec_find_decoder(AV_CODEC_ID_AAC_LATM);
-					if (! global_state->ffmpeg.codec) {
-						output_logmessage("avcodec_find_decoder(): Codec AV_CODEC_ID_AAC_LATM not found.\n");
-						goto end;
-					}
-					global_state->ffmpeg.parser = av_parser_init(global_state->ffmpeg.codec->id);
-					if (! global_state->ffmpeg.parser) {
-						output_logmessage("av_parser_init(): Parser for Codec not possible.\n");
-						goto end;
-					}
-					global_state->ffmpeg.c = avcodec_alloc_context3(global_state->ffmpeg.codec);
-					if (! global_state->ffmpeg.c) {
-						output_logmessage("avcodec_alloc_context3(): Could not allocate audio codec context.\n");
-						goto end;
-					}
-					/* open it */
-					if (avcodec_open2(global_state->ffmpeg.c, global_state->ffmpeg.codec, NULL) < 0) {
-						output_logmessage("avcodec_open2(): Could not open codec.\n");
-						goto end;
-					}
-					global_state->ffmpeg.decoded_frame = av_frame_alloc();
-					if (! global_state->ffmpeg.decoded_frame) {
-						output_logmessage("av_frame_alloc(): Could not allocate decoded frame space.\n");
-						goto end;
-					}
-#endif 
-					/* No FFMPEG or Parser successfully initialized, let's go! */
-					global_state->aac_inline_rds = 1;
-#ifdef FFMPEG
-					end:
-#endif
-					(void)0; // NOP
-				}
+	}
+	/* Search RDS */
+	for (i = 0; i < found_streams_counter; i++) {
+		if (quality[i].stream_type == STREAM_MODE_RDS) {
+			if (stream_unsubscribed(PMT_PID(quality[i].ptr))) {
+				global_state->aac_inline_rds = 0;
+				sprintf(aac_info_message, " (Separate RDS PID %d available)", PMT_PID(quality[i].ptr) );
+				add_payload_from_pmt(&quality[i], program->service_id);
 			}
 		}
-		/* Search RDS */
-		for (i = 0; i < found_streams_counter; i++) {
-			if (quality[i]->stream_type == STREAM_MODE_RDS) {
-				if (! channel_map[PMT_PID(quality[i]->ptr)]) {
-					global_state->aac_inline_rds = 0;
-					sprintf(aac_info_message, " (Separate RDS PID %d available)", PMT_PID(quality[i]->ptr) );
-					add_payload_from_pmt(quality[i], start);
-				}
+	}
+	/* Search DSMCC */
+	for (i = 0; i < found_streams_counter; i++) {
+		if (quality[i].stream_type == STREAM_MODE_DSMCC) {
+			if (stream_unsubscribed(PMT_PID(quality[i].ptr))) {
+				add_payload_from_pmt(&quality[i], program->service_id);
 			}
 		}
-		/* Search DSMCC */
-		for (i = 0; i < found_streams_counter; i++) {
-			if (quality[i]->stream_type == STREAM_MODE_DSMCC) {
-				if (! channel_map[PMT_PID(quality[i]->ptr)]) {
-					add_payload_from_pmt(quality[i], start);
-				}
-			}
+	}
+	/* The clock of the programme may have a PID of its own */
+	if (global_state->payload_added && program->pcr_pid >= 0x20 && program->pcr_pid < 0x1fff) {
+		global_state->pcr_pid = program->pcr_pid;
+		if (stream_unsubscribed(program->pcr_pid)) {
+			subscribe_stream(CHANNEL_TYPE_PCR, program->pcr_pid);
 		}
-		for (i = 0; i < found_streams_counter; i++) {
-			free(quality[i]);
+	}
+	/* Warm start subscriptions not found in the PMT are stale */
+	if (global_state->payload_added) {
+		for (i = 0; i < channel_count; i++) {
+			if (channels[i]->speculative) {
+				drop_speculative_stream(channels[i]);
+			}
 		}
+	} else {
+		output_logmessage("select_programme(): No usable audio stream in service_id %d\n", program->service_id);
 	}
-#ifdef FFMPEG
 	output_logmessage("AAC inline RDS messages are %s (rds option %s) %s\n", ((global_state->prefer_rds && global_state->aac_inline_rds > 0)? "enabled" : "disabled"), 
 		((global_state->prefer_rds)?"given" : "not given"), aac_info_message);
-#endif
 }
 
 
@@ -824,6 +934,9 @@ static void extract_sdt_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout
 		return;
 	}
 	start = sdt_table->buffer;
+	if (global_state->multiplex && dvb_crc32(start, sdt_table->section_length + 3) == 0) {
+		services_sdt(start);
+	}
 #ifdef DEBUG
 	fprintf (stderr, "SDT: Found data, table 0x%2.2x (Section length %d), program number %d, section %d, last section %d\n",
 		PMT_TABLE_ID(start),
@@ -876,16 +989,10 @@ static void extract_sdt_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout
 							char service_name[STR_BUF_SIZE];
 							uint8_t service_name_length = description_content[SDT_DC_PROVIDER_NAME_LENGTH(description_content) + 4];
 							unsigned char * tmp = description_content + SDT_DC_PROVIDER_NAME_LENGTH(description_content) + 5;
-							if (SDT_DC_PROVIDER_NAME_LENGTH(description_content) < STR_BUF_SIZE) {
-								if (SDT_DC_PROVIDER_NAME(description_content)[0] < 0x20) {
-									/* MPEG Standard has very sophisticated charset encoding, therefore a simple Hack for my setup */
-									snprintf(provider_name, SDT_DC_PROVIDER_NAME_LENGTH(description_content), "%s", SDT_DC_PROVIDER_NAME(description_content + 1) );
-								} else {
-									snprintf(provider_name, SDT_DC_PROVIDER_NAME_LENGTH(description_content) + 1, "%s", SDT_DC_PROVIDER_NAME(description_content));
-								}
-							}
-							/* like above, but written compacted, if first character is smaller 0x20 it's the charset encoding */
-							snprintf(service_name, service_name_length + (tmp[0]< 0x20?0:1), "%s", tmp + (tmp[0]< 0x20?1:0));
+							/* Both names start with the character table selection, see EN 300 468 Annex A */
+							dvb_text_to_utf8(SDT_DC_PROVIDER_NAME(description_content), SDT_DC_PROVIDER_NAME_LENGTH(description_content),
+								provider_name, STR_BUF_SIZE);
+							dvb_text_to_utf8(tmp, service_name_length, service_name, STR_BUF_SIZE);
 							/* Service 0x02, 0x0A, 0x07: (Digital) Radio */
 							if (SDT_DC_SERVICE_TYPE(description_content) == 0x2
 								|| SDT_DC_SERVICE_TYPE(description_content) == 0x0a
@@ -893,26 +1000,29 @@ static void extract_sdt_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout
 								|| SDT_DC_SERVICE_TYPE(description_content) == 0x01 /* broken station has SD-TV set */ ) {
 								/* Sometime we get garbage only store if we have a service_name with length > 0 */
 								if (strlen(service_name) > 0) {
-									/* service name is latin1 in most cases */
-									unsigned char utf8_service_name[STR_BUF_SIZE];
-									utf8((unsigned char*)service_name, utf8_service_name);
 									/* Yes, we want to get information about the programme */
-									output_logmessage("SDT: Stream is station %s from network %s.\n", utf8_service_name, provider_name);
-									strncpy(global_state->station_name, service_name, STR_BUF_SIZE);
+									output_logmessage("SDT: Stream is station %s from network %s.\n", service_name, provider_name);
+									if (strcmp(global_state->station_name, service_name) != 0) {
+										strncpy(global_state->station_name, service_name, STR_BUF_SIZE);
+										nowplaying_publish();
+									}
+									/* The icy-name is gone already, tell the station name by the StreamTitle */
+									if (global_state->station_name_pending) {
+										global_state->station_name_pending = 0;
+										if (global_state->stream_title[0] == 0) {
+											set_stream_title(global_state->station_name);
+										}
+									}
 									global_state->sdt_fromstream = 1;
+									latency_milestone(MILESTONE_SDT);
 									break; /* leave while loop */
 								}
 							} else {
 								/* If service type is 0xff it's very likely just a stuffing frame without any content */
-								unsigned char utf8_service_name[STR_BUF_SIZE];
-								if (strlen(service_name) > 0) {
-									unsigned char utf8_service_name[STR_BUF_SIZE];
-									utf8((unsigned char*)service_name, utf8_service_name);
-								}
 								if (SDT_DC_SERVICE_TYPE(description_content) == 0x1f) {
-									output_logmessage("SDT: Warning: Stream (also) contains service HEVC HDTV (%s)\n", utf8_service_name);
+									output_logmessage("SDT: Warning: Stream (also) contains service HEVC HDTV (%s)\n", service_name);
 								} else if (SDT_DC_SERVICE_TYPE(description_content) != 0xff) {
-									output_logmessage("SDT: Warning: Stream (also) contains unkown service with id 0x%2x (%s)\n", SDT_DC_SERVICE_TYPE(description_content), utf8_service_name);
+									output_logmessage("SDT: Warning: Stream (also) contains unkown service with id 0x%2x (%s)\n", SDT_DC_SERVICE_TYPE(description_content), service_name);
 								}
 							}
 						}
@@ -927,19 +1037,155 @@ static void extract_sdt_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout
 }
 
 
+/* Present/following handling of the EIT (table 0x4e). Section 0 contains the
+ * present event, section 1 the following event. Both are decoded with their
+ * start time and duration when a new version of the section arrives. The title
+ * of the following event is prepared in advance and switched by eit_timer()
+ * at the scheduled start time, so we don't have to wait for the broadcaster
+ * to send a new version of the present section. */
+typedef struct eit_event_s {
+	uint8_t  valid;
+	uint16_t event_id;
+	uint8_t  running_status;
+	time_t   start;                     /* start time (UTC), 0 if undefined */
+	uint32_t duration;                  /* duration in seconds */
+	char     short_description[STR_BUF_SIZE];
+	char     title[STR_BUF_SIZE];       /* ready to use StreamTitle */
+} eit_event_t;
+
+static struct {
+	uint8_t  version[2];                /* version of the present and following section */
+	eit_event_t event[2];               /* present and following event */
+	time_t   switch_at;                 /* start of the following event, 0 if not scheduled */
+	uint16_t switched_from;             /* event_id we left at the scheduled time */
+} eit_pf = { { 0xff, 0xff } };
+
+/* Convert BCD coded time (hours, minutes, seconds) to seconds */
+static uint32_t eit_bcd_seconds(uint32_t bcd) {
+	uint8_t h = bcd >> 16;
+	uint8_t m = (bcd >> 8) & 0xff;
+	uint8_t s = bcd & 0xff;
+	return ((h >> 4) * 10 + (h & 0x0f)) * 3600 + ((m >> 4) * 10 + (m & 0x0f)) * 60 + (s >> 4) * 10 + (s & 0x0f);
+}
+
+/* Start time is given as MJD date and BCD time (UTC). All bits set means undefined */
+static time_t eit_event_start(unsigned char* event_start) {
+	uint32_t mjd = EIT_EVENT_STARTTIME_DATE(event_start);
+	uint32_t bcd = EIT_EVENT_STARTTIME_TIME(event_start);
+	if (mjd == 0xffff && bcd == 0xffffff) {
+		return 0;
+	}
+	return ((time_t)mjd - 40587) * 86400 + eit_bcd_seconds(bcd);
+}
+
+/* Build the StreamTitle (UTF-8) out of the short event descriptor(s) of an event.
+ * The event name is taken from the first descriptor, the texts of all short event
+ * descriptors are joined with " ~ " (some broadcasters split longer texts) */
+static int eit_event_decode(unsigned char* event_start, unsigned char* section_end, eit_event_t *event) {
+	unsigned char* description_start = EIT_EVENT_DESCRIPTORP(event_start);
+	unsigned char* description_end = description_start + EIT_EVENT_LOOPLENGTH(event_start);
+	char text_description[STR_BUF_SIZE];
+	size_t text_length = 0;
+	uint8_t found = 0;
+	int retval;
+
+	if (description_end > section_end) {
+		return 0;
+	}
+	text_description[0] = 0;
+	while (description_start + EIT_SIZE_DESCRIPTOR_HEADER <= description_end
+		&& description_start + 2 + description_start[1] <= description_end) {
+		/* 0x4d = Short event descriptor */
+		if (DESCRIPTOR_TAG(description_start) == 0x4d) {
+			unsigned char* text1_start = EIT_NAME_CONTENT(description_start) + EIT_NAME_LENGTH(description_start);
+			if (text1_start + 1 + text1_start[0] > description_end) {
+				break;
+			}
+			if (! found) {
+				dvb_text_to_utf8(EIT_NAME_CONTENT(description_start), EIT_NAME_LENGTH(description_start),
+					event->short_description, STR_BUF_SIZE);
+				found = 1;
+			}
+			if (text1_start[0] > 0 && text_length + 4 < STR_BUF_SIZE) {
+				if (text_length > 0) {
+					strcpy(text_description + text_length, " ~ ");
+					text_length += 3;
+				}
+				text_length += dvb_text_to_utf8(text1_start + 1, text1_start[0], text_description + text_length, STR_BUF_SIZE - text_length);
+			}
+#ifdef DEBUG
+			fprintf(stderr, "DEBUG: text1: %s, text1_len: %d, global_len: %d\n", text_description, text1_start[0], EIT_EVENT_LOOPLENGTH(event_start));
+#endif
+		}
+		description_start += description_start[1] + 2;
+	}
+	if (! found) {
+		return 0;
+	}
+	event->event_id = EIT_EVENT_EVENTID(event_start);
+	event->running_status = EIT_EVENT_RUNNING_STATUS(event_start);
+	event->start = eit_event_start(event_start);
+	event->duration = eit_bcd_seconds(EIT_EVENT_DURATION(event_start));
+	/* Write full info into channel title, but only if there is a difference between text and short description */
+	if (text_length > 0) {
+		retval = snprintf(event->title, STR_BUF_SIZE, "%s - %s", event->short_description, text_description);
+	} else {
+		/* Sonst nur short description */
+		retval = snprintf(event->title, STR_BUF_SIZE, "%s", event->short_description);
+	}
+	assert(retval >= 0);
+	event->valid = 1;
+	return 1;
+}
+
+/* Use the title of event as StreamTitle */
+static void eit_set_title(eit_event_t *event) {
+	char current_playtime[19] = "";
+	if (global_state->found_rds > 0 || ! set_stream_title(event->title)) {
+		return;
+	}
+	if (! global_state->cgi_mode ) {
+		if ( global_state->playtime_s < 60) {
+			snprintf(current_playtime, 18, " (%d s)", global_state->playtime_s);
+		} else {
+			snprintf(current_playtime, 18, " (%02d:%02d s)", (global_state->playtime_s / 60), global_state->playtime_s % 60);
+		}
+	}
+	output_logmessage("EIT%s: %s\n", current_playtime, event->short_description);
+	return;
+}
+
+/* Arm the switch to the following event if it starts in the future */
+static void eit_schedule_following() {
+	eit_event_t *following = &eit_pf.event[1];
+	eit_pf.switch_at = 0;
+	if (following->valid && following->start > time(NULL)) {
+		eit_pf.switch_at = following->start;
+	}
+	return;
+}
+
+/* Called regularly, switches to the following event at its start time */
+static void eit_timer() {
+	if (eit_pf.switch_at == 0 || time(NULL) < eit_pf.switch_at) {
+		return;
+	}
+	eit_pf.switch_at = 0;
+	eit_pf.switched_from = eit_pf.event[0].event_id;
+	eit_pf.event[0] = eit_pf.event[1];
+	eit_pf.event[1].valid = 0;
+	/* Force reading the next version of the following section */
+	eit_pf.version[1] = 0xff;
+	eit_set_title(&eit_pf.event[0]);
+	return;
+}
+
 static void extract_eit_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout_channel_t *chan, int start_of_pes, unsigned char* ts_full_frame )
 {
-	if (global_state->found_rds > 0) {
+	if (global_state->found_rds > 0 && ! global_state->multiplex) {
 		return;
 	}
 	unsigned char* start = NULL;
-	//uint8_t buffer[EIT_BUF_SIZE];
-	//uint8_t size = 0;
-	char short_description[STR_BUF_SIZE];
-	char text_description[STR_BUF_SIZE];
-
-	memset(short_description, 0, STR_BUF_SIZE);
-	memset(text_description, 0, STR_BUF_SIZE);
 
 	start = pes_ptr + start_of_pes;
 
@@ -951,27 +1197,31 @@ static void extract_eit_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout
 #ifdef DEBUG
 	fprintf(stderr, "EIT: crc32 %s (%d, l: %d)\n",(  dvb_crc32(start, EIT_SECTION_LENGTH(start)+3)== 0?"OK":"FAIL"), dvb_crc32(start, EIT_SECTION_LENGTH(start)+3), EIT_SECTION_LENGTH(start)+3);
 #endif
-	if (dvb_crc32(start, EIT_SECTION_LENGTH(start)+3)!= 0) {
-		/* crc32 not valid, throw away buffer */
-		// eit_table->ob_used = 0;
-		eit_table->buffer_valid = 0;
-		return;
+	/* Only present/following, the schedule tables (0x50-0x6f) are most of the EIT and aren't worth a crc32 */
+	if (global_state->multiplex && eit_table->buffer_valid == 1
+		&& (EIT_PACKET_TABLEID(start) == 0x4e || EIT_PACKET_TABLEID(start) == 0x4f) && EIT_SECTION_NUMBER(start) <= 1
+		&& dvb_crc32(start, EIT_SECTION_LENGTH(start)+3) == 0) {
+		services_eit(start);
 	}
-	/* 0x4e current_event table */
-	if (eit_table->buffer_valid == 1 &&  0x4e == EIT_PACKET_TABLEID(start)) {
-		/* Current programme found */
+	/* 0x4e present/following table, section 0 is the present, section 1 the following event */
+	if (eit_table->buffer_valid == 1 && 0x4e == EIT_PACKET_TABLEID(start)
+		&& EIT_SECTION_NUMBER(start) <= 1
+		&& EIT_SERVICE_ID(start) == global_state->service_id
+		&& EIT_TRANSPORT_STREAM_ID(start) == global_state->transport_stream_id
+		&& EIT_VERSION_NUMBER(start) != eit_pf.version[EIT_SECTION_NUMBER(start)]
+		&& EIT_SECTION_LENGTH(start) > 15 ) {
 		unsigned char* event_start = EIT_PACKET_EVENTSP(start);
-		unsigned char* description_start = EIT_EVENT_DESCRIPTORP(event_start);
-		unsigned int service_id = EIT_SERVICE_ID(start);
-		if ( service_id != global_state->service_id ) {
-#ifdef DEBUG
-			fprintf(stderr, "EIT: service_id %d is wrong (%d)\n", service_id, global_state->service_id);
-#endif
+		uint8_t section = EIT_SECTION_NUMBER(start);
+		eit_event_t *event = &eit_pf.event[section];
+		/* Now calculate crc32, because we want to do something with the data */
+		if (dvb_crc32(start, EIT_SECTION_LENGTH(start)+3) != 0) {
+			#ifdef DEBUG
+			fprintf(stderr, "EIT: crc32 does not match, calculated %d, expected 0, using section length: %d\n", dvb_crc32(start, EIT_SECTION_LENGTH(start)+3), EIT_SECTION_LENGTH(start)+3);
+			#endif
 			eit_table->buffer_valid = 0;
 			return;
 		}
 #ifdef DEBUG
-		unsigned char* first_description_start = EIT_EVENT_DESCRIPTORP(event_start);
 		fprintf(stderr, "EIT: Found event with id %d, currently in status %d, starttime %6.6x, duration %6.6x, Section: %d (V:%d) from %d (Length: %d).\n",
 			EIT_EVENT_EVENTID(event_start),
 			EIT_EVENT_RUNNING_STATUS(event_start),
@@ -982,102 +1232,29 @@ static void extract_eit_payload(unsigned char *pes_ptr, size_t pes_len, ts2shout
 			EIT_LAST_SECTION_NUMBER(start),
 			EIT_SECTION_LENGTH(start));
 #endif
-		/* 0x4d = Short event descriptor found, transport_stream matches */
-		if (DESCRIPTOR_TAG(description_start) == 0x4d && EIT_TRANSPORT_STREAM_ID(start) == global_state->transport_stream_id ) {
-			/* Now calculate crc32, because we want to do something with the data */
-			if (dvb_crc32(start, EIT_SECTION_LENGTH(start)+3) != 0) {
-				#ifdef DEBUG
-				fprintf(stderr, "EIT: crc32 does not match, calculated %d, expected 0, using section length: %d\n", dvb_crc32(start, EIT_SECTION_LENGTH(start)+3), EIT_SECTION_LENGTH(start)+3);
-				#endif
-				eit_table->buffer_valid = 0;
-				return;
-			}
-			//fprintf(stderr, "EIT: Dumping full buffer .. \n");
-			// write(2, start, eit_table->section_length);
-			// fprintf(stderr, "\n");
-			/* Step through the event descriptions */
-			uint16_t current_in_position = 0;
-			uint16_t current_out_position = 0;
-			uint16_t max_size = EIT_EVENT_LOOPLENGTH(event_start);
-			unsigned int stringlen = 0;
-			unsigned char* text1_start = NULL;
-			enum_charset text_charset;
-			int text1_len = 0;
-			uint8_t * tmp = EIT_NAME_CONTENT(description_start);
-			/* The same charset issue as with the SDT */
-			stringlen = EIT_NAME_LENGTH(description_start) + (tmp[0] < 0x20? 0 : 1);
-			snprintf(short_description, stringlen, "%s", EIT_NAME_CONTENT(description_start) + (tmp[0] < 0x20? 1 : 0) );
-			if (tmp[0] < 0x20) {
-				text_charset = tmp[0];
-			} else {
-				text_charset = CHARSET_LATIN1;
-			}
-			while (current_in_position + 60 <= max_size && current_in_position < eit_table->section_length) {
-				stringlen = EIT_NAME_LENGTH(description_start);
-				text1_start = description_start + EIT_SIZE_DESCRIPTOR_HEADER + stringlen;
-				text1_len = text1_start[0];
-				if (text1_len == 0 || text1_len > max_size) break;
-				/* Avoid the character code marker 0x05 if it's a latin1 text */
-				memcpy(text_description + current_out_position, text1_start + (text1_start[1] < 0x20 ? 2 : 1), text1_len - ((text1_start[1] < 0x20) ? 1 : 1));
-				/* First round? */
-				if (current_out_position == 0 && ( 70 < max_size) ) {
-					/* Hack, if the overall text is very short, no "~" */
-					strcpy(text_description + current_out_position + text1_len - 1, " ~ ");
-					memset(text_description + current_out_position + text1_len + 3 - 1, 0, 1);
-					current_out_position += text1_len + 3 - 1;
-				} else {
-					memset(text_description + current_out_position + text1_len - 1, 0, 1);
-					current_out_position += text1_len - 1;
-				}
-#ifdef DEBUG
-				fprintf(stderr, "DEBUG: text1 (charset: 0x%x): %s, in_pos: %d (%d), text1_len: %d, global_len: %d\n", text1_start[1], text_description, current_in_position,
-					current_in_position + text1_len + EIT_SIZE_DESCRIPTOR_HEADER + stringlen, text1_len, max_size);
-#endif
-				description_start = description_start + EIT_SIZE_DESCRIPTOR_HEADER + stringlen + 1 + text1_len + 1;
-				current_in_position += EIT_SIZE_DESCRIPTOR_HEADER + stringlen + 1 + text1_len + 1;
-			}
-			/* Replace control characters */
-			cleanup_mpeg_string(text_description);
-			if ( EIT_EVENT_RUNNING_STATUS(event_start) == 4) {
-				char tmp_title[STR_BUF_SIZE+1];
-#ifdef DEBUG
-				fprintf(stderr, "EIT: RUNNING EVENT: %s (%s) in language %3.3s found.\n", short_description, text_description, EIT_DESCRIPTOR_LANG(first_description_start));
-#endif			/* Write full info into channel title, but only if there is a difference between text and short description */
-				if (text_description != NULL && strlen(text_description) > 0 ) {
-					int retval;
-					retval = snprintf(tmp_title, STR_BUF_SIZE, "%s - %s", short_description, text_description);
-					assert(retval > 0);
-				} else {
-					/* Sonst nur short description */
-					int retval;
-					retval = snprintf(tmp_title, STR_BUF_SIZE, "%s", short_description);
-					assert(retval > 0);
+		if (section == 0 && EIT_EVENT_EVENTID(event_start) == eit_pf.switched_from) {
+			/* The broadcaster didn't update the present section yet, we already switched */
+			eit_table->buffer_valid = 0;
+			return;
+		}
+		eit_pf.version[section] = EIT_VERSION_NUMBER(start);
+		if (eit_event_decode(event_start, start + 3 + EIT_SECTION_LENGTH(start) - 4, event)) {
+			if (section == 0) {
+				eit_pf.switched_from = 0;
+				/* running (or running status not given) */
+				if (event->running_status == 4 || event->running_status == 0) {
+					eit_set_title(event);
 				}
-				if (0 != strcmp(tmp_title, global_state->stream_title)) {
-					// It's needed in iso8859-1 for StreamTitle, but in UTF-8 for logging
-					unsigned char utf8_message[STR_BUF_SIZE];
-					char current_playtime[19];
-					if (! global_state->cgi_mode ) {
-						if ( global_state->playtime_s < 60) {
-							snprintf(current_playtime, 18, " (%d s)", global_state->playtime_s);
-						} else {
-							snprintf(current_playtime, 18, " (%02d:%02d s)", (global_state->playtime_s / 60), global_state->playtime_s % 60);
-						}
-					}
-					strcpy(global_state->stream_title, tmp_title);
-					if (text_charset == CHARSET_LATIN1) {
-						output_logmessage("EIT%s: %s\n", current_playtime, utf8((unsigned char*)short_description, utf8_message));
-					} else if ( text_charset == CHARSET_UTF8 ) {
-						output_logmessage("EIT%s: %s\n", current_playtime, short_description);
-					} else {
-						output_logmessage("EIT%s: (MPEG-Charset: 0x%x, output likely garbaled) %s\n", current_playtime, text_charset, utf8((unsigned char*)short_description, utf8_message));
-					}
+				/* The following event may already be known */
+				if (eit_pf.event[1].valid && eit_pf.event[1].event_id == event->event_id) {
+					eit_pf.event[1].valid = 0;
 				}
-			} else {
+			}
 #ifdef DEBUG
-				fprintf(stderr, "EIT: Event %s in Language %3.3s found.\n", short_description, EIT_DESCRIPTOR_LANG(first_description_start));
+			fprintf(stderr, "EIT: %s event %s (start %ld, duration %d s).\n", (section == 0 ? "present" : "following"),
+				event->title, (long)event->start, event->duration);
 #endif
-			}
+			eit_schedule_following();
 		}
 	}
 	eit_table->buffer_valid = 0;
@@ -1105,11 +1282,34 @@ static void extract_dsmcc_payload( unsigned char *pes_ptr, size_t pes_len, ts2sh
 	unsigned char* start = NULL;
     start = pes_ptr + start_of_pes;
 
+    /* Blocks of modules that are already decoded are dropped by the header in
+     * the first packet of the section, the packets of the rest are not collected */
+    if (start_of_pes) {
+        unsigned char* section = start + TS_PACKET_POINTER(ts_full_frame);
+        if (dsmcc_table->skip && TS_PACKET_POINTER(ts_full_frame) > 0) {
+            /* The packet starts with the end of the skipped section */
+            memset(dsmcc_table, 0, sizeof(section_aggregate_t));
+        }
+        dsmcc_table->skip = 0;
+        if (section + 23 <= pes_ptr + pes_len && dsmcc_table->continuation == 0 && ! dsmcc_section_wanted(section)) {
+            memset(dsmcc_table, 0, sizeof(section_aggregate_t));
+            dsmcc_table->skip = 1;
+            return;
+        }
+    } else if (dsmcc_table->skip) {
+        return;
+    }
+
     /* collect up continuation frames */
     if (! collect_continuation(dsmcc_table, pes_ptr, pes_len, start_of_pes, ts_full_frame, CHANNEL_TYPE_DSMCC )) {
         return;
     }
     start = dsmcc_table->buffer;
+    /* Sections the first packet didn't tell about are dropped before calculating the crc32 */
+    if (! dsmcc_section_wanted(start)) {
+        dsmcc_table->buffer_valid = 0;
+        return;
+    }
     if (dvb_crc32(start, EIT_SECTION_LENGTH(start)+3)!= 0) {
         /* crc32 not valid, throw away continued data */
 #ifdef DEBUG
@@ -1131,75 +1331,23 @@ static void extract_dsmcc_payload( unsigned char *pes_ptr, size_t pes_len, ts2sh
 	return;
 }
 
-#ifdef FFMPEG
-static void aac_decode(AVCodecContext *dec_ctx, AVPacket *pkt, AVFrame *frame) {
-	int ret, data_size;
-	static int64_t frame_nr = 0;
-	char	errstr[STR_BUF_SIZE];
-	/* send the packet with the compressed data to the decoder */
-	ret = avcodec_send_packet(dec_ctx, pkt);
-	if (ret < 0) {
-		av_strerror(ret, errstr, STR_BUF_SIZE);
-		output_logmessage("aac_decode(): Error submitting the packet to the decoder: %s\n", errstr);
-		return;
-    }
-	// fprintf(stderr, "aac_decode(): OK submitting packet to the decoder\n");
-    /* read all the output frames (in general there may be any number of them */
-	while (ret >= 0) {
-		AVFrameSideData* sd = NULL;
-		ret = avcodec_receive_frame(dec_ctx, frame);
-		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-			return;
-		else if (ret < 0) {
-			fprintf(stderr, "Error during decoding\n");
-			exit(1);
-		}
-		frame_nr++;
-		data_size = av_get_bytes_per_sample(dec_ctx->sample_fmt);
-		if (data_size < 0) {
-			/* This should not occur, checking just for paranoia */
-			fprintf(stderr, "Failed to calculate data size\n");
-			exit(1);
-		}
-		sd = av_frame_get_side_data(frame, AV_FRAME_DATA_RDS_DATA_PACKET);
-		/* Sometimes more than one UECP message is found in the frame side data
-		   therefore we try to split it up. */
-		if (sd) {
-			unsigned char* data = sd->data;
-			if ( sd->size >= 2) {
-				int startval = 1;
-				int used = 0;
-				int count = 0; // ensure termination, also for broken data
-				while ( startval < (sd->size - 1) && count < 15 ) {
-					int i = startval;
-					for (; i < (sd->size - 1); i++) {
-						if (   data[i] == 0xff
-							&& data[i+1] == 0xfe) {
-							// fprintf(stderr, "Splitup @%d (size %d, maxsize %ld)\n", startval, i - startval, sd->size);
-							rds_convert_from_extra_pes(data + startval, i - startval);
-							used += 1;
-							startval = i + 2;
-							break;
-						}
-					}
-					count++;
-				}
-				if (used > 0) {
-					// Last element
-					// fprintf(stderr, "Last Element %d (size %ld)\n", startval, sd->size - startval - 1);
-					rds_convert_from_extra_pes(data + startval, sd->size - startval - 1);
-				} else {
-					rds_convert_from_extra_pes(sd->data + 1, sd->size - 2);
-				}
-			}
-		}
-		//for (i = 0; i < frame->nb_samples; i++)
-			// for (ch = 0; ch < dec_ctx->channels; ch++)
-				// fwrite(frame->data[ch] + data_size*i, 1, data_size, outfile);
+/* Quick check whether an audio frame of the stream we are synced to starts at buf.
+ * Used after packet loss, so it must not touch the stream parameters */
+static int frame_header_start( ts2shout_channel_t *chan, const unsigned char* buf )
+{
+	switch (global_state->stream_type) {
+		case STREAM_MODE_MPEG:
+			return (mpa_frame_length(buf, &chan->mpah) > 0);
+		case STREAM_MODE_AAC:
+			return (buf[0] == 0xff && (buf[1] & 0xf6) == 0xf0);
+		case STREAM_MODE_AACP:
+			return (buf[0] == 0x56 && (buf[1] & 0xe0) == 0xe0);
+		case STREAM_MODE_AC3:
+			return (buf[0] == 0x0b && buf[1] == 0x77);
+		default:
+			return 1;
 	}
-	return;
 }
-#endif
 
 int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_channel_t *chan, int start_of_pes )
 {
@@ -1207,12 +1355,6 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 	size_t es_len=0;
 	int32_t bytes_written = 0;
 	static int64_t pes_start = 0;
-#ifdef FFMPEG
-	int ret;
-	static size_t data_size = 0;
-	static unsigned char data_base[STR_BUF_SIZE];
-	static unsigned char* data = data_base;
-#endif
 	/* Start of audio block / PES? */
 	if ( start_of_pes ) {
 		/* Parse and remove PES header */
@@ -1233,35 +1375,10 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 		}
 	}
 #ifdef FFMPEG
-	if (global_state->prefer_rds && global_state->aac_inline_rds && chan->synced ) {
-		// fprintf(stderr, "Filling Offset: %ld, Buffer-size: %ld\n", data - data_base, data_size);
-		memcpy(data, es_ptr, es_len);
-		data = data + es_len;
-		data_size += es_len;
-		/* Process data with ffmpeg */
-		if (! global_state->ffmpeg.decoded_frame) {
-			if (!(global_state->ffmpeg.decoded_frame = av_frame_alloc())) {
-				output_logmessage("ffmpeg(): Could not allocate audio frame\n");
-			}
-		}
-		// DumpHex(data_base, data_size);
-		ret = av_parser_parse2(global_state->ffmpeg.parser, global_state->ffmpeg.c, &global_state->ffmpeg.pkt->data,
-			&global_state->ffmpeg.pkt->size, data_base, data_size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
-		// fprintf(stderr, "ffmpeg(): Decoding: data_size=%ld, ret=%d, pkt->size=%d\n", data_size, ret, global_state->ffmpeg.pkt->size);
-		if (ret < 0) {
-			fprintf(stderr, "ffmpeg(): Error while parsing\n");
-		}
-		data = data_base + ret;
-		data_size -= ret;
-		if (global_state->ffmpeg.pkt->size) {
-			aac_decode(global_state->ffmpeg.c, global_state->ffmpeg.pkt, global_state->ffmpeg.decoded_frame);
-		}
-		memmove(data_base, data, data_size);
-		//if (data_size > 0) {
-		//	fprintf(stderr, "---LEFTOVER---\n");
-		// 	DumpHex(data_base, data_size);
-		//}
-		data = data_base + data_size;
+	/* FFmpeg is only needed as long as the native LATM parser didn't find RDS data */
+	if (global_state->prefer_rds && global_state->aac_inline_rds && chan->synced) {
+		/* Decoded by the worker, the RDS data comes back later */
+		aac_rds_payload(es_ptr, es_len);
 	}
 #endif
 	// Subtract the amount remaining in current PES packet
@@ -1271,6 +1388,18 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 #endif
 	// Got some data to write out?
 	if (es_ptr) {
+		// Packets were lost: skip the rest of the broken frame, the buffered data is kept
+		while (chan->resync && es_len >= 6) {
+			if (frame_header_start(chan, es_ptr)) {
+				chan->resync = 0;
+			} else {
+				es_len--;
+				es_ptr++;
+			}
+		}
+		if (chan->resync) {
+			es_len = 0;
+		}
 		// Scan through Elementary Stream (ES)
 		// and try and find MPEG audio stream header
 		while (!chan->synced && es_len>= 6) {
@@ -1295,6 +1424,7 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 				}
 			}
 			if (chan->synced) {
+				latency_milestone(MILESTONE_SYNC);
 				// Allocate buffer to store packet in
 				chan->buf_size = chan->payload_size + TS_PACKET_SIZE;
 				chan->buf = realloc( chan->buf, chan->buf_size + 4 );
@@ -1310,6 +1440,10 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 				es_ptr++;
 			}
 		}
+		// LATM: read stream parameters and RDS data stream elements
+		if (chan->synced && global_state->stream_type == STREAM_MODE_AACP) {
+			latm_parse(es_ptr, es_len);
+		}
 		// If stream is synced then put data info buffer
 		if (chan->synced && global_state->output_payload) {
 			// Check that there is space
@@ -1320,6 +1454,7 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 			// Copy data into the buffer
 			memcpy( chan->buf_ptr + chan->buf_used, es_ptr, es_len);
 			chan->buf_used += es_len;
+			latency_buffered(es_len);
 		}
 	}
 	/* Okay, actually this doesn't fit very well here, but we want to update the
@@ -1328,6 +1463,7 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 	 * here - Perhaps we can move this elsewhere TODO */
 	if ((!global_state->cache_written) &&
 		global_state->cgi_mode		   &&
+		global_state->payload_added    &&
 		global_state->sdt_fromstream   &&
 		chan->synced) {
 		add_cache(global_state);
@@ -1343,6 +1479,7 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 	// Got enough to send packet and we are allowed to output data
 	if (chan->buf_used > chan->payload_size && global_state->output_payload ) {
 		#ifndef DEBUG
+		latency_write_begin();
 		if (pes_start == 0) {	
 			pes_start = chan->pes_ts;
 		}
@@ -1374,20 +1511,17 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 			} else {
 				uint32_t first_write = SHOUTCAST_METAINT - chan->bytes_written_nt;
 				uint32_t second_write = chan->payload_size - first_write;
-				uint16_t bytes = 0;
 				uint16_t written = 0;
-				char streamtitle[STR_BUF_SIZE];
+				/* A single 0 byte if there is no new StreamTitle */
+				static const unsigned char no_metadata = 0;
+				const unsigned char* metadata = &no_metadata;
+				uint16_t metadata_size = 1;
 				/* Only output StreamTitle if it's different or for the first time */
-				if (strcmp(global_state->stream_title, global_state->old_stream_title) != 0) {
-					/* Maximum of 2000 characters! */
-					snprintf(streamtitle, STR_BUF_SIZE - 1, "StreamTitle='%.2000s';", global_state->stream_title);
-					strcpy(global_state->old_stream_title, global_state->stream_title);
-				} else {
-					memset(streamtitle, 0, strlen(global_state->stream_title) + 1);
+				if (global_state->icy_metadata_pending) {
+					metadata = global_state->icy_metadata;
+					metadata_size = global_state->icy_metadata_size;
+					global_state->icy_metadata_pending = 0;
 				}
-				bytes = ((strlen(streamtitle))>>4) + (strlen(streamtitle) > 0?1:0);
-				/* Shift right by 4 bit => Divide by 16, and add 1 to get minimum possible length.
-				 * Add 1 only, if size is > 0, otherwise there is no metadata and therefore nothing to send */
 				if (first_write > 0) {
 					if (! fwrite((char*)chan->buf, first_write, 1, stdout)) {
 						if (ferror(stdout)) {
@@ -1400,10 +1534,8 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 					bytes_written += first_write;
 					chan->bytes_written_nt += first_write;
 				}
-				fwrite(&bytes, 1, 1, stdout);
-				fwrite(streamtitle, bytes<<4, 1, stdout);
-				bytes_written += 1;
-				bytes_written += bytes<<4;
+				fwrite(metadata, metadata_size, 1, stdout);
+				bytes_written += metadata_size;
 				if (second_write > 0) {
 					if (! fwrite((char*)(chan->buf + first_write), second_write, 1, stdout) ) {
 						if (ferror(stdout)) {
@@ -1415,9 +1547,9 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 					}
 					written = second_write;
 					bytes_written += written;
-					/* Reset the Shoutcastcounter */
-					chan->bytes_written_nt = second_write;
 				}
+				/* Reset the Shoutcastcounter */
+				chan->bytes_written_nt = second_write;
 				fflush(stdout);
 			}
 		} else {
@@ -1428,6 +1560,8 @@ int32_t extract_pes_payload( unsigned char *pes_ptr, size_t pes_len, ts2shout_ch
 			bytes_written += chan->payload_size;
 			chan->bytes_written_nt += chan->payload_size;
 		}
+		latency_written(chan->payload_size);
+		latency_milestone(MILESTONE_AUDIO);
 		#endif
 		// Move any remaining memory to the start of the buffer
 		chan->buf_used -= chan->payload_size;
@@ -1450,6 +1584,7 @@ void filter_global_loop(int fd_dvr) {
 	while (! Interrupted ) {
 		bytes_read = read(fd_dvr, buf, TS_PACKET_SIZE);
 		global_state->bytes_streamed_read += bytes_read;
+		latency_ingest();
 		if (bytes_read == 0) {
 			output_logmessage("filter_global_loop: read from stream %.2f MB, wrote %.2f MB, no bytes left to read - EOF. Exiting.\n",
 				(float)global_state->bytes_streamed_read/mb_conversion, (float)global_state->bytes_streamed_write/mb_conversion);
@@ -1535,12 +1670,23 @@ static size_t write_callback(void *contents, size_t size, size_t nmemb, void *us
 	/* process the data we've stored from the last run? */
 	unsigned char * buf = contents;
 
+	latency_ingest();
+
 	/* Do we have to output the HTTP Header? */
 	if (!global_state->output_payload) {
 		/* not all data items were available, check wether they are available now.
 		 * output the header and START playing audio */
-		if (global_state->station_name
-			&& strlen(global_state->station_name) > 0
+		const char* station_name = global_state->station_name;
+		/* Fast start: the audio stream is known, the station name is sent later */
+		if (global_state->faststart
+			&& strlen(station_name) == 0
+			&& global_state->mime_type
+			&& global_state->br > 0
+			&& global_state->sr > 0) {
+			station_name = FASTSTART_STATION_NAME;
+			global_state->station_name_pending = 1;
+		}
+		if (strlen(station_name) > 0
 			&& global_state->br > 0
 			&& global_state->sr > 0) {
 			if (shoutcast) {
@@ -1552,7 +1698,7 @@ static size_t write_callback(void *contents, size_t size, size_t nmemb, void *us
 						"icy-name: %.120s\n" \
 						"icy-metaint: %d\n\n",
 						global_state->mime_type,
-						global_state->br, global_state->sr, global_state->station_name, SHOUTCAST_METAINT);
+						global_state->br, global_state->sr, station_name, SHOUTCAST_METAINT);
 			} else {
 				snprintf(header, STR_BUF_SIZE, "Content-Type: %s\n" \
 						"Connection: close\n\n", global_state->mime_type);
@@ -1560,6 +1706,11 @@ static size_t write_callback(void *contents, size_t size, size_t nmemb, void *us
 			fwrite(header, strlen(header), 1, stdout);
 			fflush(stdout);
 			global_state->output_payload = 1;
+			latency_milestone(MILESTONE_HEADERS);
+			output_logmessage("write_callback(): Headers sent after %.1f ms and %.1f KByte of the stream%s\n",
+				latency_milestone_ms(MILESTONE_HEADERS),
+				(float)global_state->bytes_streamed_read / 1024,
+				(global_state->station_name_pending ? ", station name not yet known" : ""));
 		}
 	}
 
@@ -1678,6 +1829,11 @@ void start_curl_download() {
 	}
 	/* Try to get cached parameters from last session */
 	fetch_cached_parameters(global_state);
+	warm_start_subscribe();
+	/* Without a given service_id the programme of the last session is played */
+	if (global_state->wanted_service_id == 0) {
+		psi_want_service(global_state->warm_start.service_id);
+	}
 
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
@@ -1710,6 +1866,54 @@ void start_curl_download() {
 }
 
 
+/* Real time pacing for filter mode (option "realtime"). When reading a recorded
+ * transport stream from a file or pipe we release the data at the pace given by
+ * the PCR of the audio stream. The first PCR is bound to the monotonic clock,
+ * every further PCR gives the time it is due. Waiting is done with an absolute
+ * sleep, so there is neither busy waiting nor an accumulating error. If PCR and
+ * clock drift too far apart (PCR jump, stalled input) or the discontinuity
+ * indicator is set we start over with a new anchor. */
+#define PCR_MAX_DRIFT_NS 1000000000LL
+/* A PCR has to come at least every 100ms, this many packets without one are reported */
+#define PCR_MISSING_PACKETS 20000
+
+static struct {
+	uint8_t anchored;
+	int64_t pcr;                /* PCR (27 MHz) at the anchor */
+	int64_t last_pcr;           /* last seen PCR */
+	struct timespec clock;      /* monotonic clock at the anchor */
+} pacing;
+
+static void pcr_pacing(int64_t pcr, int discontinuity) {
+	struct timespec now;
+	struct timespec target;
+	int64_t pcr_ns;
+	int64_t elapsed_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (pacing.anchored && ! discontinuity && pcr >= pacing.last_pcr) {
+		pcr_ns = (pcr - pacing.pcr) * 1000 / 27;
+		elapsed_ns = (int64_t)(now.tv_sec - pacing.clock.tv_sec) * 1000000000LL + (now.tv_nsec - pacing.clock.tv_nsec);
+		pacing.last_pcr = pcr;
+		if (pcr_ns - elapsed_ns < PCR_MAX_DRIFT_NS && elapsed_ns - pcr_ns < PCR_MAX_DRIFT_NS) {
+			if (pcr_ns > elapsed_ns) {
+				target.tv_sec = pacing.clock.tv_sec + (pacing.clock.tv_nsec + pcr_ns) / 1000000000LL;
+				target.tv_nsec = (pacing.clock.tv_nsec + pcr_ns) % 1000000000LL;
+				/* Everything up to now is due, give it to the consumer before sleeping */
+				fflush(stdout);
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR && ! Interrupted);
+			}
+			return;
+		}
+		output_logmessage("pcr_pacing: PCR and clock differ by %ld ms, starting over\n", (long)((pcr_ns - elapsed_ns) / 1000000));
+	}
+	pacing.anchored = 1;
+	pacing.pcr = pcr;
+	pacing.last_pcr = pcr;
+	pacing.clock = now;
+	return;
+}
+
 /* This function handles exactly one MPEG TS full frame of 188 bytes. It has to be checked before calling
  * whether a full frame of 188 byte has been received. process_ts_packet has to be called subsequently
  * with every frame, otherwise you'll get an out-of-sync / ts_continuity error */
@@ -1722,6 +1926,7 @@ int16_t process_ts_packet( unsigned char * buf )
 	int32_t streamed = 0;
 
 	frame_count += 1 ;
+	latency_milestone(MILESTONE_PACKET);
 
 	/* If we just only receive packets and have output of payload
 	   (because no audio in stream or whatver) */
@@ -1736,12 +1941,17 @@ int16_t process_ts_packet( unsigned char * buf )
 	// Get the PID of this TS packet
 	pid = TS_PACKET_PID(buf);
 
-	// Transport error?
+	// Transport error? The packet is lost like in a continuity gap, its header can't be trusted
 	if ( TS_PACKET_TRANS_ERROR(buf) ) {
 		if (channel_map[ pid ]) {
-			channel_map[ pid ]->synced = 0;
-			channel_map[ pid ]->buf_used = 0;
+			ts2shout_channel_t *chan = channel_map[ pid ];
+			chan->cc_errors += 1;
+			/* Assume it was the next packet, the following one is not reported as gap again */
+			if (chan->continuity_count >= 0) {
+				chan->continuity_count = (chan->continuity_count + 1) & 0x0f;
+			}
 			output_logmessage("process_ts_packet: Warning, transport error in PID %d.\n", pid);
+			ts_discontinuity(chan);
 		}
 		return TS_SOFT_ERROR;
 	}
@@ -1752,6 +1962,25 @@ int16_t process_ts_packet( unsigned char * buf )
 		return TS_SOFT_ERROR;
 	}
 
+	/* Update PCR? Only the clock of our programme, the PCR_PID out of the PMT or
+	 * until the PMT has been seen the audio stream. It may come in packets without payload */
+	if ( (TS_PACKET_ADAPTATION(buf) & 0x2) && TS_PACKET_ADAPT_LEN(buf) >= 7 && TS_PACKET_ADAPT_PCR(buf)
+		&& channel_map[pid] && (global_state->pcr_pid ? pid == global_state->pcr_pid : channel_map[pid]->channel_type == CHANNEL_TYPE_PAYLOAD) ) {
+		if (global_state->pcr_first == 0) {
+			global_state->pcr_first = TS_PACKET_ADAPT_PCRVALUE(buf);
+			global_state->pcr_current = TS_PACKET_ADAPT_PCRVALUE(buf);
+		} else {
+			global_state->pcr_current = TS_PACKET_ADAPT_PCRVALUE(buf); 
+			global_state->playtime_s = (TS_PACKET_ADAPT_PCRVALUE(buf) - global_state->pcr_first)/(((double)27000000) * (double)(109.1));
+		}
+		if (global_state->realtime) {
+			pcr_pacing(TS_PCR_27MHZ(TS_PACKET_ADAPT_PCRVALUE(buf)), TS_PACKET_ADAPT_DISCONTINUITY(buf));
+		}
+	}
+	if (global_state->realtime && frame_count == PCR_MISSING_PACKETS && global_state->pcr_first == 0) {
+		output_logmessage("process_ts_packet: No PCR in the first %d packets, the output is not paced\n", PCR_MISSING_PACKETS);
+	}
+
 	// Location of and size of PES payload
 	pes_ptr = &buf[4];
 	pes_len = TS_PACKET_SIZE - 4;
@@ -1767,25 +1996,20 @@ int16_t process_ts_packet( unsigned char * buf )
 #ifdef DEBUG
 		fprintf(stderr, "process_ts_packet: Adaption field with length %d found in frame #%ld\n", TS_PACKET_ADAPT_LEN(buf), frame_count);
 #endif
-		/* Update PCR? Only main audio stream */
-		if ( TS_PACKET_ADAPT_PCR(buf) ) {
-			if (channel_map[pid] && channel_map[pid]->channel_type == CHANNEL_TYPE_PAYLOAD) {
-				if (global_state->pcr_first == 0) {
-					global_state->pcr_first = TS_PACKET_ADAPT_PCRVALUE(buf);
-					global_state->pcr_current = TS_PACKET_ADAPT_PCRVALUE(buf);
-				} else {
-					global_state->pcr_current = TS_PACKET_ADAPT_PCRVALUE(buf); 
-					global_state->playtime_s = (TS_PACKET_ADAPT_PCRVALUE(buf) - global_state->pcr_first)/(((double)27000000) * (double)(109.1));
-				}
-			}
-		}
 		pes_ptr += (TS_PACKET_ADAPT_LEN(buf) + 1);
 		pes_len -= (TS_PACKET_ADAPT_LEN(buf) + 1);
 	}
+	// Scheduled switch of the EIT event, new now playing consumers
+	if ((frame_count & 0x3f) == 0) {
+		eit_timer();
+		nowplaying_poll();
+	}
 	// Check we know about the payload
 	if (channel_map[ pid ]) {
-		// Continuity check
-		ts_continuity_check( channel_map[ pid ], TS_PACKET_CONT_COUNT(buf) );
+		// Continuity check, duplicate packets are discarded
+		if (ts_continuity_check( channel_map[ pid ], buf ) == TS_CC_DUPLICATE) {
+			return TS_SOFT_ERROR;
+		}
 		enum_channel_type channel_type = channel_map[ pid ]->channel_type;
 		global_state->ts_sync_error = 0;	/* Reset global ts_sync_error counter */
 		switch (channel_type) {
@@ -1837,6 +2061,7 @@ int main(int argc, char **argv)
 	eit_table = calloc(1, sizeof(section_aggregate_t));
 	sdt_table = calloc(1, sizeof(section_aggregate_t));
 	dsmcc_table = calloc(1, sizeof(section_aggregate_t));
+	latency_milestone(MILESTONE_START);
 	global_state = calloc(1, sizeof(programm_info_t));
 
 	/* Are we running as CGI programme? */
@@ -1861,12 +2086,57 @@ int main(int argc, char **argv)
 		if (getenv("REDIRECT_RDS") && strncmp(getenv("REDIRECT_RDS"), "1", 1) == 0) {
 			global_state->prefer_rds = 1;
 		}
+		if (getenv("LATENCY") && strncmp(getenv("LATENCY"), "1", 1) == 0) {
+			global_state->latency = 1;
+		}
+		if (getenv("REDIRECT_LATENCY") && strncmp(getenv("REDIRECT_LATENCY"), "1", 1) == 0) {
+			global_state->latency = 1;
+		}
+		if (getenv("MULTIPLEX") && strncmp(getenv("MULTIPLEX"), "1", 1) == 0) {
+			global_state->multiplex = 1;
+		}
+		if (getenv("REDIRECT_MULTIPLEX") && strncmp(getenv("REDIRECT_MULTIPLEX"), "1", 1) == 0) {
+			global_state->multiplex = 1;
+		}
+		if (getenv("FASTSTART") && strncmp(getenv("FASTSTART"), "1", 1) == 0) {
+			global_state->faststart = 1;
+		}
+		if (getenv("REDIRECT_FASTSTART") && strncmp(getenv("REDIRECT_FASTSTART"), "1", 1) == 0) {
+			global_state->faststart = 1;
+		}
+		if (getenv("NOWPLAYING")) {
+			global_state->nowplaying = getenv("NOWPLAYING");
+		} else if (getenv("REDIRECT_NOWPLAYING")) {
+			global_state->nowplaying = getenv("REDIRECT_NOWPLAYING");
+		}
+		if (getenv("LOGOURL")) {
+			global_state->logo_url = getenv("LOGOURL");
+		} else if (getenv("REDIRECT_LOGOURL")) {
+			global_state->logo_url = getenv("REDIRECT_LOGOURL");
+		}
+		if (getenv("RDSIDLE")) {
+			global_state->aac_rds_idle = atoi(getenv("RDSIDLE"));
+		} else if (getenv("REDIRECT_RDSIDLE")) {
+			global_state->aac_rds_idle = atoi(getenv("REDIRECT_RDSIDLE"));
+		}
+		if (getenv("SERVICEID")) {
+			global_state->wanted_service_id = atoi(getenv("SERVICEID"));
+		} else if (getenv("REDIRECT_SERVICEID")) {
+			global_state->wanted_service_id = atoi(getenv("REDIRECT_SERVICEID"));
+		}
 	} else {
 		// Parse command line arguments
 		parse_args( argc, argv );
 	}
+	if (global_state->aac_rds_idle == 0) {
+		global_state->aac_rds_idle = AAC_RDS_IDLE_TIMEOUT;
+	}
 	init_structures();
 	init_rds();
+	latency_init(global_state->latency);
+	services_init(global_state->multiplex);
+	psi_want_service(global_state->wanted_service_id);
+	nowplaying_init(global_state->nowplaying);
 
 	output_logmessage("ts2shout version " XSTR(CURRENT_VERSION) " compiled " XSTR(CURRENT_DATE) " started\n");
 	output_logmessage("%s %s in %s mode with%s RDS support.\n",
@@ -1885,6 +2155,9 @@ int main(int argc, char **argv)
 			return -1;
 		}
 		global_state->output_payload = 1;
+		if (global_state->realtime) {
+			output_logmessage("Output is paced in real time using the PCR of the programme.\n");
+		}
 		filter_global_loop( fd_dvr );
 		if (Interrupted) {
 				output_logmessage("Caught signal %d - closing cleanly.\n", Interrupted);
@@ -1902,6 +2175,15 @@ int main(int argc, char **argv)
 			start_curl_download();
 		}
 	}
+	ts_continuity_summary();
+	latency_report();
+	latency_timeline_report(global_state->cgi_mode);
+	services_report();
+	nowplaying_close();
+	close_dsmcc();
+#ifdef FFMPEG
+	aac_rds_close();
+#endif
 	// Clean up
 	for (i=0;i<channel_count;i++) {
 		if (channels[i]->buf) free( channels[i]->buf );
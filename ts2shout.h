@@ -54,10 +54,19 @@
 
 // Standard string buffer size
 #define STR_BUF_SIZE			6000
+
+/* The decoded objects of the DSM-CC carousel, one directory per carousel and module version */
+#define DSMCC_CACHE_DIRECTORY	"/var/tmp/cache"
 #define EIT_BUF_SIZE			5000
 
 /* Shoutcast Interval to next metadata */
 #define SHOUTCAST_METAINT		8192
+#define FASTSTART_STATION_NAME	"ts2shout"	/* icy-name if the headers are sent before the SDT */
+/* A shoutcast metadata block: length byte (in units of 16 bytes) and up to 255*16 bytes metadata */
+#define SHOUTCAST_METADATA_SIZE	(1 + 255 * 16)
+#define SHOUTCAST_TITLE_LENGTH	2000
+/* Artist or title of a song (e.g. from RDS RadioText+) */
+#define TITLE_PART_SIZE			256
 
 /*
 	Macros for accessing MPEG-2 TS packet headers
@@ -72,8 +81,11 @@
 #define TS_PACKET_ADAPTATION(b)		((b[3]&0x30)>>4)
 #define TS_PACKET_CONT_COUNT(b)		((b[3]&0x0F)>>0)
 #define TS_PACKET_ADAPT_LEN(b)		(b[4])
+#define TS_PACKET_ADAPT_DISCONTINUITY(b)	((TS_PACKET_ADAPTATION(b) & 0x2) && (b[4] > 0) && (b[5] & 0x80))
 #define TS_PACKET_ADAPT_PCR(b)		((b[5] & 0x10)>>4)
 #define TS_PACKET_ADAPT_PCRVALUE(b) ((int64_t)( ((int64_t)(b[6]))<<40 | ((int64_t)(b[7]))<<32 | ((int64_t)b[8])<<24 | b[9]<<16 | b[10]<<8 | b[11] ))
+/* PCR value (as given by TS_PACKET_ADAPT_PCRVALUE) in units of 27 MHz: base * 300 + extension */
+#define TS_PCR_27MHZ(v)				((((v) >> 15) * 300) + ((v) & 0x1ff))
 #define TS_PACKET_POINTER(b)		(uint8_t)((((b[1]&0x40)>>6 == 1) && (b[4] < 183))? b[4] : 0)
 
 /*
@@ -202,7 +214,8 @@
 		CHANNEL_TYPE(CHANNEL_TYPE_PMT)  \
 		CHANNEL_TYPE(CHANNEL_TYPE_PAYLOAD) \
 		CHANNEL_TYPE(CHANNEL_TYPE_RDS) \
-		CHANNEL_TYPE(CHANNEL_TYPE_DSMCC)
+		CHANNEL_TYPE(CHANNEL_TYPE_DSMCC) \
+		CHANNEL_TYPE(CHANNEL_TYPE_PCR)
 
 #define GENERATE_ENUM(ENUM) ENUM,
 #define GENERATE_STRING(STRING) #STRING,
@@ -233,12 +246,6 @@ typedef enum {
 	DSMCC_STREAM            /* This stream is a DSMCC data stream */
 } enum_audio_checks;
 
-typedef enum {
-	CHARSET_LATIN1	= 5,
-	CHARSET_COMPLEX = 0x10,
-	CHARSET_UTF8	= 0x15
-} enum_charset;
-
 /* An enum to select best quality audio */
 typedef enum {
 	AUDIO_PREFERENCE_LOW    = 0x100,
@@ -254,6 +261,15 @@ typedef struct audio_quality_s {
 	enum_stream_type stream_type;
 } audio_quality_t;
 
+/* The PSI layout of a programme as found in PAT and PMT, PIDs are 0 if there is no such stream */
+typedef struct stream_layout_s {
+	uint16_t transport_stream_id;
+	uint16_t service_id;
+	uint16_t payload_pid;
+	uint16_t rds_pid;
+	uint16_t dsmcc_pid;
+} stream_layout_t;
+
 
 /* Structure containing single channel */
 typedef struct ts2shout_channel_s {
@@ -262,7 +278,12 @@ typedef struct ts2shout_channel_s {
 
 	enum_channel_type channel_type;	// Channel Type (MPEG / PMT / whatever)
 
-	int continuity_count;	// TS packet continuity counter
+	int continuity_count;	// TS packet continuity counter (expected value of the next packet)
+	uint32_t cc_duplicates;	// Number of duplicate packets (discarded)
+	uint32_t cc_gaps;		// Number of continuity errors (packets missing)
+	uint32_t cc_lost;		// Number of lost packets (modulo 16 per gap, so a lower bound)
+	uint32_t cc_errors;		// Number of packets with transport error indicator (discarded)
+	uint8_t speculative;	// Subscribed from the tuning cache, not yet confirmed by the PMT
 
 	/* Only relevant for the payload stream */
 	int pes_stream_id;		// PES stream ID
@@ -270,6 +291,7 @@ typedef struct ts2shout_channel_s {
 	unsigned long pes_ts;	// Timestamp for current PES packet
 	mpa_header_t mpah;		// Parsed MPEG audio header
 	int synced;				// Have MPA sync?
+	int resync;				// Packets were lost, skip data up to the next frame header
 	uint32_t  bytes_written_nt; // Bytes written (count the 8192 Bytes to next StreamTitle inside shoutcast)
 	uint8_t * buf;			// MPEG Audio Buffer (with 4 nulls bytes)
 	uint8_t * buf_ptr;		// Pointer to start of audio data
@@ -298,25 +320,41 @@ typedef struct programm_info_s {
 	uint8_t	cache_written;              /* cache written in current session */
 	char station_name[STR_BUF_SIZE];    /* Name of station (normally only a few bytes) */
 	char stream_title[STR_BUF_SIZE];    /* StreamTitle for shoutcast stream */
-	char old_stream_title[STR_BUF_SIZE]; /* Old StreamTitle, that was given in last session */
+	char stream_artist[TITLE_PART_SIZE]; /* Artist of the StreamTitle, if known */
+	char stream_song[TITLE_PART_SIZE];  /* Song title of the StreamTitle, if known */
+	unsigned char icy_metadata[SHOUTCAST_METADATA_SIZE]; /* prebuilt shoutcast metadata block of stream_title */
+	uint16_t icy_metadata_size;         /* size of icy_metadata including the length byte */
+	uint8_t icy_metadata_pending;       /* icy_metadata not yet sent to the listener */
+	char stream_logo[STR_BUF_SIZE];     /* Station logo from the DSM-CC carousel, relative to DSMCC_CACHE_DIRECTORY */
 	uint32_t br;                        /* Bitrate of stream e.g. 320000 kBit/s	*/
 	uint32_t sr;                        /* Streamrate of stream e.g. 48 kHz == 48000 Hz */
 	uint64_t bytes_streamed_read;       /* Total bytes read from stream */
 	uint64_t bytes_streamed_write;      /* Total bytes write to stdout/streamed to application/CGI */
 	uint16_t ts_sync_error;             /* Total global number of sync errors */
 	uint16_t service_id;                /* The service_id, aka program_id */
+	uint16_t wanted_service_id;         /* The service_id to be played out of a multi programme stream (0 = lowest with audio) */
 	char *programme;                    /* the environment variable PROGRAMMNO (no hassling arround with REDIRECT_ ) */
 	uint8_t	want_ac3;                   /* do we want AC-3 output */
 	uint8_t prefer_rds;                 /* do we prefer RDS  - instead of EPG? (only if there is RDS) */
 	uint8_t found_rds;                  /* We found RDS, don't use EIT any longer */
 	uint16_t transport_stream_id;       /* The transport stream id of the wanted programm stream (important for EIT/SDT scan) */
 	enum_stream_type stream_type;       /* The type of transport stream (abstract), fetch from PAT/PMT */
+	stream_layout_t warm_start;         /* PSI layout of the last session from the tuning cache */
 	const char * mime_type;             /* The MIME type (e.g. audio/mpeg) of the current stream (indirect from PAT/PMT) */
 	uint64_t pcr_first;                  /* PCR, first found program clock reference in *used* audio PAYLOAD stream */
 	uint64_t pcr_current;				/* PCR current */
+	uint16_t pcr_pid;                   /* PCR_PID of the programme from the PMT, 0 = not known yet (the audio PID is used) */
 	uint32_t playtime_s;                /* current playtime in stream, calculated out of PCR stamps, useful for manual filtering */
 	int8_t cgi_mode;                    /* Are we running as CGI programme? This is set if there is QUERY_STRING set in the environment */
 	uint8_t aac_inline_rds;             /* set if AAC inline RDS is possible */
+	uint32_t aac_rds_idle;              /* seconds without inline RDS until the FFmpeg decoder is torn down */
+	uint8_t realtime;                   /* Filter mode: pace the output in real time using the PCR */
+	uint8_t latency;                    /* Measure the latency from packet arrival to audio output */
+	uint8_t multiplex;                  /* Collect station names and titles of all services in the multiplex */
+	uint8_t faststart;                  /* CGI mode: send the headers as soon as the audio stream is known */
+	uint8_t station_name_pending;       /* The headers were sent before the SDT, the station name follows as StreamTitle */
+	char *nowplaying;                   /* Unix socket for now playing events (NULL = disabled) */
+	char *logo_url;                     /* URL of DSMCC_CACHE_DIRECTORY for the StreamUrl (NULL = no StreamUrl) */
     avcodec_buffers_t ffmpeg;           /* ffmpeg library access for decoding AAC-embedded RDS */
 } programm_info_t;
 
@@ -330,6 +368,7 @@ typedef struct section_aggregate_s {
 	uint8_t		buffer[EIT_BUF_SIZE];
 	uint8_t		offset_buffer[TS_PACKET_SIZE]; /* A buffer for continued tables */
 	uint8_t		ob_used;			/* Pointer wether the offset_buffer is used */
+	uint8_t		skip;				/* The section is not wanted, its continuation packets are skipped */
 } section_aggregate_t;
 
 /* crc32.c */
@@ -348,6 +387,11 @@ extern ts2shout_channel_t *channels[MAX_CHANNEL_COUNT];
  * appropriate log message. TODO: Handle the SOFT_ERROR */
 #define TS_SOFT_ERROR -1
 #define TS_HARD_ERROR -2
+
+/* Results of the continuity counter check */
+#define TS_CC_OK 0
+#define TS_CC_DUPLICATE 1
+#define TS_CC_DISCONTINUITY 2
 int16_t process_ts_packet(unsigned char *buf);
 
 /* In pes.c */
@@ -363,12 +407,19 @@ const char* mime_type(enum_stream_type stream_type);
 /* Get AAC profile */
 const char* aac_profile_name(uint8_t profile_and_level);
 
-unsigned char *utf8(unsigned char* in, unsigned char* out);
 
+/* Set a new StreamTitle, returns 1 if the title has changed */
+int set_stream_title(const char* title);
+/* Set a new StreamTitle "artist - title" and remember both parts */
+int set_stream_title_parts(const char* artist, const char* title);
+/* Set the station logo (path relative to DSMCC_CACHE_DIRECTORY, "" if there is none) */
+int set_stream_logo(const char* path);
 void add_cache(programm_info_t* global_state);
 void fetch_cached_parameters(programm_info_t* global_state);
 
 /* In dsmcc.c */
 void handle_dsmcc_message(unsigned char *buf, size_t len);
+int dsmcc_section_wanted(unsigned char *buf);
+void close_dsmcc();
 
 #endif
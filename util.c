@@ -31,17 +31,59 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 
 #include "ts2shout.h"
+#include "nowplaying.h"
 
 #define CACHE_FILENAME "/var/tmp/ts2shout.cache"
+#define CACHE_MAGIC "ts2shc04"
+/* Number of records, probed slots on a collision and read attempts of a record */
+#define CACHE_RECORDS 512
+#define CACHE_PROBES 8
+#define CACHE_READ_RETRIES 64
+/* A record odd for longer (seconds) has lost its writer, e.g. by SIGKILL */
+#define CACHE_WRITE_TIMEOUT 2
+/* A title of the last session is shown at tune-in if it is not older (seconds) */
+#define CACHE_TITLE_RDS_MAX_AGE 300
+#define CACHE_TITLE_EIT_MAX_AGE 1800
+
+/* One record of the tuning cache, the sequence counter has to be the first member */
+typedef struct tuning_cache_record_s {
+	_Atomic uint64_t seq;               /* odd while a writer changes the record, then the upper 32 bits are the time it started */
+	uint32_t hash;                      /* hash of programme and want_ac3, 0 = empty slot */
+	uint32_t br;
+	uint32_t sr;
+	uint8_t want_ac3;
+	uint8_t stream_type;
+	stream_layout_t layout;             /* PAT/PMT layout for the warm start */
+	char programme[128];
+	char station_name[256];
+	int64_t title_time;                 /* time of the last title change */
+	uint8_t title_rds;                  /* the title was sent by RDS, else it is from EIT */
+	char title[512];                    /* last known StreamTitle */
+} tuning_cache_record_t;
+
+typedef struct tuning_cache_s {
+	char magic[8];
+	tuning_cache_record_t record[CACHE_RECORDS];
+} tuning_cache_t;
+
+extern programm_info_t *global_state;
 
 
 static const char *channel_type_name[] = {
     FOREACH_CHANNEL_TYPE(GENERATE_STRING)
 };
 
+static void cache_store_title();
+
 static const char *mime_type_string[] = { 	"none", "audio/mpeg", "audio/aac", "audio/aacp", "audio/ac3" };
 
 /* initialize the structure after allocating memory for it */
@@ -142,121 +184,435 @@ const char* aac_profile_name(uint8_t profile_and_level) {
 	return profile_name;
 }
 
-/* from https://stackoverflow.com/questions/4059775/convert-iso-8859-1-strings-to-utf-8-in-c-c */
-unsigned char *utf8(unsigned char *in, unsigned char *out) {
-	uint32_t counter = 0;
-	unsigned char *outstart = out;
-	while (*in && counter+2 < STR_BUF_SIZE) {
-	    if (*in<128) {
-			*out++=*in++;
-			counter++;
+/* Build the shoutcast metadata block once, so the output only has to send
+ * it on the next SHOUTCAST_METAINT boundary */
+static void icy_metadata_update() {
+	size_t length;
+	size_t limit;
+	int url_length;
+	/* Maximum of 2000 bytes, but don't cut an UTF-8 sequence */
+	limit = strlen(global_state->stream_title);
+	if (limit > SHOUTCAST_TITLE_LENGTH) {
+		limit = SHOUTCAST_TITLE_LENGTH;
+		while (limit > 0 && (global_state->stream_title[limit] & 0xc0) == 0x80) {
+			limit--;
+		}
+	}
+	memset(global_state->icy_metadata, 0, SHOUTCAST_METADATA_SIZE);
+	length = snprintf((char*)global_state->icy_metadata + 1, SHOUTCAST_METADATA_SIZE - 1, "StreamTitle='%.*s';",
+		(int)limit, global_state->stream_title);
+	if (global_state->logo_url && global_state->stream_logo[0] != 0 && length < SHOUTCAST_METADATA_SIZE - 1) {
+		url_length = snprintf((char*)global_state->icy_metadata + 1 + length, SHOUTCAST_METADATA_SIZE - 1 - length, "StreamUrl='%s/%s';",
+			global_state->logo_url, global_state->stream_logo);
+		/* A cut StreamUrl would break the block, leave it out */
+		if (url_length > 0 && (size_t)url_length < SHOUTCAST_METADATA_SIZE - 1 - length) {
+			length += url_length;
 		} else {
-			*out++=0xc2+(*in>0xbf), *out++=(*in++&0x3f)+0x80;
-			counter += 2;
+			memset(global_state->icy_metadata + 1 + length, 0, SHOUTCAST_METADATA_SIZE - 1 - length);
 		}
 	}
-	*out = 0;
-	return outstart;
+	/* Divide by 16 and round up, the remaining bytes are padded with 0 */
+	global_state->icy_metadata[0] = (length + 15) >> 4;
+	global_state->icy_metadata_size = 1 + (global_state->icy_metadata[0] << 4);
+	global_state->icy_metadata_pending = 1;
+	return;
 }
-	
-void add_cache(programm_info_t *global_state) {
-	/* the existing cache file, name given in define CACHE_FILENAME */
-	int cachefd = 0;
-	FILE* CACHEFILE = NULL;
-	/* a new temporary file with unique name to be renamed to be later the new cache */
-	int tempfd = 0;
-	FILE * TEMPFILE = NULL;
-	
-	char *tempname = NULL;
-	/* for reading with getline */
-	size_t t = 0;
-	char *gptr = NULL;
-	int linesize = 0;
-
-	/* Generate temporary file */
-	tempname = alloca(sizeof(CACHE_FILENAME) + 8); /* Trailing \0 character */
-	strcpy(tempname, CACHE_FILENAME ".XXXXXX");
-	tempfd = mkstemp(tempname);
-	if (tempfd <= 0) {
-		output_logmessage("add_cache() warning: Cannot create temporary file %s (ignored): %s\n", tempname, strerror(errno));
-		return;
+
+/* Store the StreamTitle, returns 1 if it has changed */
+static int stream_title_update(const char* title) {
+	if (strcmp(title, global_state->stream_title) == 0) {
+		return 0;
+	}
+	snprintf(global_state->stream_title, STR_BUF_SIZE, "%s", title);
+	global_state->stream_artist[0] = 0;
+	global_state->stream_song[0] = 0;
+	icy_metadata_update();
+	cache_store_title();
+	return 1;
+}
+
+int set_stream_title(const char* title) {
+	if (! stream_title_update(title)) {
+		return 0;
 	}
-	fchmod(tempfd, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
-	TEMPFILE = fdopen(tempfd, "w");
-	fprintf(TEMPFILE, "# programmno\tbitrate\tstreamrate\tac-3?\tstation_name\tstream_type\n");
-	fprintf(TEMPFILE, "%s\t%d\t%d\t%d\t%s\t%d\n",
-		global_state->programme,
-		global_state->br,
-		global_state->sr,
-		global_state->want_ac3,
-		global_state->station_name,
-		global_state->stream_type);
-	/* Try to open old file */
-	cachefd = open(CACHE_FILENAME, O_RDONLY);
-	if (cachefd < 0) {
-		output_logmessage("add_cache() warning: Cannot open cache file %s (trying to create): %s\n", CACHE_FILENAME, strerror(errno));
+	nowplaying_publish();
+	return 1;
+}
+
+int set_stream_title_parts(const char* artist, const char* title) {
+	char stream_title[STR_BUF_SIZE];
+	if (artist[0] != 0 && title[0] != 0) {
+		snprintf(stream_title, STR_BUF_SIZE, "%s - %s", artist, title);
 	} else {
-		int ac3 = 0;
-		CACHEFILE = fdopen(cachefd, "r");
-		/* Search for line starting with programme */
-		while( (linesize = getline(&gptr, &t, CACHEFILE)) > 0) {
-			sscanf(gptr, "%*[^\t]\t%*d\t%*d\t%d\t%*s\t%*d", &ac3);
-			if ( (!global_state->programme)
-				|| (strncmp(global_state->programme, gptr, strlen(global_state->programme)) != 0)
-				|| (ac3 != global_state->want_ac3 )
-				)  {
-				/* not equal, and not top line */
-				if (strncmp("# programmno", gptr, strlen("# programmno")) != 0) {
-					fprintf(TEMPFILE, "%s", gptr);
-				}
-			} else {
-				/* done after reading everything */
+		snprintf(stream_title, STR_BUF_SIZE, "%s", (title[0] != 0) ? title : artist);
+	}
+	if (! stream_title_update(stream_title)) {
+		return 0;
+	}
+	snprintf(global_state->stream_artist, TITLE_PART_SIZE, "%s", artist);
+	snprintf(global_state->stream_song, TITLE_PART_SIZE, "%s", title);
+	nowplaying_publish();
+	return 1;
+}
+
+int set_stream_logo(const char* path) {
+	if (strcmp(path, global_state->stream_logo) == 0) {
+		return 0;
+	}
+	snprintf(global_state->stream_logo, STR_BUF_SIZE, "%s", path);
+	if (global_state->logo_url) {
+		icy_metadata_update();
+	}
+	nowplaying_publish();
+	return 1;
+}
+
+/* The tuning cache is a file of fixed size records, mapped into every
+ * process. The home slot of a programme is given by a hash over the
+ * programme and the AC-3 preference, collisions are resolved by probing
+ * the next CACHE_PROBES slots. Every record carries its own sequence
+ * counter: a writer makes it odd, changes the record in place and makes it
+ * even again, a reader retries if the counter was odd or has changed while
+ * it copied the record. No locks, no temporary files, no parsing. A writer
+ * killed in between leaves the record odd, after CACHE_WRITE_TIMEOUT the
+ * next writer takes it over. */
+
+/* Get the mapping of the cache file, create or replace it if necessary */
+static tuning_cache_t* cache_map() {
+	static tuning_cache_t *cache = NULL;
+	static int tried = 0;
+	struct stat st;
+	int fd = -1;
+	int prot = PROT_READ|PROT_WRITE;
+	int old_fd = -1;
+	int result;
+
+	if (tried) {
+		return cache;
+	}
+	tried = 1;
+	fd = open(CACHE_FILENAME, O_RDWR);
+	if (fd < 0 && errno == EACCES) {
+		/* We can still use a cache somebody else writes */
+		fd = open(CACHE_FILENAME, O_RDONLY);
+		prot = PROT_READ;
+	}
+	if (fd >= 0) {
+		if (fstat(fd, &st) < 0) {
+			output_logmessage("cache_map() warning: Cannot stat cache file %s (ignored): %s\n", CACHE_FILENAME, strerror(errno));
+			close(fd);
+			return NULL;
+		}
+		if (st.st_size == sizeof(tuning_cache_t)) {
+			cache = mmap(NULL, sizeof(tuning_cache_t), prot, MAP_SHARED, fd, 0);
+			if (cache == MAP_FAILED) {
+				output_logmessage("cache_map() warning: Cannot map cache file %s (ignored): %s\n", CACHE_FILENAME, strerror(errno));
+				close(fd);
+				cache = NULL;
+				return NULL;
+			}
+			if (memcmp(cache->magic, CACHE_MAGIC, sizeof(cache->magic)) == 0) {
+				close(fd);
+				return cache;
 			}
+			munmap(cache, sizeof(tuning_cache_t));
+			cache = NULL;
 		}
+		/* Old text cache or a different layout, kept open to lock it while replacing */
+		old_fd = fd;
 	}
-	fclose(TEMPFILE);
-	if (rename(tempname, CACHE_FILENAME) < 0) {
-		output_logmessage("add_cache() warning: Cannot rename %s to %s: %s (removing %s anyway)\n", tempname, CACHE_FILENAME, strerror(errno), tempname);
+	if (prot == PROT_READ) {
+		if (old_fd >= 0) {
+			close(old_fd);
+		}
+		return NULL;
+	}
+	{
+		/* Generate a new empty cache and put it in place, concurrent
+		 * processes either see the old or the complete new file. A new
+		 * cache file is linked, so only the first of several processes
+		 * creating it succeeds. An old file is replaced under its lock
+		 * by the first one only. Everybody maps the file the name points
+		 * to afterwards, not the own temporary one */
+		char tempname[] = CACHE_FILENAME ".XXXXXX";
+		fd = mkstemp(tempname);
+		if (fd < 0) {
+			output_logmessage("cache_map() warning: Cannot create temporary file %s (ignored): %s\n", tempname, strerror(errno));
+			if (old_fd >= 0) {
+				close(old_fd);
+			}
+			return NULL;
+		}
+		fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+		if (ftruncate(fd, sizeof(tuning_cache_t)) < 0
+			|| write(fd, CACHE_MAGIC, sizeof(cache->magic)) != sizeof(cache->magic)) {
+			result = -1;
+		} else if (old_fd >= 0) {
+			struct stat current;
+			/* Unless another process has replaced it meanwhile */
+			result = flock(old_fd, LOCK_EX);
+			if (result == 0 && stat(CACHE_FILENAME, &current) == 0
+				&& current.st_dev == st.st_dev && current.st_ino == st.st_ino) {
+				result = rename(tempname, CACHE_FILENAME);
+			}
+			close(old_fd);
+		} else {
+			result = link(tempname, CACHE_FILENAME);
+			if (result < 0 && errno == EEXIST) {
+				/* Another process was faster, use its file */
+				result = 0;
+			}
+		}
+		if (result < 0) {
+			output_logmessage("cache_map() warning: Cannot create cache file %s (ignored): %s\n", CACHE_FILENAME, strerror(errno));
+		}
+		close(fd);
 		unlink(tempname);
+		if (result < 0) {
+			return NULL;
+		}
+		fd = open(CACHE_FILENAME, O_RDWR);
+		if (fd < 0 || fstat(fd, &st) < 0 || st.st_size != sizeof(tuning_cache_t)) {
+			output_logmessage("cache_map() warning: Cache file %s replaced meanwhile (ignored)\n", CACHE_FILENAME);
+			if (fd >= 0) {
+				close(fd);
+			}
+			return NULL;
+		}
+		cache = mmap(NULL, sizeof(tuning_cache_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (cache == MAP_FAILED) {
+			output_logmessage("cache_map() warning: Cannot map cache file %s (ignored): %s\n", CACHE_FILENAME, strerror(errno));
+			cache = NULL;
+		} else if (memcmp(cache->magic, CACHE_MAGIC, sizeof(cache->magic)) != 0) {
+			output_logmessage("cache_map() warning: Cache file %s replaced meanwhile (ignored)\n", CACHE_FILENAME);
+			munmap(cache, sizeof(tuning_cache_t));
+			cache = NULL;
+		}
 	}
-	if (gptr) {
-		free(gptr);
+	return cache;
+}
+
+/* FNV-1a over programme and AC-3 preference, never 0 (0 marks an empty slot) */
+static uint32_t cache_hash(const char *programme, uint8_t want_ac3) {
+	uint32_t hash = 2166136261u;
+	while (*programme) {
+		hash = (hash ^ (uint8_t)*programme++) * 16777619u;
 	}
+	hash = (hash ^ want_ac3) * 16777619u;
+	return hash ? hash : 1;
+}
+
+/* Copy a consistent snapshot of a record, returns 0 if a writer was too busy */
+static int cache_read_record(tuning_cache_record_t *record, tuning_cache_record_t *copy) {
+	int retry;
+	for (retry = 0; retry < CACHE_READ_RETRIES; retry++) {
+		uint64_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+		if (seq & 1) {
+			continue;
+		}
+		memcpy((char*)copy + sizeof(copy->seq), (char*)record + sizeof(record->seq), sizeof(*copy) - sizeof(copy->seq));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&record->seq, memory_order_relaxed) == seq) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Has the writer of a record died while it changed the record? */
+static int cache_record_abandoned(tuning_cache_record_t *record) {
+	uint64_t seq = atomic_load_explicit(&record->seq, memory_order_relaxed);
+	return ((seq & 1) && (uint32_t)time(NULL) - (uint32_t)(seq >> 32) > CACHE_WRITE_TIMEOUT);
+}
+
+/* Find the slot of a programme, or (want_free) a slot to store it into */
+static tuning_cache_record_t* cache_slot(tuning_cache_t *cache, const char* programme, uint8_t want_ac3, uint32_t hash, int want_free) {
+	int i;
+	tuning_cache_record_t copy;
+	for (i = 0; i < CACHE_PROBES; i++) {
+		tuning_cache_record_t *record = &cache->record[(hash + i) % CACHE_RECORDS];
+		if (! cache_read_record(record, &copy)) {
+			/* The content of an abandoned record is useless */
+			if (want_free && cache_record_abandoned(record)) {
+				return record;
+			}
+			continue;
+		}
+		if (copy.hash == hash && copy.want_ac3 == want_ac3
+			&& strncmp(copy.programme, programme, sizeof(copy.programme)) == 0) {
+			return record;
+		}
+		if (want_free && copy.hash == 0) {
+			return record;
+		}
+	}
+	/* All probed slots are taken by other programmes, reuse the home slot */
+	return want_free ? &cache->record[hash % CACHE_RECORDS] : NULL;
+}
+
+/* Write a record in place, but only if anything has changed */
+static void cache_write_record(tuning_cache_record_t *record, tuning_cache_record_t *entry) {
+	tuning_cache_record_t copy;
+	sigset_t all_signals;
+	sigset_t old_signals;
+	uint64_t seq = 0;
+	uint32_t counter;
+	/* Nothing changed, nothing to write */
+	if (cache_read_record(record, &copy)
+		&& memcmp((char*)&copy + sizeof(copy.seq), (char*)entry + sizeof(entry->seq), sizeof(*entry) - sizeof(entry->seq)) == 0) {
+		return;
+	}
+	/* Take the record, if another process is writing it we leave it to that
+	 * one. A record its writer has abandoned is taken over, the counter stays
+	 * odd so that readers keep away. */
+	seq = atomic_load_explicit(&record->seq, memory_order_relaxed);
+	if ((seq & 1) && ! cache_record_abandoned(record)) {
+		return;
+	}
+	counter = (uint32_t)seq + ((seq & 1) ? 2 : 1);
+	/* Signals could end the process with the record odd */
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	if (atomic_compare_exchange_strong_explicit(&record->seq, &seq, ((uint64_t)(uint32_t)time(NULL) << 32) | counter,
+			memory_order_acquire, memory_order_relaxed)) {
+		atomic_thread_fence(memory_order_release);
+		memcpy((char*)record + sizeof(record->seq), (char*)entry + sizeof(entry->seq), sizeof(*entry) - sizeof(entry->seq));
+		atomic_store_explicit(&record->seq, (uint32_t)(counter + 1), memory_order_release);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
 	return;
 }
 
-void fetch_cached_parameters(programm_info_t *global_state) {
-	FILE* CACHEFILE = NULL;
-	/* für getline */
-	size_t t = 0;
-	char *gptr = NULL;
-	int linesize = 0;
-	int ac3 = 0;
-	if (! global_state->programme) {
+/* Put the current StreamTitle into a record, the time only changes with the title */
+static void cache_title(tuning_cache_record_t *entry) {
+	char title[sizeof(entry->title)];
+	memset(title, 0, sizeof(title));
+	/* Titles are cut at the limit of the record, like station names */
+	memcpy(title, global_state->stream_title, strnlen(global_state->stream_title, sizeof(title) - 1));
+	if (memcmp(title, entry->title, sizeof(title)) != 0) {
+		memcpy(entry->title, title, sizeof(title));
+		entry->title_time = time(NULL);
+		entry->title_rds = global_state->found_rds;
+	}
+	return;
+}
+
+void add_cache(programm_info_t *global_state) {
+	tuning_cache_t *cache = NULL;
+	tuning_cache_record_t *record = NULL;
+	tuning_cache_record_t entry, copy;
+	int i;
+
+	if ( (! global_state->programme)
+		|| strlen(global_state->programme) >= sizeof(entry.programme) ) {
 		return;
 	}
-	CACHEFILE = fopen(CACHE_FILENAME, "r");
-	if (! CACHEFILE) {
+	cache = cache_map();
+	if (! cache) {
 		return;
 	}
-	while( (linesize = getline(&gptr, &t, CACHEFILE)) > 0) {
-		if (strncmp(global_state->programme, gptr, strlen(global_state->programme)) == 0) {
-			/* a maximum of 600 characters is absolutly ok and fits into STR_BUF_SIZE */
-			sscanf(gptr, "%600[^\t]\t%d\t%d\t%d\t%600[^\t]\t%d[^\n]", global_state->programme, &global_state->br, &global_state->sr, &ac3, global_state->station_name, (int*)&global_state->stream_type);
-			if (global_state->want_ac3 == ac3 && global_state->stream_type > 0 ) {
-				global_state->mime_type = mime_type(global_state->stream_type);
-				output_logmessage("fetch_cached_parameters(): found parameters for programme %s\n", global_state->programme);
-				break;
-			} else {
-				/* reset, because it's not complete or the wrong line if ac3 state is not the same or stream_type is 0 */
-				global_state->sr = 0; global_state->br = 0;
-				strcpy(global_state->station_name, "");
-			}
+	memset(&entry, 0, sizeof(entry));
+	entry.hash = cache_hash(global_state->programme, global_state->want_ac3);
+	entry.br = global_state->br;
+	entry.sr = global_state->sr;
+	entry.want_ac3 = global_state->want_ac3;
+	entry.stream_type = global_state->stream_type;
+	strcpy(entry.programme, global_state->programme);
+	entry.layout.transport_stream_id = global_state->transport_stream_id;
+	entry.layout.service_id = global_state->service_id;
+	for (i = 0; i < channel_count; i++) {
+		if (channels[i]->speculative || channel_map[channels[i]->pid] != channels[i]) {
+			continue;
+		}
+		if (channels[i]->channel_type == CHANNEL_TYPE_PAYLOAD) {
+			entry.layout.payload_pid = channels[i]->pid;
+		} else if (channels[i]->channel_type == CHANNEL_TYPE_RDS) {
+			entry.layout.rds_pid = channels[i]->pid;
+		} else if (channels[i]->channel_type == CHANNEL_TYPE_DSMCC) {
+			entry.layout.dsmcc_pid = channels[i]->pid;
 		}
 	}
-	if (gptr) {
-		free(gptr);
+	/* Longer station names are cut, they are never that long in practice */
+	memcpy(entry.station_name, global_state->station_name,
+		strnlen(global_state->station_name, sizeof(entry.station_name) - 1));
+
+	record = cache_slot(cache, global_state->programme, global_state->want_ac3, entry.hash, 1);
+	if (cache_read_record(record, &copy) && copy.hash == entry.hash
+		&& strcmp(copy.programme, entry.programme) == 0) {
+		/* Keep the last title until this session has one */
+		entry.title_time = copy.title_time;
+		entry.title_rds = copy.title_rds;
+		memcpy(entry.title, copy.title, sizeof(entry.title));
+	}
+	if (global_state->stream_title[0] != 0) {
+		cache_title(&entry);
 	}
-	fclose(CACHEFILE);
+	cache_write_record(record, &entry);
 	return;
-};
+}
+
+/* Update the title of our record on every change of the StreamTitle. The
+ * record is only there after add_cache() has written it */
+static void cache_store_title() {
+	tuning_cache_t *cache = NULL;
+	tuning_cache_record_t *record = NULL;
+	tuning_cache_record_t entry;
+
+	if ( (! global_state->cgi_mode) || (! global_state->cache_written)
+		|| global_state->stream_title[0] == 0 ) {
+		return;
+	}
+	cache = cache_map();
+	if (! cache) {
+		return;
+	}
+	record = cache_slot(cache, global_state->programme, global_state->want_ac3,
+		cache_hash(global_state->programme, global_state->want_ac3), 0);
+	if (! record || ! cache_read_record(record, &entry)) {
+		return;
+	}
+	cache_title(&entry);
+	cache_write_record(record, &entry);
+	return;
+}
+
+void fetch_cached_parameters(programm_info_t *global_state) {
+	tuning_cache_t *cache = NULL;
+	tuning_cache_record_t *record = NULL;
+	tuning_cache_record_t copy;
+	uint32_t hash = 0;
+
+	if ( (! global_state->programme)
+		|| strlen(global_state->programme) >= sizeof(copy.programme) ) {
+		return;
+	}
+	cache = cache_map();
+	if (! cache) {
+		return;
+	}
+	hash = cache_hash(global_state->programme, global_state->want_ac3);
+	record = cache_slot(cache, global_state->programme, global_state->want_ac3, hash, 0);
+	if (! record || ! cache_read_record(record, &copy)
+		|| copy.hash != hash || copy.stream_type == 0) {
+		return;
+	}
+	global_state->br = copy.br;
+	global_state->sr = copy.sr;
+	global_state->stream_type = copy.stream_type;
+	snprintf(global_state->station_name, STR_BUF_SIZE, "%s", copy.station_name);
+	global_state->mime_type = mime_type(global_state->stream_type);
+	global_state->warm_start = copy.layout;
+	/* Show the title of the last session until EIT or RDS tell us better */
+	if (copy.title[0] != 0) {
+		int64_t age = time(NULL) - copy.title_time;
+		if (age >= 0 && age <= (copy.title_rds ? CACHE_TITLE_RDS_MAX_AGE : CACHE_TITLE_EIT_MAX_AGE)) {
+			copy.title[sizeof(copy.title) - 1] = 0;
+			set_stream_title(copy.title);
+			output_logmessage("fetch_cached_parameters(): %s title of the last session (%d s ago): %s\n",
+				(copy.title_rds ? "RDS" : "EIT"), (int)age, copy.title);
+		}
+	}
+	output_logmessage("fetch_cached_parameters(): found parameters for programme %s\n", global_state->programme);
+	return;
+}